@@ -0,0 +1,38 @@
+# JSON.dump throughput on many small API-style responses, where the
+# per-call setup and the copy into the result string dominate.
+
+def bench_dump(label, obj)
+  bytes = JSON.dump(obj).bytesize
+  ops = 0
+  timer = Chrono::Timer.new
+  while timer.elapsed < 1.0
+    yield
+    ops += 1
+  end
+  elapsed = timer.elapsed
+  puts "#{label.ljust(30)}: #{(ops / elapsed).round(0)} dumps/sec, " \
+       "#{((bytes * ops).to_f / elapsed / 1_000_000_000).round(3)} GBps"
+end
+
+response = {
+  "status" => "ok",
+  "user" => { "id" => 42, "name" => "alice", "email" => "alice@example.com", "admin" => false },
+  "items" => Array.new(20) { |i| { "id" => i, "title" => "item #{i}", "price" => i * 1.25 } }
+}
+sym_response = {
+  status: "ok",
+  user: { id: 42, name: "alice", email: "alice@example.com", admin: false },
+  items: Array.new(20) { |i| { id: i, title: "item #{i}", price: i * 1.25 } }
+}
+int_keys = Hash[Array.new(100) { |i| [i, i] }]
+buffer = String.new
+strings = Array.new(50) { |i| ("value #{i} " + "x" * 100_000).freeze }
+texts = Array.new(50) { |i| ("wert #{i} " + "ä" * 50_000).freeze }
+
+bench_dump("JSON.dump", response) { JSON.dump(response) }
+bench_dump("JSON.dump(into: buffer)", response) { JSON.dump(response, into: buffer) }
+bench_dump("Hash#to_json", response) { response.to_json }
+bench_dump("symbol keys", sym_response) { JSON.dump(sym_response) }
+bench_dump("integer keys", int_keys) { JSON.dump(int_keys) }
+bench_dump("100 KB ASCII strings", strings) { JSON.dump(strings) }
+bench_dump("100 KB UTF-8 strings (frozen)", texts) { JSON.dump(texts) }
@@ -0,0 +1,24 @@
+# JSON.dump of arrays of large IDs: unsigned 64-bit values above INT64_MAX,
+# which mruby holds as bigints, and IDs beyond 64 bits.
+
+def bench_dump(label, obj)
+  bytes = JSON.dump(obj).bytesize
+  ops = 0
+  timer = Chrono::Timer.new
+  while timer.elapsed < 1.0
+    JSON.dump(obj)
+    ops += 1
+  end
+  elapsed = timer.elapsed
+  puts "#{label.ljust(24)}: #{(ops / elapsed).round(0)} dumps/sec, " \
+       "#{((bytes * ops).to_f / elapsed / 1_000_000_000).round(3)} GBps"
+end
+
+base = 9223372036854775808 # INT64_MAX + 1
+u64_ids = Array.new(10_000) { |i| base + i * 7919 }
+huge_ids = Array.new(10_000) { |i| 340282366920938463463374607431768211456 + i }
+small_ids = Array.new(10_000) { |i| 1_000_000_000 + i }
+
+bench_dump("int64 IDs", small_ids)
+bench_dump("uint64 IDs (bigint)", u64_ids)
+bench_dump("128-bit IDs (bigint)", huge_ids)
@@ -0,0 +1,23 @@
+# NDJSON throughput of JSON.each_document, single-threaded and with worker
+# threads parsing ahead.
+
+lines = []
+200_000.times do |i|
+  lines << %Q({"id":#{i},"user":"user#{i}","tags":["a","b","c"],"score":#{i * 0.25},"ok":#{i.odd?}})
+end
+ndjson = lines.join("\n")
+puts "Input              : #{(ndjson.bytesize / 1_000_000.0).round(1)} MB, #{lines.size} records"
+
+def bench(label, ndjson, **opts)
+  timer = Chrono::Timer.new
+  count = JSON.each_document(ndjson, **opts) { |v| v }
+  elapsed = timer.elapsed
+  puts "--- #{label} ---"
+  puts "Throughput         : #{(ndjson.bytesize / elapsed / 1_000_000_000).round(3)} GBps"
+  puts "Records/sec        : #{(count / elapsed).round(0)}"
+end
+
+bench("each_document", ndjson)
+[1, 2, 4].each do |n|
+  bench("each_document threads: #{n}", ndjson, threads: n)
+end
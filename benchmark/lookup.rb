@@ -0,0 +1,44 @@
+# Field lookups on a lazily parsed routing message: the cost of getting a
+# few nested values out of a document that is otherwise never converted.
+
+def bench_lookup(label)
+  ops = 0
+  timer = Chrono::Timer.new
+  while timer.elapsed < 1.0
+    yield
+    ops += 1
+  end
+  puts "#{label.ljust(30)}: #{(ops / timer.elapsed).round(0)} lookups/sec"
+end
+
+message = JSON.dump({
+  "route" => { "service" => "billing", "version" => 3, "shard" => 17 },
+  "meta" => { "id" => "3f2a", "ts" => 1_700_000_000, "tags" => Array.new(20) { |i| "t#{i}" } },
+  "payload" => { "items" => Array.new(50) { |i| { "sku" => "s#{i}", "qty" => i } }, "total" => 1234.5 }
+})
+doc = JSON.parse_lazy(message)
+
+bench_lookup("chained Document#[]") { doc["route"]["service"] }
+bench_lookup("Document#at_pointer") { doc.at_pointer("/route/service") }
+bench_lookup("Document#dig") { doc.dig(:route, :service) }
+bench_lookup("Document#dig with index") { doc.dig("payload", "items", 3, "sku") }
+bench_lookup("Document#value chain") { doc.value(:route)[:service] }
+
+fields = %w[id kind status priority owner created updated region]
+record = JSON.dump(Hash[(fields + Array.new(60) { |i| "extra#{i}" }).map { |k| [k, "#{k}-value"] }])
+rdoc = JSON.parse_lazy(record)
+bench_lookup("8 fields via Document#[]") { fields.each { |f| rdoc[f] } }
+bench_lookup("8 fields via values_at") { rdoc.values_at(*fields) }
+
+sku = JSON::Pointer.compile("/payload/items/3/sku")
+bench_lookup("at_pointer(String)") { doc.at_pointer("/payload/items/3/sku") }
+bench_lookup("at_pointer(JSON::Pointer)") { doc.at_pointer(sku) }
+
+queries = ["/meta/id", "/meta/ts", "/payload/items/*/sku", "/payload/total"]
+bench_lookup("4 paths via at_pointer") do
+  doc.at_pointer("/meta/id")
+  doc.at_pointer("/meta/ts")
+  doc.at_path_with_wildcard("$.payload.items[*].sku")
+  doc.at_pointer("/payload/total")
+end
+bench_lookup("4 paths via query_many") { doc.query_many(queries) }
@@ -0,0 +1,26 @@
+# Stripping whitespace from pretty-printed JSON: a full decode and re-encode
+# with JSON.dump(JSON.parse(x)) vs. simdjson's minifier through JSON.minify,
+# with a fresh result string and with a reused buffer.
+
+def bench(label, json)
+  yield # warm up
+  ops = 0
+  timer = Chrono::Timer.new
+  while timer.elapsed < 1.0
+    yield
+    ops += 1
+  end
+  elapsed = timer.elapsed
+  puts "#{label.ljust(28)}: #{((json.bytesize * ops).to_f / elapsed / 1_000_000_000).round(3)} GBps"
+end
+
+rows = []
+20_000.times do |i|
+  rows << %Q(  {\n    "id" : #{i},\n    "name" : "user #{i}",\n    "tags" : [ "a", "b" ],\n    "score" : #{i * 0.5}\n  })
+end
+pretty = "[\n#{rows.join(",\n")}\n]\n"
+buffer = String.new
+
+bench("JSON.dump(JSON.parse(x))", pretty) { JSON.dump(JSON.parse(pretty)) }
+bench("JSON.minify", pretty) { JSON.minify(pretty) }
+bench("JSON.minify with buffer", pretty) { JSON.minify(pretty, buffer) }
@@ -0,0 +1,35 @@
+# JSON.parse throughput of the DOM-to-mruby conversion.
+#
+# Uses output.json from gen_bench.rb when present, plus a generated document
+# with many small values where per-node conversion cost dominates. Run it on
+# two builds to compare converters.
+
+def bench_parse(label, json, **opts)
+  JSON.parse(json, **opts) # warm up the parser and buffer
+  ops = 0
+  timer = Chrono::Timer.new
+  while timer.elapsed < 1.0
+    JSON.parse(json, **opts)
+    ops += 1
+  end
+  elapsed = timer.elapsed
+
+  puts "--- #{label} ---"
+  puts "Throughput         : #{((json.bytesize * ops).to_f / elapsed / 1_000_000_000).round(3)} GBps"
+  puts "Ops/sec            : #{(ops / elapsed).round(2)}"
+end
+
+rows = []
+20_000.times do |i|
+  rows << %Q({"id":#{i},"name":"user#{i}","active":#{i.even?},"score":#{i * 0.5},"tags":["a","b"],"pos":[#{i},#{i + 1},#{i + 2}]})
+end
+small = "[#{rows.join(',')}]"
+
+documents = { "small values" => small }
+documents["output.json"] = File.read("output.json") if File.exist?("output.json")
+
+documents.each do |name, json|
+  bench_parse("#{name}: JSON.parse", json)
+  bench_parse("#{name}: symbolize_names", json, symbolize_names: true)
+  bench_parse("#{name}: packed_numbers", json, packed_numbers: true)
+end
@@ -0,0 +1,53 @@
+# JSON.parse with rescue vs. JSON.try_parse vs. the validation-only
+# JSON.valid? and JSON.validate_many on a mix of valid and invalid payloads,
+# as seen on untrusted ingest endpoints.
+
+VALID = [
+  '{"id":1,"name":"alice","tags":["a","b"],"score":1.5}',
+  '{"id":2,"name":"bob","active":true,"meta":{"x":1}}',
+  '[1,2,3,4,5,6,7,8]'
+]
+INVALID = [
+  '{"id":1,"name":"alice",}',
+  '{"id":2,"name":"bob"',
+  '[1,2,3,,4]',
+  '{"id":3,"name":"unterminated}'
+]
+
+def mix(invalid_ratio, n = 1000)
+  Array.new(n) do |i|
+    (i % 100) < invalid_ratio ? INVALID[i % INVALID.size] : VALID[i % VALID.size]
+  end
+end
+
+def bench(label, inputs)
+  ops = 0
+  timer = Chrono::Timer.new
+  while timer.elapsed < 1.0
+    inputs.each { |json| yield json }
+    ops += inputs.size
+  end
+  puts "#{label.ljust(34)}: #{(ops / timer.elapsed).round(0)} docs/sec"
+end
+
+[0, 10, 50, 90].each do |ratio|
+  inputs = mix(ratio)
+  puts "--- #{ratio}% invalid ---"
+  bench("JSON.parse + rescue", inputs) do |json|
+    begin
+      JSON.parse(json)
+    rescue JSON::ParserError
+      nil
+    end
+  end
+  bench("JSON.try_parse", inputs) { |json| JSON.try_parse(json) }
+  bench("JSON.valid?", inputs) { |json| JSON.valid?(json) }
+
+  ops = 0
+  timer = Chrono::Timer.new
+  while timer.elapsed < 1.0
+    JSON.validate_many(inputs)
+    ops += inputs.size
+  end
+  puts "#{"JSON.validate_many".ljust(34)}: #{(ops / timer.elapsed).round(0)} docs/sec"
+end
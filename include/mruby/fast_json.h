@@ -64,10 +64,47 @@ MRB_BEGIN_DECL
 #define E_JSON_OUT_OF_CAPACITY_ERROR   (mrb_class_get_under(mrb, mrb_module_get(mrb, "JSON"), "OutOfCapacityError"))
 
 
+/* flags for mrb_json_parse_flags / mrb_json_load_flags */
+#define MRB_JSON_SYMBOLIZE_NAMES  (1u << 0)
+#define MRB_JSON_SHARED_STRINGS   (1u << 1)
+#define MRB_JSON_FREEZE           (1u << 2)
+#define MRB_JSON_PACKED_NUMBERS   (1u << 3)
+
 MRB_API mrb_value
 mrb_json_parse(mrb_state *mrb, mrb_value str, mrb_bool symbolize_names);
 
+MRB_API mrb_value
+mrb_json_parse_flags(mrb_state *mrb, mrb_value str, uint32_t flags);
+
+/* Like mrb_json_parse_flags, but returns undef instead of raising when str
+ * is not valid JSON. *error (if not NULL) receives the simdjson error code,
+ * 0 on success. */
+MRB_API mrb_value
+mrb_json_try_parse(mrb_state *mrb, mrb_value str, uint32_t flags, int *error);
+
+/* Checks that str is well-formed JSON in valid UTF-8 without converting
+ * it. Returns the simdjson error code, 0 if valid. */
+MRB_API int
+mrb_json_validate(mrb_state *mrb, mrb_value str);
+
+MRB_API mrb_value
+mrb_json_load(mrb_state *mrb, mrb_value path, mrb_bool symbolize_names);
+
+MRB_API mrb_value
+mrb_json_load_flags(mrb_state *mrb, mrb_value path, uint32_t flags);
+
 MRB_API mrb_value
 mrb_json_dump(mrb_state *mrb, const mrb_value obj);
 
+/* Like mrb_json_dump, but writes the JSON into the string out, replacing its
+ * contents and reusing its buffer. Returns out. */
+MRB_API mrb_value
+mrb_json_dump_into(mrb_state *mrb, mrb_value obj, mrb_value out);
+
+/* Writes the JSON for obj to the file descriptor fd in pieces of about
+ * chunk_size bytes (64 KiB when 0) while encoding. Returns the number of
+ * bytes written. Raises SystemCallError when a write fails. */
+MRB_API mrb_int
+mrb_json_dump_fd(mrb_state *mrb, mrb_value obj, int fd, size_t chunk_size);
+
 MRB_END_DECL
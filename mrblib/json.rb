@@ -1,5 +1,46 @@
 module JSON
-  class << self
-    attr_accessor :zero_copy_parsing
+  class NumericArray
+    include Enumerable
+
+    def each(&block)
+      to_a.each(&block)
+      self
+    end
+
+    def inspect
+      "#<JSON::NumericArray #{type} #{to_a.inspect}>"
+    end
+  end
+
+  class StreamReader
+    include Enumerable
+  end
+
+  class Pointer
+    def self.compile(pointer)
+      new(pointer)
+    end
+
+    def inspect
+      "#<JSON::Pointer #{self}>"
+    end
+  end
+
+  class Path
+    def self.compile(path)
+      new(path)
+    end
+
+    def inspect
+      "#<JSON::Path #{self}>"
+    end
+  end
+
+  class Value
+    include Enumerable
+
+    def inspect
+      "#<JSON::Value #{type}>"
+    end
   end
 end
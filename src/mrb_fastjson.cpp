@@ -17,7 +17,15 @@ MRB_BEGIN_DECL
 #include <mruby/internal.h>
 MRB_END_DECL
 #include <mruby/ned.h>
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <string>
 #include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <simdjson.h>
 
 using namespace simdjson;
@@ -25,10 +33,22 @@ using namespace simdjson;
 #ifdef _WIN32
 #include <windows.h>
 #include <sysinfoapi.h>
+#include <io.h>
 #else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #endif
+#include <cerrno>
+#include <climits>
 #include <cstdio>
+#include <cstring>
+#ifdef SIMDJSON_THREADS_ENABLED
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
 
 static long pagesize;
 
@@ -53,611 +73,3072 @@ static bool need_allocation(const char* buf,
   return true; // must allocate padded_string
 }
 
-static padded_string_view
-simdjson_safe_view_from_mrb_string(mrb_state *mrb, mrb_value str,
-                                   padded_string &jsonbuffer) {
-  mrb_int len = RSTRING_LEN(str);
-  if (mrb_test(mrb_iv_get(mrb, mrb_obj_value(mrb_module_get_id(mrb, MRB_SYM(JSON))), MRB_IVSYM(zero_copy_parsing)))) {
-    if (likely(!need_allocation(RSTRING_PTR(str), len, RSTRING_CAPA(str)))) {
-      str = mrb_obj_freeze(mrb, str);
-      return padded_string_view(RSTRING_PTR(str), len, len + SIMDJSON_PADDING);
+// Hands out one frozen string per distinct object key, so mrb_hash_set
+// neither allocates a second copy nor dups the key. Cached strings are kept
+// alive by the `keep` array, which is owned by the per-state object.
+class KeyCache {
+public:
+  static constexpr size_t max_key_length = 64;
+  static constexpr size_t max_entries    = 4096;
+
+  mrb_value keep;
+
+  mrb_value fetch(mrb_state *mrb, std::string_view sv) {
+    auto it = map.find(sv);
+    if (likely(it != map.end())) {
+      return it->second;
     }
-  }
 
-  if (mrb_frozen_p(mrb_obj_ptr(str))) {
-    jsonbuffer = padded_string(RSTRING_PTR(str), len);
-    return jsonbuffer;
+    mrb_value str = mrb_obj_freeze(mrb, mrb_str_new(mrb, sv.data(), sv.size()));
+    if (likely(sv.size() <= max_key_length && map.size() < max_entries)) {
+      mrb_ary_push(mrb, keep, str);
+      map.emplace(std::string_view(RSTRING_PTR(str), RSTRING_LEN(str)), str);
+    }
+    return str;
   }
 
-  // Prevent overflow in len + SIMDJSON_PADDING
-  if (unlikely(len > SIZE_MAX - SIMDJSON_PADDING)) {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "JSON input too large for padding");
+  void clear() {
+    if (map.empty()) return;
+    map.clear();
+    ARY_SET_LEN(mrb_ary_ptr(keep), 0);
   }
 
-  mrb_int required = len + SIMDJSON_PADDING;
+  size_t size() const { return map.size(); }
 
-  if (RSTRING_CAPA(str) < required) {
-    // grow Ruby string to required bytes (len + padding)
-    str = mrb_str_resize(mrb, str, required);
-    str = mrb_obj_freeze(mrb, str);
-    // restore logical length to original JSON length
-    RSTR_SET_LEN(RSTRING(str), len);
+private:
+  std::unordered_map<std::string_view, mrb_value> map;
+};
+
+// Frozen strings with multibyte characters that JSON.dump found to be valid
+// UTF-8, so dumping them again skips the check. Cached strings are kept
+// alive by `keep`, so a cached address cannot be reused by another string.
+// The cache is emptied when it holds too many strings or bytes.
+class Utf8Cache {
+public:
+  static constexpr size_t min_length  = 64;
+  static constexpr size_t max_entries = 4096;
+  static constexpr size_t max_bytes   = 16 << 20;
+
+  mrb_value keep;
+
+  bool contains(const struct RString *s) const {
+    return set.find(s) != set.end();
   }
 
-  // capacity is now at least `required`
-  return padded_string_view(RSTRING_PTR(str), len, required);
-}
+  void add(mrb_state *mrb, mrb_value str) {
+    const size_t len = RSTRING_LEN(str);
+    if (unlikely(len > max_bytes)) return;
+    if (set.size() >= max_entries || bytes + len > max_bytes) clear();
+    mrb_ary_push(mrb, keep, str);
+    set.insert(mrb_str_ptr(str));
+    bytes += len;
+  }
 
-static mrb_value convert_array(mrb_state* mrb,
-                               const dom::element& arr_el,
-                               mrb_bool symbolize_names);
+  void clear() {
+    set.clear();
+    bytes = 0;
+    ARY_SET_LEN(mrb_ary_ptr(keep), 0);
+  }
 
-static mrb_value convert_object(mrb_state* mrb,
-                                const dom::element& obj_el,
-                                mrb_bool symbolize_names);
+  size_t size() const { return set.size(); }
 
+private:
+  std::unordered_set<const struct RString *> set;
+  size_t bytes = 0;
+};
 
-static mrb_value convert_element(mrb_state *mrb, const dom::element& el,
-                                 mrb_bool symbolize_names) {
-  using namespace dom;
-  switch (el.type()) {
-  case element_type::ARRAY:
-    return convert_array(mrb, el, symbolize_names);
+// Object keys for JSON.dump, escaped and quoted once ("key":) and then
+// copied into the builder as they are. Symbols are cached by symbol. Short
+// frozen strings, which is what mruby makes hash keys, are cached by their
+// bytes, so equal keys of different hashes share an entry. The map refers
+// to those bytes, and `keep` keeps the strings alive. Each map is emptied
+// when it is full.
+class EscapedKeyCache {
+public:
+  static constexpr size_t max_key_length = KeyCache::max_key_length;
+  static constexpr size_t max_entries    = 4096;
 
-  case element_type::OBJECT:
-    return convert_object(mrb, el, symbolize_names);
+  mrb_value keep;
 
-  case element_type::INT64:
-    return mrb_convert_number(mrb, static_cast<int64_t>(el.get<int64_t>()));
+  const std::string *find(mrb_sym sym) const {
+    auto it = symbols.find(sym);
+    return it != symbols.end() ? &it->second : nullptr;
+  }
 
-  case element_type::UINT64:
-    return mrb_convert_number(mrb, static_cast<uint64_t>(el.get<uint64_t>()));
+  const std::string *find(std::string_view key) const {
+    auto it = strings.find(key);
+    return it != strings.end() ? &it->second : nullptr;
+  }
 
-  case element_type::DOUBLE:
-    return mrb_convert_number(mrb, static_cast<double>(el.get<double>()));
+  void add(mrb_sym sym, std::string_view escaped) {
+    if (symbols.size() >= max_entries) symbols.clear();
+    symbols.emplace(sym, escaped);
+  }
 
-  case element_type::STRING: {
-    std::string_view sv(el);
-    return mrb_str_new(mrb, sv.data(), sv.size());
+  void add(mrb_state *mrb, mrb_value str, std::string_view escaped) {
+    if (strings.size() >= max_entries) {
+      strings.clear();
+      ARY_SET_LEN(mrb_ary_ptr(keep), 0);
+    }
+    mrb_ary_push(mrb, keep, str);
+    strings.emplace(std::string_view(RSTRING_PTR(str), RSTRING_LEN(str)), escaped);
   }
 
-  case element_type::BOOL:
-    return mrb_bool_value(el.get_bool());
+  void clear() {
+    symbols.clear();
+    strings.clear();
+    ARY_SET_LEN(mrb_ary_ptr(keep), 0);
+  }
 
-  case element_type::NULL_VALUE:
-    return mrb_nil_value();
-  default:
-    mrb_raise(mrb, E_TYPE_ERROR, "unknown JSON type");
-    return mrb_undef_value(); // unreachable
+  size_t size() const { return symbols.size() + strings.size(); }
+
+private:
+  std::unordered_map<mrb_sym, std::string> symbols;
+  std::unordered_map<std::string_view, std::string> strings;
+};
+
+// One step of a compiled JSON Pointer or JSONPath. A step whose key is a
+// number also carries it as an index for when it meets an array, as JSON
+// Pointer reads "/0".
+struct PathStep {
+  static constexpr size_t no_index = SIZE_MAX;
+  std::string key;            // unescaped
+  size_t index = no_index;
+  bool wildcard = false;      // [*] or .* in a JSONPath
+  bool bad_index = false;     // "" or "0…": never a valid array index
+};
+
+struct CompiledPath {
+  std::vector<PathStep> steps;
+  bool has_wildcard = false;
+};
+
+// A canonical array index: digits without a leading zero.
+static bool
+parse_path_index(std::string_view token, size_t &out)
+{
+  if (token.empty() || token.size() > 18) return false;
+  if (token.size() > 1 && token[0] == '0') return false;
+  size_t n = 0;
+  for (char c : token) {
+    if (c < '0' || c > '9') return false;
+    n = n * 10 + static_cast<size_t>(c - '0');
   }
+  out = n;
+  return true;
 }
 
-static mrb_value convert_array(mrb_state *mrb, const dom::element& arr_el,
-                               mrb_bool symbolize_names) {
-  dom::array arr = arr_el.get_array();
-  mrb_value ary = mrb_ary_new_capa(mrb, arr.size());
-  int arena_index = mrb_gc_arena_save(mrb);
-  for (dom::element item : arr) {
-    mrb_ary_push(mrb, ary, convert_element(mrb, item, symbolize_names));
-    mrb_gc_arena_restore(mrb, arena_index);
+static void
+path_add_step(CompiledPath &path, PathStep &&step)
+{
+  if (step.wildcard) {
+    path.has_wildcard = true;
+  } else if (!parse_path_index(step.key, step.index)) {
+    const std::string &k = step.key;
+    step.bad_index = k.empty() ||
+      (k[0] == '0' && k.find_first_not_of("0123456789") == std::string::npos);
   }
-  return ary;
+  path.steps.push_back(std::move(step));
 }
 
-using KeyConverterFn = mrb_value (*)(mrb_state *, std::string_view);
-
-static mrb_value convert_key_as_str(mrb_state *mrb, std::string_view sv) {
-  return mrb_str_new(mrb, sv.data(), sv.size());
+// RFC 6901: "" is the whole document, otherwise each "/" starts a token in
+// which "~1" stands for "/" and "~0" for "~".
+static error_code
+compile_json_pointer(std::string_view src, CompiledPath &path)
+{
+  if (src.empty()) return SUCCESS;
+  if (src[0] != '/') return INVALID_JSON_POINTER;
+  size_t pos = 1;
+  for (;;) {
+    size_t end = src.find('/', pos);
+    if (end == std::string_view::npos) end = src.size();
+    PathStep step;
+    for (size_t i = pos; i < end; i++) {
+      char c = src[i];
+      if (c == '~') {
+        if (i + 1 >= end || (src[i + 1] != '0' && src[i + 1] != '1')) return INVALID_JSON_POINTER;
+        c = src[++i] == '0' ? '~' : '/';
+      }
+      step.key.push_back(c);
+    }
+    path_add_step(path, std::move(step));
+    if (end == src.size()) return SUCCESS;
+    pos = end + 1;
+  }
 }
 
-static mrb_value convert_key_as_sym(mrb_state *mrb, std::string_view sv) {
-  return mrb_symbol_value(mrb_intern(mrb, sv.data(), sv.size()));
+// The JSONPath subset simdjson's at_path understands: an optional "$",
+// then .name, ['name'], ["name"], [index], and the wildcards .* and [*].
+static error_code
+compile_json_path(std::string_view src, CompiledPath &path)
+{
+  const size_t n = src.size();
+  size_t i = 0;
+  if (i < n && src[i] == '$') i++;
+  while (i < n) {
+    PathStep step;
+    if (src[i] == '.') {
+      i++;
+      if (i < n && src[i] == '*') {
+        step.wildcard = true;
+        i++;
+      } else {
+        const size_t start = i;
+        while (i < n && src[i] != '.' && src[i] != '[') i++;
+        if (i == start) return INVALID_JSON_POINTER;
+        step.key.assign(src.substr(start, i - start));
+      }
+    } else if (src[i] == '[') {
+      i++;
+      if (i < n && src[i] == '*') {
+        step.wildcard = true;
+        i++;
+      } else if (i < n && (src[i] == '\'' || src[i] == '"')) {
+        const char quote = src[i++];
+        while (i < n && src[i] != quote) {
+          if (src[i] == '\\' && i + 1 < n) i++;
+          step.key.push_back(src[i++]);
+        }
+        if (i >= n) return INVALID_JSON_POINTER;
+        i++;
+      } else {
+        const size_t start = i;
+        while (i < n && src[i] >= '0' && src[i] <= '9') i++;
+        if (i == start) return INVALID_JSON_POINTER;
+        step.key.assign(src.substr(start, i - start));
+      }
+      if (i >= n || src[i] != ']') return INVALID_JSON_POINTER;
+      i++;
+    } else {
+      return INVALID_JSON_POINTER;
+    }
+    path_add_step(path, std::move(step));
+  }
+  return SUCCESS;
 }
 
-static mrb_value convert_object(mrb_state *mrb, const dom::element& obj_el,
-                                mrb_bool symbolize_names) {
-  dom::object obj = obj_el.get_object();
+// A compiled path in use. One from the cache below shares ownership with
+// it, so it outlives its eviction by a nested lookup (a #to_s or block run
+// while the path is applied); one of a JSON::Pointer or JSON::Path owns
+// nothing, as the object it belongs to is the argument being used.
+using PathRef = std::shared_ptr<const CompiledPath>;
 
-  mrb_value hash = mrb_hash_new_capa(mrb, obj.size());
-  int arena_index = mrb_gc_arena_save(mrb);
-  KeyConverterFn convert_key =
-      symbolize_names ? convert_key_as_sym : convert_key_as_str;
+// The compiled forms of the path strings most recently given to Document
+// methods; the least recently used is dropped first. Services apply the
+// same few paths to every document, so in steady state no path is parsed.
+class PathCache {
+public:
+  static constexpr size_t max_entries = 256;
+
+  // Returns the compiled src, or null with *code set if it is invalid.
+  PathRef compile(std::string_view src, bool json_path, error_code *code) {
+    auto it = map.find(src);
+    if (likely(it != map.end())) {
+      entries.splice(entries.begin(), entries, it->second);
+      return it->second->path;
+    }
 
-  for (auto &kv : obj) {
-    mrb_value key = convert_key(mrb, kv.key);
-    mrb_value val = convert_element(mrb, kv.value, symbolize_names);
-    mrb_hash_set(mrb, hash, key, val);
-    mrb_gc_arena_restore(mrb, arena_index);
-  }
+    auto path = std::make_shared<CompiledPath>();
+    *code = json_path ? compile_json_path(src, *path) : compile_json_pointer(src, *path);
+    if (unlikely(*code != SUCCESS)) return nullptr;
 
-  return hash;
-}
+    if (entries.size() >= max_entries) {
+      map.erase(entries.back().source);
+      entries.pop_back();
+    }
+    entries.push_front(Entry{std::string(src), std::move(path)});
+    map.emplace(entries.front().source, entries.begin());
+    return entries.front().path;
+  }
 
-static void raise_simdjson_error(mrb_state *mrb, const error_code code) {
-  const char *msg = error_message(code);
+  // Paths in use stay alive through their PathRef.
+  void clear() {
+    map.clear();
+    entries.clear();
+  }
 
-  switch (code) {
-  case UNCLOSED_STRING:
-    mrb_raise(mrb, E_JSON_UNCLOSED_STRING_ERROR, msg);
-    break;
-  case STRING_ERROR:
-    mrb_raise(mrb, E_JSON_STRING_ERROR, msg);
-    break;
-  case UNESCAPED_CHARS:
-    mrb_raise(mrb, E_JSON_UNESCAPED_CHARS_ERROR, msg);
-    break;
+  size_t size() const { return entries.size(); }
 
-  case TAPE_ERROR:
-    mrb_raise(mrb, E_JSON_TAPE_ERROR, msg);
-    break;
-  case DEPTH_ERROR:
-    mrb_raise(mrb, E_JSON_DEPTH_ERROR, msg);
-    break;
-  case INCOMPLETE_ARRAY_OR_OBJECT:
-    mrb_raise(mrb, E_JSON_INCOMPLETE_ARRAY_OR_OBJECT_ERROR, msg);
-    break;
-  case TRAILING_CONTENT:
-    mrb_raise(mrb, E_JSON_TRAILING_CONTENT_ERROR, msg);
-    break;
+private:
+  struct Entry {
+    std::string source;
+    PathRef path;
+  };
+  std::list<Entry> entries; // most recently used first
+  std::unordered_map<std::string_view, std::list<Entry>::iterator> map;
+};
 
-  case MEMALLOC:
-    mrb_exc_raise(mrb, mrb_obj_value(mrb->nomem_err));
-    break;
-  case CAPACITY:
-    mrb_raise(mrb, E_JSON_CAPACITY_ERROR, msg);
-    break;
-  case OUT_OF_CAPACITY:
-    mrb_raise(mrb, E_JSON_OUT_OF_CAPACITY_ERROR, msg);
-    break;
-  case INSUFFICIENT_PADDING:
-    mrb_raise(mrb, E_JSON_INSUFFICIENT_PADDING_ERROR, msg);
-    break;
+// An open array or hash while the tape is converted.
+struct TapeFrame {
+  mrb_value container;
+  mrb_value key;     // key of the value being converted, undef if none yet
+  int arena_index;   // arena state right after container was created
+  bool is_object;
+};
 
-  case NUMBER_ERROR:
-    mrb_raise(mrb, E_JSON_NUMBER_ERROR, msg);
-    break;
-  case BIGINT_ERROR:
-    mrb_raise(mrb, E_JSON_BIGINT_ERROR, msg);
-    break;
-  case NUMBER_OUT_OF_RANGE:
-    mrb_raise(mrb, E_JSON_NUMBER_OUT_OF_RANGE_ERROR, msg);
-    break;
+// Per-mrb_state scratch space for JSON.parse and JSON.load. The DOM parser
+// and the padded input buffer grow to the largest document seen and are
+// reused by every following call, so steady-state parsing does not allocate.
+struct mrb_json_state {
+  dom::parser parser;
+  padded_string buffer;
+  KeyCache keys;
+  KeyCache values; // interned string values for freeze: true
+  Utf8Cache utf8;  // frozen strings JSON.dump found valid
+  EscapedKeyCache dump_keys; // object keys as JSON.dump writes them
+  PathCache pointers; // compiled String arguments of at_pointer and friends
+  PathCache paths;    // compiled String arguments of at_path and friends
+#ifdef MRB_USE_BIGINT
+  mrb_value uint64_max = mrb_nil_value(); // UINT64_MAX as an Integer
+#endif
+  std::vector<TapeFrame> frames; // TapeConverter stack, reused across calls
+  size_t dump_builder_capacity = 0; // of the builder in JSON's dump_builder
+
+  // Classes and settings, resolved once in gem_init instead of looked up
+  // by name on every call.
+  struct RClass *json_mod = nullptr;
+  struct RClass *parser_class = nullptr;
+  struct RClass *document_class = nullptr;
+  struct RClass *value_class = nullptr;
+  struct RClass *pointer_class = nullptr;
+  struct RClass *path_class = nullptr;
+  struct RClass *padded_string_class = nullptr;
+  struct RClass *padded_string_view_class = nullptr;
+  struct RClass *numeric_array_class = nullptr;
+  struct RClass *parser_error = nullptr;
+  struct RClass *error_classes[NUM_ERROR_CODES] = {}; // JSON::*Error by error_code
+  mrb_sym error_names[NUM_ERROR_CODES] = {};          // their names, for try_parse
+  bool zero_copy_parsing = false; // JSON.zero_copy_parsing
+  int64_t mmap_threshold = INT64_C(4) << 20; // JSON.mmap_threshold, -1 if never
+  bool cache_keys = false;        // JSON.cache_keys
+};
 
-  case T_ATOM_ERROR:
-    mrb_raise(mrb, E_JSON_T_ATOM_ERROR, msg);
-    break;
-  case F_ATOM_ERROR:
-    mrb_raise(mrb, E_JSON_F_ATOM_ERROR, msg);
-    break;
-  case N_ATOM_ERROR:
-    mrb_raise(mrb, E_JSON_N_ATOM_ERROR, msg);
-    break;
+MRB_CPP_DEFINE_TYPE(mrb_json_state, json_state);
 
-  case UTF8_ERROR:
-    mrb_raise(mrb, E_JSON_UTF8_ERROR, msg);
-    break;
+static mrb_json_state*
+mrb_json_state_lookup(mrb_state *mrb)
+{
+  mrb_value state_obj = mrb_iv_get(mrb,
+    mrb_obj_value(mrb_module_get_id(mrb, MRB_SYM(JSON))), MRB_SYM(json_state));
+  return mrb_cpp_get<mrb_json_state>(mrb, state_obj);
+}
 
-  case EMPTY:
-    mrb_raise(mrb, E_JSON_EMPTY_INPUT_ERROR, msg);
-    break;
-  case UNINITIALIZED:
-    mrb_raise(mrb, E_JSON_UNINITIALIZED_ERROR, msg);
-    break;
-  case PARSER_IN_USE:
-    mrb_raise(mrb, E_JSON_PARSER_IN_USE_ERROR, msg);
-    break;
-  case SCALAR_DOCUMENT_AS_VALUE:
-    mrb_raise(mrb, E_JSON_SCALAR_DOCUMENT_AS_VALUE_ERROR, msg);
-    break;
+// mrb_json_state_get runs on every parse, dump and raised error, so the
+// lookup by name above is done once per thread and mrb_state: each thread
+// remembers the last pair it used. gem_final bumps the epoch, so an entry
+// for a closed mrb_state is never used, even if a new one gets its address.
+struct JsonStateCache {
+  mrb_state *mrb = nullptr;
+  mrb_json_state *state = nullptr;
+  uint64_t epoch = 0;
+};
+static std::atomic<uint64_t> json_state_epoch{1};
+static thread_local JsonStateCache json_state_cache;
 
-  case INCORRECT_TYPE:
-    mrb_raise(mrb, E_TYPE_ERROR, msg);
-    break;
-  case NO_SUCH_FIELD:
-    mrb_raise(mrb, E_JSON_NO_SUCH_FIELD_ERROR, msg);
-    break;
-  case INDEX_OUT_OF_BOUNDS:
-    mrb_raise(mrb, E_INDEX_ERROR, msg);
-    break;
-  case OUT_OF_BOUNDS:
-    mrb_raise(mrb, E_JSON_OUT_OF_BOUNDS_ERROR, msg);
-    break;
-  case OUT_OF_ORDER_ITERATION:
-    mrb_raise(mrb, E_JSON_OUT_OF_ORDER_ITERATION_ERROR, msg);
-    break;
+static inline mrb_json_state*
+mrb_json_state_get(mrb_state *mrb)
+{
+  JsonStateCache &cache = json_state_cache;
+  const uint64_t epoch = json_state_epoch.load(std::memory_order_acquire);
+  if (likely(cache.mrb == mrb && cache.epoch == epoch)) return cache.state;
+  mrb_json_state *state = mrb_json_state_lookup(mrb);
+  cache = JsonStateCache{mrb, state, epoch};
+  return state;
+}
 
-  case IO_ERROR:
-    mrb_raise(mrb, E_JSON_IO_ERROR, msg);
-    break;
-  case INVALID_JSON_POINTER:
-    mrb_raise(mrb, E_JSON_INVALID_JSON_POINTER_ERROR, msg);
-    break;
-  case INVALID_URI_FRAGMENT:
-    mrb_raise(mrb, E_JSON_INVALID_URI_FRAGMENT_ERROR, msg);
-    break;
+// Returns a scratch buffer of at least len bytes plus SIMDJSON_PADDING, or
+// nullptr when growing it failed. The previous buffer stays valid then.
+static char*
+mrb_json_state_reserve(mrb_json_state *state, size_t len)
+{
+  if (state->buffer.data() == nullptr || state->buffer.size() < len) {
+    padded_string grown(len);
+    if (unlikely(grown.data() == nullptr)) {
+      return nullptr;
+    }
+    state->buffer = std::move(grown);
+  }
+  return state->buffer.data();
+}
 
-  case UNSUPPORTED_ARCHITECTURE:
-    mrb_raise(mrb, E_JSON_UNSUPPORTED_ARCHITECTURE_ERROR, msg);
-    break;
-  case UNEXPECTED_ERROR:
-    mrb_raise(mrb, E_JSON_UNEXPECTED_ERROR, msg);
-    break;
+// Returns the JSON::*Error class simdjson's code is raised as.
+static struct RClass*
+mrb_json_error_class(mrb_state *mrb, error_code code)
+{
+  mrb_json_state *state = mrb_json_state_get(mrb);
+  struct RClass *cls = nullptr;
+  if (likely(code >= 0 && code < NUM_ERROR_CODES)) {
+    cls = state->error_classes[code];
+  }
+  return cls ? cls : state->parser_error;
+}
 
+// Returns the name of the error class raise_simdjson_error would raise for
+// code as a symbol, e.g. :TapeError, or :TypeError and :IndexError for the
+// codes it maps to core classes. Allocation failures are still raised.
+static mrb_sym
+mrb_json_error_name(mrb_state *mrb, int code)
+{
+  switch (code) {
+  case MEMALLOC:
+    mrb_exc_raise(mrb, mrb_obj_value(mrb->nomem_err));
+  case INCORRECT_TYPE:
+    return MRB_SYM(TypeError);
+  case INDEX_OUT_OF_BOUNDS:
+    return MRB_SYM(IndexError);
   default:
-    mrb_raise(mrb, E_JSON_PARSER_ERROR, msg);
     break;
   }
+  mrb_json_state *state = mrb_json_state_get(mrb);
+  mrb_sym name = 0;
+  if (likely(code >= 0 && code < NUM_ERROR_CODES)) {
+    name = state->error_names[code];
+  }
+  return name ? name : MRB_SYM(ParserError);
 }
 
-MRB_API mrb_value mrb_json_parse(mrb_state *mrb, mrb_value str,
-                                 mrb_bool symbolize_names) {
-  dom::parser parser;
-  padded_string jsonbuffer;
-  auto view = simdjson_safe_view_from_mrb_string(mrb, str, jsonbuffer);
-  auto result = parser.parse(view);
-
-  if (unlikely(result.error() != SUCCESS)) {
-    raise_simdjson_error(mrb, result.error());
+static padded_string_view
+simdjson_safe_view_from_mrb_string(mrb_state *mrb, mrb_value str,
+                                   mrb_json_state *state) {
+  mrb_int len = RSTRING_LEN(str);
+  if (state->zero_copy_parsing) {
+    if (likely(!need_allocation(RSTRING_PTR(str), len, RSTRING_CAPA(str)))) {
+      str = mrb_obj_freeze(mrb, str);
+      return padded_string_view(RSTRING_PTR(str), len, len + SIMDJSON_PADDING);
+    }
   }
 
-  return convert_element(mrb, result.value(), symbolize_names);
-}
+  if (mrb_frozen_p(mrb_obj_ptr(str))) {
+    char *buf = mrb_json_state_reserve(state, len);
+    if (unlikely(buf == nullptr)) {
+      mrb_exc_raise(mrb, mrb_obj_value(mrb->nomem_err));
+    }
+    memcpy(buf, RSTRING_PTR(str), len);
+    return padded_string_view(buf, len, state->buffer.size() + SIMDJSON_PADDING);
+  }
 
-static mrb_value mrb_json_parse_m(mrb_state *mrb, mrb_value self) {
-  mrb_value str;
-  mrb_value kw_values[1] = {
-      mrb_undef_value()}; // default value for symbolize_names
-  mrb_sym kw_names[] = {MRB_SYM(symbolize_names)};
-  mrb_kwargs kwargs = {1, // num: number of keywords
-                       0, // required: none required
-                       kw_names, kw_values, NULL};
+  // Prevent overflow in len + SIMDJSON_PADDING
+  if (unlikely(len > SIZE_MAX - SIMDJSON_PADDING)) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "JSON input too large for padding");
+  }
 
-  mrb_get_args(mrb, "S:", &str, &kwargs);
+  mrb_int required = len + SIMDJSON_PADDING;
 
-  // Fallback default
-  mrb_bool symbolize_names = FALSE;
-  if (!mrb_undef_p(kw_values[0])) {
-    symbolize_names = mrb_bool(kw_values[0]); // cast to mrb_bool
+  if (RSTRING_CAPA(str) < required) {
+    // grow Ruby string to required bytes (len + padding)
+    str = mrb_str_resize(mrb, str, required);
+    str = mrb_obj_freeze(mrb, str);
+    // restore logical length to original JSON length
+    RSTR_SET_LEN(RSTRING(str), len);
   }
 
-  return mrb_json_parse(mrb, str, symbolize_names);
+  // capacity is now at least `required`
+  return padded_string_view(RSTRING_PTR(str), len, required);
 }
 
-#ifndef MRB_STR_LENGTH_MAX
-#define MRB_STR_LENGTH_MAX 1048576
-#endif
-
-MRB_CPP_DEFINE_TYPE(ondemand::parser, ondemand_parser);
-MRB_CPP_DEFINE_TYPE(padded_string, padded_string);
-MRB_CPP_DEFINE_TYPE(padded_string_view, padded_string_view);
-MRB_CPP_DEFINE_TYPE(ondemand::document, ondemand_document);
-
-static mrb_value
-make_padded_string_view_from_ruby_str(mrb_state *mrb, mrb_value str)
+// Reads the file at path into the state's scratch buffer.
+static padded_string_view
+mrb_json_state_load_file(mrb_state *mrb, mrb_json_state *state, mrb_value path_str)
 {
-  struct RClass *json_mod = mrb_module_get_id(mrb, MRB_SYM(JSON));
-  mrb_value zero_copy  = mrb_iv_get(mrb, mrb_obj_value(json_mod), MRB_IVSYM(zero_copy_parsing));
-
-  mrb_int len = RSTRING_LEN(str);
+  const char *path = mrb_string_value_cstr(mrb, &path_str);
+  std::FILE *fp = std::fopen(path, "rb");
+  if (unlikely(fp == nullptr)) {
+    mrb_sys_fail(mrb, "failed to read file");
+  }
 
-  mrb_value argv[] = {mrb_undef_value(), mrb_undef_value()};
-  mrb_int argc = 0;
+  long len = -1;
+  if (likely(std::fseek(fp, 0, SEEK_END) == 0)) {
+    len = std::ftell(fp);
+  }
+  char *buf = nullptr;
+  if (likely(len >= 0 && std::fseek(fp, 0, SEEK_SET) == 0)) {
+    buf = mrb_json_state_reserve(state, static_cast<size_t>(len));
+  }
+  if (unlikely(buf == nullptr)) {
+    std::fclose(fp);
+    mrb_sys_fail(mrb, "failed to read file");
+  }
 
-  if (mrb_test(zero_copy) && likely(!need_allocation(RSTRING_PTR(str), len, RSTRING_CAPA(str)))) {
-    argv[0] = mrb_obj_freeze(mrb, str);
-    argv[1] = mrb_convert_number(mrb, len + SIMDJSON_PADDING);
-    argc = 2;
+  size_t read = std::fread(buf, 1, static_cast<size_t>(len), fp);
+  std::fclose(fp);
+  if (unlikely(read != static_cast<size_t>(len))) {
+    mrb_sys_fail(mrb, "failed to read file");
+  }
 
-  } else if (mrb_frozen_p(mrb_obj_ptr(str))) {
-    argv[0] = mrb_obj_new(
-      mrb,
-      mrb_class_get_under_id(mrb, json_mod, MRB_SYM(PaddedString)),
-      1, &str
-    );
-    argc = 1;
+  return padded_string_view(buf, read, state->buffer.size() + SIMDJSON_PADDING);
+}
 
-  } else if (unlikely(len > SIZE_MAX - SIMDJSON_PADDING)) {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "JSON input too large for padding");
-  } else {
-    mrb_int required = len + SIMDJSON_PADDING;
+// Options and scratch state shared by one conversion into mruby objects.
+// Unless JSON.cache_keys is set the key cache only lives as long as the
+// conversion; interned values (freeze: true) never outlive it.
+struct ConvertCtx {
+  mrb_bool symbolize_names;
+  mrb_bool freeze;
+  mrb_bool packed_numbers;
+  KeyCache &keys;
+  KeyCache &values;
+  bool keep_keys;
+  // Set by share_tape_strings: string values become substrings of `strings`,
+  // a copy of the parser's string buffer starting at `strings_base`.
+  mrb_value strings = mrb_nil_value();
+  const char *strings_base = nullptr;
+  // JSON::NumericArray
+  struct RClass *numeric_array_class;
+
+  ConvertCtx(mrb_state *mrb, mrb_json_state *state, uint32_t flags)
+  : symbolize_names((flags & MRB_JSON_SYMBOLIZE_NAMES) != 0),
+    freeze((flags & MRB_JSON_FREEZE) != 0),
+    packed_numbers((flags & MRB_JSON_PACKED_NUMBERS) != 0),
+    keys(state->keys), values(state->values),
+    keep_keys(state->cache_keys),
+    numeric_array_class(state->numeric_array_class) {}
+
+  ConvertCtx(mrb_state *mrb, uint32_t flags)
+  : ConvertCtx(mrb, mrb_json_state_get(mrb), flags) {}
+
+  ~ConvertCtx() {
+    if (!keep_keys) keys.clear();
+    values.clear();
+  }
 
-    if (RSTRING_CAPA(str) < required) {
-      str = mrb_str_resize(mrb, str, required);
-      str = mrb_obj_freeze(mrb, str);
-      RSTR_SET_LEN(RSTRING(str), len);
-    }
+  ConvertCtx(const ConvertCtx&) = delete;
+  ConvertCtx& operator=(const ConvertCtx&) = delete;
+};
 
-    argv[0] = str;
-    argc = 1;
+// Creates a string value. With freeze: true short strings are interned, so
+// every occurrence of the same value is one frozen object.
+static mrb_value convert_string(mrb_state *mrb, std::string_view sv, ConvertCtx &ctx) {
+  if (ctx.freeze && sv.size() <= KeyCache::max_key_length) {
+    return ctx.values.fetch(mrb, sv);
   }
 
-  return mrb_obj_new(
-    mrb,
-    mrb_class_get_under_id(mrb, json_mod, MRB_SYM(PaddedStringView)),
-    argc, argv
-  );
+  mrb_value str;
+  if (ctx.strings_base) {
+    str = mrb_str_byte_subseq(mrb, ctx.strings, sv.data() - ctx.strings_base, sv.size());
+  } else {
+    str = mrb_str_new(mrb, sv.data(), sv.size());
+  }
+  return ctx.freeze ? mrb_obj_freeze(mrb, str) : str;
 }
 
+// JSON::NumericArray stores the elements of a homogeneous numeric array as
+// native int64 or double values in one frozen binary string.
 static mrb_value
-mrb_ondemand_parser_initialize(mrb_state *mrb, mrb_value self)
+make_numeric_array(mrb_state *mrb, mrb_value data, mrb_sym type, ConvertCtx &ctx)
 {
-  mrb_int max_capacity = SIMDJSON_MAXSIZE_BYTES;
+  mrb_value obj = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_OBJECT, ctx.numeric_array_class));
+  mrb_iv_set(mrb, obj, MRB_SYM(data), mrb_obj_freeze(mrb, data));
+  mrb_iv_set(mrb, obj, MRB_SYM(type), mrb_symbol_value(type));
+  return ctx.freeze ? mrb_obj_freeze(mrb, obj) : obj;
+}
 
-  mrb_get_args(mrb, "|i", &max_capacity);
+// Integers beyond 2**53 can't be stored in a float64 array without loss.
+static constexpr int64_t max_exact_double_int = INT64_C(1) << 53;
 
-  mrb_cpp_new<ondemand::parser>(mrb, self, max_capacity);
+using internal::tape_type;
 
-  return self;
+static inline tape_type
+tape_type_of(uint64_t word)
+{
+  return static_cast<tape_type>(word >> 56);
 }
 
-static mrb_value
-mrb_ondemand_parser_allocate(mrb_state *mrb, mrb_value self)
+// Number of elements (arrays) or members (objects) of a container, as
+// recorded on its start entry. Saturates at 0xFFFFFF, so only a size hint.
+static inline uint32_t
+tape_scope_count(uint64_t word)
 {
-  mrb_int new_capacity  = MRB_STR_LENGTH_MAX;
-  mrb_int new_max_depth = DEFAULT_MAX_DEPTH;
-  mrb_get_args(mrb, "|ii", &new_capacity, &new_max_depth);
+  return uint32_t((word >> 32) & internal::JSON_COUNT_MASK);
+}
 
-  auto code = mrb_cpp_get<ondemand::parser>(mrb, self)->allocate(new_capacity, new_max_depth);
-  if (likely(code == SUCCESS)) return self;
+// A parsed document: its tape and the string buffer the tape points into.
+// Either a dom::document or a copy of one made by a stream worker.
+struct TapeView {
+  const uint64_t *tape;
+  const uint8_t *strings;
 
-  raise_simdjson_error(mrb, code);
-  return mrb_undef_value();
-}
+  TapeView(const uint64_t *tape, const uint8_t *strings) : tape(tape), strings(strings) {}
+  TapeView(const dom::document &doc) : tape(doc.tape.get()), strings(doc.string_buf.get()) {}
+};
 
-static mrb_value
-mrb_ondemand_parser_iterate(mrb_state *mrb, mrb_value self)
+static inline std::string_view
+tape_string(TapeView doc, uint64_t word)
 {
-  mrb_value arg;
-  mrb_get_args(mrb, "S", &arg);
+  const uint8_t *p = doc.strings + (word & internal::JSON_VALUE_MASK);
+  uint32_t len;
+  memcpy(&len, p, sizeof(len));
+  return std::string_view(reinterpret_cast<const char *>(p + sizeof(len)), len);
+}
 
-  mrb_value view_obj = make_padded_string_view_from_ruby_str(mrb, arg);
-  struct RClass *json_mod = mrb_module_get_id(mrb, MRB_SYM(JSON));
-  struct RClass *doc_cls =
-    mrb_class_get_under_id(mrb, json_mod, MRB_SYM(Document));
-  mrb_value args[] = { view_obj, self };
-  return mrb_obj_new(mrb, doc_cls, 2, args);
+template <typename T>
+static inline T
+tape_payload(const uint64_t *tape, size_t index)
+{
+  T value;
+  memcpy(&value, &tape[index + 1], sizeof(value));
+  return value;
+}
+
+// Packs the array starting at tape[start] into a JSON::NumericArray when
+// every element is a number: int64 when all are signed integers, float64
+// when at least one is a double and every integer is exactly representable.
+// Returns undef otherwise.
+static mrb_value
+pack_tape_array(mrb_state *mrb, const uint64_t *tape, size_t start, ConvertCtx &ctx)
+{
+  const size_t end = uint32_t(tape[start]) - 1; // the END_ARRAY entry
+  bool has_double = false;
+  bool has_wide_int = false;
+
+  // every number occupies two tape entries, anything else makes us bail out
+  for (size_t i = start + 1; i < end; i += 2) {
+    switch (tape_type_of(tape[i])) {
+      case tape_type::INT64: {
+        int64_t v = tape_payload<int64_t>(tape, i);
+        has_wide_int |= (v > max_exact_double_int || v < -max_exact_double_int);
+      } break;
+      case tape_type::DOUBLE:
+        has_double = true;
+        break;
+      default:
+        return mrb_undef_value();
+    }
+  }
+  const size_t n = (end - start - 1) / 2;
+  if (n == 0 || (has_double && has_wide_int)) {
+    return mrb_undef_value();
+  }
+
+  mrb_value data = mrb_str_new_capa(mrb, n * sizeof(int64_t));
+  char *p = RSTRING_PTR(data);
+  for (size_t i = start + 1; i < end; i += 2, p += sizeof(int64_t)) {
+    if (has_double && tape_type_of(tape[i]) == tape_type::INT64) {
+      double d = static_cast<double>(tape_payload<int64_t>(tape, i));
+      memcpy(p, &d, sizeof(d));
+    } else {
+      // int64 and double payloads are stored as-is
+      memcpy(p, &tape[i + 1], sizeof(int64_t));
+    }
+  }
+  RSTR_SET_LEN(RSTRING(data), n * sizeof(int64_t));
+
+  return make_numeric_array(mrb, data, has_double ? MRB_SYM(float64) : MRB_SYM(int64), ctx);
+}
+
+// Converts a parsed DOM document into mruby objects by walking its tape
+// linearly. Open arrays and hashes live on an explicit stack instead of the
+// C stack and are pre-sized from the counts on the tape. Key conversion is
+// chosen at compile time through Symbolize.
+template <bool Symbolize>
+class TapeConverter {
+public:
+  TapeConverter(mrb_state *mrb, TapeView doc,
+                std::vector<TapeFrame> &stack, ConvertCtx &ctx)
+  : mrb(mrb), doc(doc), tape(doc.tape), stack(stack), ctx(ctx) {}
+
+  // Converts the value at tape[index]; the root value is at index 1.
+  mrb_value convert(size_t index) {
+    // Conversions never nest, so anything left here was abandoned by a
+    // raise in an earlier call.
+    stack.clear();
+    size_t i = index;
+
+    for (;;) {
+      const uint64_t word = tape[i];
+      mrb_value value;
+
+      switch (tape_type_of(word)) {
+        case tape_type::START_ARRAY:
+          if (ctx.packed_numbers) {
+            value = pack_tape_array(mrb, tape, i, ctx);
+            if (!mrb_undef_p(value)) {
+              i = uint32_t(word);
+              break;
+            }
+          }
+          open(mrb_ary_new_capa(mrb, tape_scope_count(word)), false);
+          i++;
+          continue;
+
+        case tape_type::START_OBJECT:
+          open(mrb_hash_new_capa(mrb, tape_scope_count(word)), true);
+          i++;
+          continue;
+
+        case tape_type::END_ARRAY:
+        case tape_type::END_OBJECT:
+          value = stack.back().container;
+          stack.pop_back();
+          if (ctx.freeze) mrb_obj_freeze(mrb, value);
+          i++;
+          break;
+
+        case tape_type::STRING:
+          if (!stack.empty() && stack.back().is_object && mrb_undef_p(stack.back().key)) {
+            stack.back().key = convert_key(tape_string(doc, word));
+            i++;
+            continue;
+          }
+          value = convert_string(mrb, tape_string(doc, word), ctx);
+          i++;
+          break;
+
+        case tape_type::INT64:
+          value = mrb_convert_number(mrb, tape_payload<int64_t>(tape, i));
+          i += 2;
+          break;
+
+        case tape_type::UINT64:
+          value = mrb_convert_number(mrb, tape_payload<uint64_t>(tape, i));
+          i += 2;
+          break;
+
+        case tape_type::DOUBLE:
+          value = mrb_convert_number(mrb, tape_payload<double>(tape, i));
+          i += 2;
+          break;
+
+        case tape_type::TRUE_VALUE:
+          value = mrb_true_value();
+          i++;
+          break;
+
+        case tape_type::FALSE_VALUE:
+          value = mrb_false_value();
+          i++;
+          break;
+
+        case tape_type::NULL_VALUE:
+          value = mrb_nil_value();
+          i++;
+          break;
+
+        default:
+          mrb_raise(mrb, E_TYPE_ERROR, "unknown JSON type");
+      }
+
+      if (stack.empty()) return value;
+      append(value);
+    }
+  }
+
+private:
+  mrb_state *mrb;
+  TapeView doc;
+  const uint64_t *tape;
+  std::vector<TapeFrame> &stack;
+  ConvertCtx &ctx;
+
+  mrb_value convert_key(std::string_view sv) {
+    if constexpr (Symbolize) {
+      return mrb_symbol_value(mrb_intern(mrb, sv.data(), sv.size()));
+    } else {
+      return ctx.keys.fetch(mrb, sv);
+    }
+  }
+
+  // The container and any pending keys of its parents stay in the GC arena
+  // until the container is added to its parent.
+  void open(mrb_value container, bool is_object) {
+    stack.push_back({container, mrb_undef_value(), mrb_gc_arena_save(mrb), is_object});
+  }
+
+  void append(mrb_value value) {
+    TapeFrame &top = stack.back();
+    if (top.is_object) {
+      mrb_hash_set(mrb, top.container, top.key, value);
+      top.key = mrb_undef_value();
+    } else {
+      mrb_ary_push(mrb, top.container, value);
+    }
+    mrb_gc_arena_restore(mrb, top.arena_index);
+  }
+};
+
+static void raise_simdjson_error(mrb_state *mrb, const error_code code) {
+  const char *msg = error_message(code);
+
+  switch (code) {
+  case MEMALLOC:
+    mrb_exc_raise(mrb, mrb_obj_value(mrb->nomem_err));
+    break;
+  case INCORRECT_TYPE:
+    mrb_raise(mrb, E_TYPE_ERROR, msg);
+    break;
+  case INDEX_OUT_OF_BOUNDS:
+    mrb_raise(mrb, E_INDEX_ERROR, msg);
+    break;
+  default:
+    mrb_raise(mrb, mrb_json_error_class(mrb, code), msg);
+    break;
+  }
+}
+
+// Returns the number of bytes of the string buffer used by a document.
+// Strings are appended to it in document order, so the end of the last
+// string on the tape is the end of the used region.
+static size_t
+tape_strings_used(TapeView doc)
+{
+  const uint64_t *tape = doc.tape;
+  const size_t tape_len = tape[0] & internal::JSON_VALUE_MASK;
+  size_t used = 0;
+
+  for (size_t i = 1; i < tape_len; i++) {
+    switch (static_cast<tape_type>(tape[i] >> 56)) {
+      case tape_type::STRING: {
+        size_t offset = tape[i] & internal::JSON_VALUE_MASK;
+        uint32_t len;
+        memcpy(&len, doc.strings + offset, sizeof(len));
+        used = offset + sizeof(len) + len + 1;
+      } break;
+      case tape_type::INT64:
+      case tape_type::UINT64:
+      case tape_type::DOUBLE:
+        i++; // skip the number payload
+        break;
+      default:
+        break;
+    }
+  }
+
+  return used;
+}
+
+// Copies the used part of the string buffer into one frozen mruby string.
+// String values are then created as substrings of it, which share its heap
+// buffer instead of allocating their own.
+static void
+share_tape_strings(mrb_state *mrb, TapeView doc, ConvertCtx &ctx)
+{
+  size_t used = tape_strings_used(doc);
+  if (used == 0) return;
+
+  const char *base = reinterpret_cast<const char *>(doc.strings);
+  ctx.strings = mrb_obj_freeze(mrb, mrb_str_new(mrb, base, used));
+  ctx.strings_base = base;
+}
+
+// Converts a successfully parsed document.
+static mrb_value
+convert_tape(mrb_state *mrb, mrb_json_state *state, TapeView doc,
+             ConvertCtx &ctx, uint32_t flags)
+{
+  ctx.strings = mrb_nil_value();
+  ctx.strings_base = nullptr;
+  if (flags & MRB_JSON_SHARED_STRINGS) {
+    share_tape_strings(mrb, doc, ctx);
+  }
+  if (ctx.symbolize_names) {
+    return TapeConverter<true>(mrb, doc, state->frames, ctx).convert(1);
+  }
+  return TapeConverter<false>(mrb, doc, state->frames, ctx).convert(1);
+}
+
+// Converts the document of the state's last successful parse.
+static mrb_value
+convert_dom_document(mrb_state *mrb, mrb_json_state *state, uint32_t flags)
+{
+  ConvertCtx ctx(mrb, state, flags);
+  return convert_tape(mrb, state, state->parser.doc, ctx, flags);
+}
+
+static mrb_value
+convert_dom_result(mrb_state *mrb, mrb_json_state *state,
+                   simdjson_result<dom::element> result, uint32_t flags)
+{
+  if (unlikely(result.error() != SUCCESS)) {
+    raise_simdjson_error(mrb, result.error());
+  }
+  return convert_dom_document(mrb, state, flags);
+}
+
+MRB_API mrb_value mrb_json_parse_flags(mrb_state *mrb, mrb_value str,
+                                       uint32_t flags) {
+  auto *state = mrb_json_state_get(mrb);
+  auto view = simdjson_safe_view_from_mrb_string(mrb, str, state);
+  return convert_dom_result(mrb, state, state->parser.parse(view), flags);
+}
+
+MRB_API mrb_value
+mrb_json_try_parse(mrb_state *mrb, mrb_value str, uint32_t flags, int *error)
+{
+  auto *state = mrb_json_state_get(mrb);
+  auto view = simdjson_safe_view_from_mrb_string(mrb, str, state);
+  error_code code = state->parser.parse(view).error();
+  if (error) *error = code;
+  if (unlikely(code != SUCCESS)) {
+    return mrb_undef_value();
+  }
+  return convert_dom_document(mrb, state, flags);
+}
+
+// Parses str into the state's parser without converting it.
+static error_code
+validate_string(mrb_state *mrb, mrb_json_state *state, mrb_value str)
+{
+  auto view = simdjson_safe_view_from_mrb_string(mrb, str, state);
+  return state->parser.parse(view).error();
+}
+
+MRB_API int
+mrb_json_validate(mrb_state *mrb, mrb_value str)
+{
+  return validate_string(mrb, mrb_json_state_get(mrb), str);
+}
+
+// Strips the whitespace between tokens of len bytes at src with simdjson's
+// SIMD minifier. The result goes into out, a caller's string whose buffer
+// is reused, or a new string when out is nil. The input is read in place.
+// The minifier stores whole SIMD blocks, so the output buffer must hold
+// len + SIMDJSON_PADDING bytes even though fewer are used.
+static mrb_value
+minify_into(mrb_state *mrb, const char *src, size_t len, mrb_value out)
+{
+  const mrb_int capa = static_cast<mrb_int>(len + SIMDJSON_PADDING);
+  if (mrb_nil_p(out)) {
+    out = mrb_str_new_capa(mrb, capa);
+  } else {
+    out = mrb_ensure_string_type(mrb, out);
+    if (unlikely(RSTRING_PTR(out) == src)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "buffer must not be the input string");
+    }
+    mrb_str_modify(mrb, mrb_str_ptr(out));
+  }
+  if (RSTRING_CAPA(out) < capa) {
+    mrb_str_resize(mrb, out, capa);
+  }
+
+  size_t written = 0;
+  error_code code = minify(src, len, RSTRING_PTR(out), written);
+  if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+  RSTR_SET_LEN(RSTRING(out), written);
+  RSTRING_PTR(out)[written] = '\0';
+  return out;
+}
+
+MRB_API mrb_value mrb_json_parse(mrb_state *mrb, mrb_value str,
+                                 mrb_bool symbolize_names) {
+  return mrb_json_parse_flags(mrb, str, symbolize_names ? MRB_JSON_SYMBOLIZE_NAMES : 0);
+}
+
+// The conversion keywords shared by JSON.parse, JSON.load and
+// JSON.each_document, in the order flags_from_kwargs reads them.
+#define MRB_JSON_PARSE_KWARGS \
+  MRB_SYM(symbolize_names), MRB_SYM(shared_strings), MRB_SYM(freeze), MRB_SYM(packed_numbers)
+
+static uint32_t
+flags_from_kwargs(const mrb_value *kw_values)
+{
+  uint32_t flags = 0;
+  if (!mrb_undef_p(kw_values[0]) && mrb_test(kw_values[0])) {
+    flags |= MRB_JSON_SYMBOLIZE_NAMES;
+  }
+  if (!mrb_undef_p(kw_values[1]) && mrb_test(kw_values[1])) {
+    flags |= MRB_JSON_SHARED_STRINGS;
+  }
+  if (!mrb_undef_p(kw_values[2]) && mrb_test(kw_values[2])) {
+    flags |= MRB_JSON_FREEZE;
+  }
+  if (!mrb_undef_p(kw_values[3]) && mrb_test(kw_values[3])) {
+    flags |= MRB_JSON_PACKED_NUMBERS;
+  }
+  return flags;
+}
+
+// Parses the keyword arguments shared by JSON.parse and JSON.load.
+static uint32_t
+get_parse_flags(mrb_state *mrb, mrb_value *str)
+{
+  mrb_value kw_values[4] = {
+      mrb_undef_value(), mrb_undef_value(), mrb_undef_value(), mrb_undef_value()};
+  mrb_sym kw_names[] = {MRB_JSON_PARSE_KWARGS};
+  mrb_kwargs kwargs = {4, // num: number of keywords
+                       0, // required: none required
+                       kw_names, kw_values, NULL};
+
+  mrb_get_args(mrb, "S:", str, &kwargs);
+
+  return flags_from_kwargs(kw_values);
+}
+
+static mrb_value mrb_json_parse_m(mrb_state *mrb, mrb_value self) {
+  mrb_value str;
+  uint32_t flags = get_parse_flags(mrb, &str);
+
+  return mrb_json_parse_flags(mrb, str, flags);
+}
+
+#ifndef MRB_STR_LENGTH_MAX
+#define MRB_STR_LENGTH_MAX 1048576
+#endif
+
+MRB_CPP_DEFINE_TYPE(ondemand::parser, ondemand_parser);
+MRB_CPP_DEFINE_TYPE(padded_string, padded_string);
+MRB_CPP_DEFINE_TYPE(padded_string_view, padded_string_view);
+MRB_CPP_DEFINE_TYPE(ondemand::document, ondemand_document);
+MRB_CPP_DEFINE_TYPE(dom::parser, dom_parser);
+MRB_CPP_DEFINE_TYPE(dom::document_stream, dom_document_stream);
+MRB_CPP_DEFINE_TYPE(ondemand::document_stream, ondemand_document_stream);
+
+// Wraps a C++ object in a hidden data object, so the GC frees it even when
+// a block raises while it is in use.
+template <typename T, typename... Args>
+static T*
+mrb_json_hidden_new(mrb_state *mrb, mrb_value *obj, Args&&... args)
+{
+  *obj = mrb_obj_value(mrb_data_object_alloc(mrb, mrb->object_class, NULL, NULL));
+  return mrb_cpp_new<T>(mrb, *obj, std::forward<Args>(args)...);
+}
+
+#ifndef _WIN32
+// A read-only mapping of a file followed by at least SIMDJSON_PADDING
+// readable zero bytes, so simdjson can parse it straight from the page
+// cache. The file is mapped over an anonymous reservation that covers the
+// padding; the bytes past the end of the file in its last page read as
+// zero as well.
+class MappedFile {
+public:
+  MappedFile() = default;
+  ~MappedFile() { unmap(); }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  // Returns false and leaves errno set on failure.
+  bool map(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && map_fd(fd, static_cast<size_t>(st.st_size));
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return ok;
+  }
+
+  void unmap() {
+    if (base != nullptr) {
+      munmap(base, mapped);
+      base = nullptr;
+    }
+  }
+
+  padded_string_view view() const {
+    return padded_string_view(static_cast<const char *>(base), len, mapped);
+  }
+
+private:
+  void *base = nullptr;
+  size_t mapped = 0;
+  size_t len = 0;
+
+  bool map_fd(int fd, size_t size) {
+    const size_t page = static_cast<size_t>(pagesize);
+    const size_t total = (size + SIMDJSON_PADDING + page - 1) / page * page;
+
+    void *region = mmap(nullptr, total, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) return false;
+    if (size > 0) {
+      if (mmap(region, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        int saved_errno = errno;
+        munmap(region, total);
+        errno = saved_errno;
+        return false;
+      }
+#ifdef MADV_SEQUENTIAL
+      madvise(region, size, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_WILLNEED
+      madvise(region, size, MADV_WILLNEED);
+#endif
+    }
+
+    base = region;
+    mapped = total;
+    len = size;
+    return true;
+  }
+};
+
+MRB_CPP_DEFINE_TYPE(MappedFile, mapped_file);
+
+// Maps the file at path into a hidden data object, which unmaps it once
+// collected.
+static MappedFile*
+mrb_json_map_file(mrb_state *mrb, mrb_value path_str, mrb_value *obj)
+{
+  const char *path = mrb_string_value_cstr(mrb, &path_str);
+  auto *file = mrb_json_hidden_new<MappedFile>(mrb, obj);
+  if (unlikely(!file->map(path))) {
+    mrb_sys_fail(mrb, path);
+  }
+  return file;
+}
+
+// True when the file at path is large enough to be mapped rather than
+// read, see JSON.mmap_threshold.
+static bool
+mrb_json_should_map(mrb_state *mrb, mrb_json_state *state, mrb_value path_str)
+{
+  if (state->mmap_threshold < 0) return false;
+  struct stat st;
+  if (stat(mrb_string_value_cstr(mrb, &path_str), &st) != 0) {
+    return false; // the read path reports the error
+  }
+  return static_cast<int64_t>(st.st_size) >= state->mmap_threshold;
+}
+#endif
+
+// Wraps an mmap'd file in a PaddedStringView that keeps the mapping alive.
+static mrb_value
+mrb_json_mapped_view(mrb_state *mrb, mrb_json_state *state, mrb_value path)
+{
+#ifdef _WIN32
+  return mrb_funcall_argv(mrb, mrb_obj_value(state->padded_string_class), MRB_SYM(load), 1, &path);
+#else
+  mrb_value file_obj;
+  auto *file = mrb_json_map_file(mrb, path, &file_obj);
+
+  mrb_value view_obj = mrb_obj_new(mrb, state->padded_string_view_class, 0, NULL);
+  *mrb_cpp_get<padded_string_view>(mrb, view_obj) = file->view();
+  mrb_iv_set(mrb, view_obj, MRB_SYM(buf), file_obj);
+  return view_obj;
+#endif
+}
+
+static mrb_value
+make_padded_string_view_from_ruby_str(mrb_state *mrb, mrb_value str)
+{
+  mrb_json_state *state = mrb_json_state_get(mrb);
+
+  mrb_int len = RSTRING_LEN(str);
+
+  mrb_value argv[] = {mrb_undef_value(), mrb_undef_value()};
+  mrb_int argc = 0;
+
+  if (state->zero_copy_parsing && likely(!need_allocation(RSTRING_PTR(str), len, RSTRING_CAPA(str)))) {
+    argv[0] = mrb_obj_freeze(mrb, str);
+    argv[1] = mrb_convert_number(mrb, len + SIMDJSON_PADDING);
+    argc = 2;
+
+  } else if (mrb_frozen_p(mrb_obj_ptr(str))) {
+    argv[0] = mrb_obj_new(mrb, state->padded_string_class, 1, &str);
+    argc = 1;
+
+  } else if (unlikely(len > SIZE_MAX - SIMDJSON_PADDING)) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "JSON input too large for padding");
+  } else {
+    mrb_int required = len + SIMDJSON_PADDING;
+
+    if (RSTRING_CAPA(str) < required) {
+      str = mrb_str_resize(mrb, str, required);
+      str = mrb_obj_freeze(mrb, str);
+      RSTR_SET_LEN(RSTRING(str), len);
+    }
+
+    argv[0] = str;
+    argc = 1;
+  }
+
+  return mrb_obj_new(mrb, state->padded_string_view_class, argc, argv);
+}
+
+static mrb_value
+mrb_ondemand_parser_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_int max_capacity = SIMDJSON_MAXSIZE_BYTES;
+
+  mrb_get_args(mrb, "|i", &max_capacity);
+
+  mrb_cpp_new<ondemand::parser>(mrb, self, max_capacity);
+
+  return self;
+}
+
+static mrb_value
+mrb_ondemand_parser_allocate(mrb_state *mrb, mrb_value self)
+{
+  mrb_int new_capacity  = MRB_STR_LENGTH_MAX;
+  mrb_int new_max_depth = DEFAULT_MAX_DEPTH;
+  mrb_get_args(mrb, "|ii", &new_capacity, &new_max_depth);
+
+  auto code = mrb_cpp_get<ondemand::parser>(mrb, self)->allocate(new_capacity, new_max_depth);
+  if (likely(code == SUCCESS)) return self;
+
+  raise_simdjson_error(mrb, code);
+  return mrb_undef_value();
+}
+
+// Counts the documents a JSON::Parser started. A parser holds the index of
+// one document at a time, so a Document, and every JSON::Value in it, is
+// only current while the count is the one it started at.
+struct ParserGeneration {
+  uint64_t count = 0;
+};
+MRB_CPP_DEFINE_TYPE(ParserGeneration, parser_generation);
+
+static uint64_t*
+mrb_json_parser_count(mrb_state *mrb, mrb_value parser_obj)
+{
+  mrb_value obj = mrb_iv_get(mrb, parser_obj, MRB_SYM(generation));
+  if (mrb_nil_p(obj)) {
+    auto *gen = mrb_json_hidden_new<ParserGeneration>(mrb, &obj);
+    mrb_iv_set(mrb, parser_obj, MRB_SYM(generation), obj);
+    return &gen->count;
+  }
+  return &mrb_cpp_get<ParserGeneration>(mrb, obj)->count;
+}
+
+// The JSON::Value handles of a Document that may still be used. simdjson
+// reads a document strictly forwards, so a value can only be navigated
+// while it and its parents are the current path into the document. ids[d]
+// is the live handle at depth d. Navigating from a handle drops the deeper
+// ones; any Document call, rewind or re-iteration drops them all, and so
+// does starting another document with the same parser.
+struct LazyPath {
+  std::vector<uint64_t> ids;
+  uint64_t next_id = 1;
+  uint64_t *parser_count = nullptr; // kept alive by the Document's @parser
+  uint64_t generation = 0;          // *parser_count when the Document started
+  bool reiterable = true;           // false for the iterate_many handle
+
+  bool current() const { return parser_count && *parser_count == generation; }
+
+  void restart() {
+    generation = ++*parser_count;
+    ids.clear();
+  }
+};
+MRB_CPP_DEFINE_TYPE(LazyPath, lazy_path);
+
+static LazyPath*
+mrb_json_doc_lazy_path(mrb_state *mrb, mrb_value doc)
+{
+  mrb_value obj = mrb_iv_get(mrb, doc, MRB_SYM(lazy_path));
+  if (mrb_nil_p(obj)) {
+    auto *path = mrb_json_hidden_new<LazyPath>(mrb, &obj);
+    mrb_iv_set(mrb, doc, MRB_SYM(lazy_path), obj);
+    return path;
+  }
+  return mrb_cpp_get<LazyPath>(mrb, obj);
+}
+
+// Records that doc started a document with parser_obj, which makes every
+// Document and JSON::Value that parser started before stale.
+static LazyPath*
+mrb_json_doc_started(mrb_state *mrb, mrb_value doc, mrb_value parser_obj)
+{
+  LazyPath *path = mrb_json_doc_lazy_path(mrb, doc);
+  path->parser_count = mrb_json_parser_count(mrb, parser_obj);
+  path->restart();
+  return path;
+}
+
+static void
+mrb_json_doc_forget_values(mrb_state *mrb, mrb_value doc)
+{
+  mrb_value obj = mrb_iv_get(mrb, doc, MRB_SYM(lazy_path));
+  if (unlikely(!mrb_nil_p(obj))) {
+    mrb_cpp_get<LazyPath>(mrb, obj)->ids.clear();
+  }
+}
+
+// Reads the freeze: keyword accepted by the lazy parsing entry points and
+// stores it on the new Document for its conversions.
+static mrb_value
+mrb_json_doc_set_flags(mrb_state *mrb, mrb_value doc, mrb_value freeze)
+{
+  if (!mrb_undef_p(freeze) && mrb_test(freeze)) {
+    mrb_iv_set(mrb, doc, MRB_SYM(flags), mrb_convert_number(mrb, MRB_JSON_FREEZE));
+  }
+  return doc;
+}
+
+static mrb_value
+mrb_ondemand_parser_iterate(mrb_state *mrb, mrb_value self)
+{
+  mrb_value arg;
+  mrb_value kw_values[1] = {mrb_undef_value()};
+  mrb_sym kw_names[] = {MRB_SYM(freeze)};
+  mrb_kwargs kwargs = {1, 0, kw_names, kw_values, NULL};
+  mrb_get_args(mrb, "S:", &arg, &kwargs);
+
+  mrb_value view_obj = make_padded_string_view_from_ruby_str(mrb, arg);
+  mrb_value args[] = { view_obj, self };
+  mrb_value doc = mrb_obj_new(mrb, mrb_json_state_get(mrb)->document_class, 2, args);
+  return mrb_json_doc_set_flags(mrb, doc, kw_values[0]);
 }
 
 static mrb_value
 mrb_padded_string_initialize(mrb_state *mrb, mrb_value self)
 {
-  mrb_value buf;
-  mrb_int argc = mrb_get_args(mrb, "|S", &buf);
-  if (argc == 0) {
-    mrb_cpp_new<padded_string>(mrb, self);
-    return self;
+  mrb_value buf;
+  mrb_int argc = mrb_get_args(mrb, "|S", &buf);
+  if (argc == 0) {
+    mrb_cpp_new<padded_string>(mrb, self);
+    return self;
+  }
+
+  mrb_cpp_new<padded_string>(
+    mrb,
+    self,
+    RSTRING_PTR(buf),
+    RSTRING_LEN(buf)
+  );
+
+  return self;
+}
+
+static mrb_value
+mrb_padded_string_s_load(mrb_state *mrb, mrb_value self)
+{
+  mrb_value path;
+  mrb_get_args(mrb, "S", &path);
+
+  std::string_view sv(RSTRING_PTR(path), RSTRING_LEN(path));
+
+  // 1. Load padded_string from file
+  padded_string loaded = padded_string::load(sv);
+
+  // 2. Create Ruby PaddedString object to own the buffer
+  struct RClass *ps_class = mrb_class_ptr(self);
+
+  mrb_value ps_obj = mrb_obj_new(mrb, ps_class, 0, NULL);
+  auto *ps = mrb_cpp_get<padded_string>(mrb, ps_obj);
+  *ps = std::move(loaded);
+
+  // 3. Create padded_string_view from the padded_string
+  padded_string_view psv(*ps);
+
+  // 4. Create Ruby PaddedStringView object
+  struct RClass *psv_class = mrb_json_state_get(mrb)->padded_string_view_class;
+
+  mrb_value view_obj = mrb_obj_new(mrb, psv_class, 0, NULL);
+  auto *view_cpp = mrb_cpp_get<padded_string_view>(mrb, view_obj);
+  *view_cpp = std::move(psv);
+
+  // 5. Store the padded_string inside the view for lifetime safety
+  mrb_iv_set(mrb, view_obj, MRB_SYM(buf), ps_obj);
+
+  return view_obj;
+}
+
+// JSON::PaddedString.mmap(path): like PaddedString.load, but maps the file
+// instead of reading it into the heap (read on Windows).
+static mrb_value
+mrb_padded_string_s_mmap(mrb_state *mrb, mrb_value self)
+{
+  mrb_value path;
+  mrb_get_args(mrb, "S", &path);
+  return mrb_json_mapped_view(mrb, mrb_json_state_get(mrb), path);
+}
+
+// JSON::PaddedString#minify(buffer = nil)
+static mrb_value
+mrb_padded_string_minify(mrb_state *mrb, mrb_value self)
+{
+  mrb_value buffer = mrb_nil_value();
+  mrb_get_args(mrb, "|o", &buffer);
+  auto *ps = mrb_cpp_get<padded_string>(mrb, self);
+  return minify_into(mrb, ps->data(), ps->size(), buffer);
+}
+
+static mrb_value
+mrb_padded_string_view_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_value buf = mrb_undef_value();
+  mrb_int capa = 0;
+  mrb_int argc = mrb_get_args(mrb, "|oi", &buf, &capa);
+
+  if (argc == 0) {
+    mrb_cpp_new<padded_string_view>(mrb, self);
+    return self;
+  }
+
+  if (mrb_string_p(buf)) {
+    mrb_cpp_new<padded_string_view>(
+        mrb, self,
+        RSTRING_PTR(buf),
+        RSTRING_LEN(buf),
+        argc == 1 ? RSTRING_CAPA(buf) : capa);
+  } else {
+    auto *ps = mrb_cpp_get<padded_string>(mrb, buf);
+    auto psv = padded_string_view(*ps);
+    mrb_cpp_new<padded_string_view>(
+      mrb, self,
+      std::move(psv)
+    );
+  }
+
+  mrb_iv_set(mrb, self, MRB_SYM(buf), buf);
+
+  return self;
+}
+
+// Starts iterating view_obj with parser_obj into the Document self.
+static error_code
+mrb_json_doc_iterate(mrb_state *mrb, mrb_value self, mrb_value view_obj, mrb_value parser_obj)
+{
+  auto *view = mrb_cpp_get<padded_string_view>(mrb, view_obj);
+  auto *parser = mrb_cpp_get<ondemand::parser>(mrb, parser_obj);
+  auto *doc = mrb_cpp_new<ondemand::document>(mrb, self);
+  auto code = parser->iterate(*view).get(*doc);
+  if (likely(code == SUCCESS)) {
+    // Store Ruby ivars for rehydration later
+    mrb_iv_set(mrb, self, MRB_SYM(view), view_obj);
+    mrb_iv_set(mrb, self, MRB_SYM(parser), parser_obj);
+    mrb_json_doc_started(mrb, self, parser_obj);
+  }
+  return code;
+}
+
+static mrb_value
+mrb_json_doc_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_value view_obj;
+  mrb_value parser_obj = mrb_undef_value();
+
+  mrb_get_args(mrb, "o|o", &view_obj, &parser_obj);
+
+  if (mrb_undef_p(parser_obj)) {
+    parser_obj = mrb_obj_new(mrb, mrb_json_state_get(mrb)->parser_class, 0, NULL);
+  }
+
+  auto code = mrb_json_doc_iterate(mrb, self, view_obj, parser_obj);
+  if (likely(code == SUCCESS)) {
+    return self;
+  }
+  raise_simdjson_error(mrb, code);
+  return mrb_undef_value();
+}
+
+static mrb_value
+mrb_json_parse_lazy(mrb_state *mrb, mrb_value self)
+{
+  mrb_value str;
+  mrb_value parser_obj = mrb_undef_value();
+  mrb_value kw_values[1] = {mrb_undef_value()};
+  mrb_sym kw_names[] = {MRB_SYM(freeze)};
+  mrb_kwargs kwargs = {1, 0, kw_names, kw_values, NULL};
+  mrb_get_args(mrb, "S|o:", &str, &parser_obj, &kwargs);
+
+  mrb_json_state *state = mrb_json_state_get(mrb);
+
+  // 1. Build padded_string_view from Ruby string
+  mrb_value view_obj = make_padded_string_view_from_ruby_str(mrb, str);
+
+  // 2. Create Parser
+  if (mrb_undef_p(parser_obj)) {
+    parser_obj = mrb_obj_new(mrb, state->parser_class, 0, NULL);
+  }
+
+  // 3. Create Document(view, parser)
+  mrb_value args[2] = { view_obj, parser_obj };
+  mrb_value doc = mrb_obj_new(mrb, state->document_class, 2, args);
+  return mrb_json_doc_set_flags(mrb, doc, kw_values[0]);
+}
+
+// JSON.try_parse_lazy(str, parser = nil, freeze: false): like
+// JSON.parse_lazy, but returns the error class name as a Symbol instead of
+// raising when str can't be indexed. Errors found later, while values are
+// accessed, still raise.
+static mrb_value
+mrb_json_try_parse_lazy(mrb_state *mrb, mrb_value self)
+{
+  mrb_value str;
+  mrb_value parser_obj = mrb_undef_value();
+  mrb_value kw_values[1] = {mrb_undef_value()};
+  mrb_sym kw_names[] = {MRB_SYM(freeze)};
+  mrb_kwargs kwargs = {1, 0, kw_names, kw_values, NULL};
+  mrb_get_args(mrb, "S|o:", &str, &parser_obj, &kwargs);
+
+  mrb_json_state *state = mrb_json_state_get(mrb);
+  mrb_value view_obj = make_padded_string_view_from_ruby_str(mrb, str);
+  if (mrb_undef_p(parser_obj)) {
+    parser_obj = mrb_obj_new(mrb, state->parser_class, 0, NULL);
+  }
+
+  // allocated without calling initialize, which would raise
+  mrb_value doc = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_CDATA, state->document_class));
+  auto code = mrb_json_doc_iterate(mrb, doc, view_obj, parser_obj);
+  if (unlikely(code != SUCCESS)) {
+    return mrb_symbol_value(mrb_json_error_name(mrb, code));
+  }
+  return mrb_json_doc_set_flags(mrb, doc, kw_values[0]);
+}
+
+// Returns a PaddedStringView for a String, PaddedString or PaddedStringView
+// argument of the streaming entry points.
+static mrb_value
+mrb_json_view_arg(mrb_state *mrb, mrb_json_state *state, mrb_value input)
+{
+  if (mrb_string_p(input)) {
+    return make_padded_string_view_from_ruby_str(mrb, input);
+  }
+  if (mrb_obj_is_kind_of(mrb, input, state->padded_string_view_class)) {
+    return input;
+  }
+  if (mrb_obj_is_kind_of(mrb, input, state->padded_string_class)) {
+    return mrb_obj_new(mrb, state->padded_string_view_class, 1, &input);
+  }
+  mrb_raise(mrb, E_TYPE_ERROR, "expected String, JSON::PaddedString or JSON::PaddedStringView");
+  return mrb_undef_value(); // unreachable
+}
+
+// Returns the offset of the line following the one containing pos.
+static size_t
+next_line_start(const char *buf, size_t pos, size_t len)
+{
+  const void *nl = memchr(buf + pos, '\n', len - pos);
+  return nl ? static_cast<size_t>(static_cast<const char *>(nl) - buf) + 1 : len;
+}
+
+// Reads a positive size keyword such as batch_size:, or fallback when it
+// is not given.
+static size_t
+size_kwarg(mrb_state *mrb, mrb_value val, size_t fallback, const char *name)
+{
+  if (mrb_undef_p(val) || mrb_nil_p(val)) return fallback;
+  mrb_int n = mrb_as_int(mrb, val);
+  if (n <= 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "%s must be positive", name);
+  }
+  return static_cast<size_t>(n);
+}
+
+// Upper bounds for the threads: and queue_size: keywords of
+// JSON.each_document. More workers than cores only add contention, and
+// every queued chunk holds a parsed copy of up to batch_size bytes.
+static constexpr size_t max_stream_threads = 64;
+static constexpr size_t max_stream_queue = 4 * max_stream_threads;
+
+// Like size_kwarg, but raises ArgumentError above max.
+static size_t
+bounded_size_kwarg(mrb_state *mrb, mrb_value val, size_t fallback, size_t max, const char *name)
+{
+  size_t n = size_kwarg(mrb, val, fallback, name);
+  if (n > max) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "%s must be at most %d", name, static_cast<mrb_int>(max));
+  }
+  return n;
+}
+
+// The DOM parser used by JSON.each_document. It is taken out of the state
+// while a stream runs, so a nested each_document gets its own. The GC arena
+// keeps it alive meanwhile, as the block may run the GC.
+static mrb_value
+mrb_json_stream_parser_take(mrb_state *mrb, mrb_json_state *state)
+{
+  mrb_value json = mrb_obj_value(state->json_mod);
+  mrb_value parser_obj = mrb_iv_get(mrb, json, MRB_SYM(stream_parser));
+  if (mrb_nil_p(parser_obj)) {
+    mrb_json_hidden_new<dom::parser>(mrb, &parser_obj);
+  } else {
+    mrb_gc_protect(mrb, parser_obj);
+    mrb_iv_set(mrb, json, MRB_SYM(stream_parser), mrb_nil_value());
+  }
+  return parser_obj;
+}
+
+// Runs every document of the newline-delimited or concatenated JSON in buf
+// through parser and calls on_doc with each. Stops at the first error and
+// returns it, unless skip_invalid is set: then the batch that failed is
+// re-read line by line from the last good document, the malformed line is
+// dropped and streaming resumes after it.
+template <typename OnDoc>
+static error_code
+stream_documents(dom::parser &parser, dom::document_stream &stream,
+                 const char *buf, size_t len, size_t batch_size,
+                 bool skip_invalid, OnDoc &&on_doc)
+{
+  size_t pos = 0;
+  while (pos < len) {
+    auto code = parser.parse_many(reinterpret_cast<const uint8_t *>(buf) + pos,
+                                  len - pos, batch_size).get(stream);
+    size_t done = pos; // end of the last good document
+    if (likely(code == SUCCESS)) {
+      for (auto it = stream.begin(); it != stream.end(); ++it) {
+        code = (*it).error();
+        if (unlikely(code != SUCCESS)) break;
+        done = pos + it.current_index() + it.source().size();
+        on_doc(parser.doc);
+      }
+      if (code == SUCCESS && stream.truncated_bytes() > 0) {
+        code = INCOMPLETE_ARRAY_OR_OBJECT;
+      }
+    }
+    if (likely(code == SUCCESS)) break;
+    if (!skip_invalid) return code;
+
+    // Re-read line by line up to and including the first bad record.
+    pos = done;
+    while (pos < len) {
+      const size_t end = next_line_start(buf, pos, len);
+      auto line = parser.parse(buf + pos, end - pos, false).error();
+      pos = end;
+      if (line == SUCCESS) {
+        on_doc(parser.doc);
+      } else if (line != EMPTY) {
+        break;
+      }
+    }
+  }
+  return SUCCESS;
+}
+
+#ifdef SIMDJSON_THREADS_ENABLED
+// The documents of one line-aligned chunk of the input, parsed ahead by a
+// worker thread. Their tapes and string buffers are copied out of the
+// worker's parser, so the mruby thread only has to convert them.
+struct ParsedChunk {
+  std::vector<uint64_t> tapes;
+  std::vector<uint8_t> strings;
+  std::vector<std::pair<size_t, size_t>> docs; // offsets into tapes and strings
+  error_code error = SUCCESS;                  // first error not skipped
+  bool ready = false;
+
+  void append(TapeView doc) {
+    const size_t tape_len = (doc.tape[0] & internal::JSON_VALUE_MASK) + 1;
+    docs.emplace_back(tapes.size(), strings.size());
+    tapes.insert(tapes.end(), doc.tape, doc.tape + tape_len);
+    strings.insert(strings.end(), doc.strings, doc.strings + tape_strings_used(doc));
+  }
+
+  void clear() {
+    tapes.clear();
+    strings.clear();
+    docs.clear();
+    error = SUCCESS;
+    ready = false;
+  }
+};
+
+// Splits newline-delimited input into chunks of about batch_size bytes and
+// has worker threads parse them ahead of the mruby thread, which takes the
+// chunks back in input order. At most queue_size chunks are in flight, so
+// memory stays bounded however far the workers could run ahead.
+class StreamPipeline {
+public:
+  StreamPipeline(const char *buf, size_t len, size_t batch_size,
+                 size_t queue_size, bool skip_invalid)
+  : buf(buf), batch_size(batch_size), skip_invalid(skip_invalid), slots(queue_size) {
+    bounds.push_back(0);
+    while (bounds.back() < len) {
+      size_t pos = std::min(bounds.back() + batch_size, len);
+      bounds.push_back(pos < len ? next_line_start(buf, pos, len) : len);
+    }
+  }
+
+  ~StreamPipeline() { stop(); }
+
+  StreamPipeline(const StreamPipeline&) = delete;
+  StreamPipeline& operator=(const StreamPipeline&) = delete;
+
+  void start(unsigned threads) {
+    for (unsigned i = 0; i < threads; i++) {
+      workers.emplace_back([this] { work(); });
+    }
+  }
+
+  // Waits for the next chunk in input order; nullptr once all are done.
+  ParsedChunk *next() {
+    if (consumed + 1 >= bounds.size()) return nullptr;
+    ParsedChunk &chunk = slot(consumed);
+    std::unique_lock<std::mutex> lock(mutex);
+    chunk_ready.wait(lock, [&] { return chunk.ready; });
+    return &chunk;
+  }
+
+  // Hands the chunk returned by next() back to the workers.
+  void release() {
+    std::lock_guard<std::mutex> lock(mutex);
+    slot(consumed).clear();
+    consumed++;
+    slot_free.notify_all();
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    slot_free.notify_all();
+    for (auto &worker : workers) {
+      if (worker.joinable()) worker.join();
+    }
+    workers.clear();
+  }
+
+private:
+  const char *buf;
+  size_t batch_size;
+  bool skip_invalid;
+  std::vector<size_t> bounds; // chunk i is [bounds[i], bounds[i + 1])
+  std::vector<ParsedChunk> slots;
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable chunk_ready;
+  std::condition_variable slot_free;
+  size_t claimed = 0;  // chunks handed to workers
+  size_t consumed = 0; // chunks taken back by the mruby thread
+  bool stopping = false;
+
+  ParsedChunk &slot(size_t chunk) { return slots[chunk % slots.size()]; }
+
+  void work() {
+    dom::parser parser;
+    parser.threaded = false; // the pipeline is the background thread
+    dom::document_stream stream;
+
+    for (;;) {
+      size_t i;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        slot_free.wait(lock, [&] {
+          return stopping || claimed + 1 >= bounds.size() || claimed < consumed + slots.size();
+        });
+        if (stopping || claimed + 1 >= bounds.size()) return;
+        i = claimed++;
+      }
+
+      ParsedChunk &chunk = slot(i);
+      const size_t len = bounds[i + 1] - bounds[i];
+      chunk.error = stream_documents(parser, stream, buf + bounds[i], len,
+                                     std::max(batch_size, len), skip_invalid,
+                                     [&](const dom::document &doc) { chunk.append(doc); });
+
+      std::lock_guard<std::mutex> lock(mutex);
+      chunk.ready = true;
+      chunk_ready.notify_all();
+    }
+  }
+};
+
+MRB_CPP_DEFINE_TYPE(StreamPipeline, stream_pipeline);
+
+struct PipelineRun {
+  mrb_json_state *state;
+  StreamPipeline *pipeline;
+  ConvertCtx *ctx;
+  mrb_value block;
+  uint32_t flags;
+  mrb_int count;
+};
+
+static mrb_value
+pipeline_consume(mrb_state *mrb, mrb_value data)
+{
+  auto *run = static_cast<PipelineRun *>(mrb_cptr(data));
+  int arena_index = mrb_gc_arena_save(mrb);
+
+  while (ParsedChunk *chunk = run->pipeline->next()) {
+    for (auto [tape, strings] : chunk->docs) {
+      TapeView doc(chunk->tapes.data() + tape, chunk->strings.data() + strings);
+      mrb_yield(mrb, run->block, convert_tape(mrb, run->state, doc, *run->ctx, run->flags));
+      mrb_gc_arena_restore(mrb, arena_index);
+      run->count++;
+    }
+    error_code code = chunk->error;
+    run->pipeline->release();
+    if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+  }
+  return mrb_nil_value();
+}
+
+static mrb_value
+pipeline_stop(mrb_state *mrb, mrb_value data)
+{
+  static_cast<PipelineRun *>(mrb_cptr(data))->pipeline->stop();
+  return mrb_nil_value();
+}
+#endif // SIMDJSON_THREADS_ENABLED
+
+// JSON.each_document(input, batch_size: 1MB, skip_invalid: false,
+//                    threads: nil, queue_size: nil, **opts) { |value| }
+//
+// Parses newline-delimited or concatenated JSON documents with simdjson's
+// document stream and yields each converted value. Returns the number of
+// documents yielded. See stream_documents for skip_invalid.
+//
+// With threads: n, newline-delimited input is split into chunks that n
+// worker threads parse ahead (at most queue_size chunks, default 2 * n)
+// while this thread only converts and yields.
+static mrb_value
+mrb_json_each_document(mrb_state *mrb, mrb_value self)
+{
+  mrb_value input, block;
+  mrb_value kw_values[8] = {mrb_undef_value(), mrb_undef_value(), mrb_undef_value(),
+                            mrb_undef_value(), mrb_undef_value(), mrb_undef_value(),
+                            mrb_undef_value(), mrb_undef_value()};
+  mrb_sym kw_names[] = {MRB_JSON_PARSE_KWARGS, MRB_SYM(batch_size), MRB_SYM(skip_invalid),
+                        MRB_SYM(threads), MRB_SYM(queue_size)};
+  mrb_kwargs kwargs = {8, 0, kw_names, kw_values, NULL};
+  mrb_get_args(mrb, "o:&!", &input, &kwargs, &block);
+
+  const uint32_t flags = flags_from_kwargs(kw_values);
+  const size_t batch_size = size_kwarg(mrb, kw_values[4], dom::DEFAULT_BATCH_SIZE, "batch_size");
+  const bool skip_invalid = !mrb_undef_p(kw_values[5]) && mrb_test(kw_values[5]);
+  const size_t threads = bounded_size_kwarg(mrb, kw_values[6], 0, max_stream_threads, "threads");
+  const size_t queue_size = bounded_size_kwarg(mrb, kw_values[7], threads * 2,
+                                               max_stream_queue, "queue_size");
+#ifndef SIMDJSON_THREADS_ENABLED
+  if (threads > 0) {
+    mrb_raise(mrb, E_NOTIMP_ERROR, "threads: needs a build with thread support");
+  }
+  (void)queue_size;
+#endif
+
+  mrb_json_state *state = mrb_json_state_get(mrb);
+  mrb_value view_obj = mrb_json_view_arg(mrb, state, input);
+  auto *view = mrb_cpp_get<padded_string_view>(mrb, view_obj);
+  const char *buf = view->data();
+  const size_t len = view->length();
+
+  ConvertCtx ctx(mrb, state, flags);
+
+#ifdef SIMDJSON_THREADS_ENABLED
+  if (threads > 0) {
+    mrb_value pipeline_obj;
+    auto *pipeline = mrb_json_hidden_new<StreamPipeline>(mrb, &pipeline_obj, buf, len,
+                                                         batch_size, queue_size, skip_invalid);
+    mrb_iv_set(mrb, pipeline_obj, MRB_SYM(view), view_obj);
+    pipeline->start(static_cast<unsigned>(threads));
+
+    PipelineRun run = {state, pipeline, &ctx, block, flags, 0};
+    mrb_value data = mrb_cptr_value(mrb, &run);
+    mrb_ensure(mrb, pipeline_consume, data, pipeline_stop, data);
+    return mrb_convert_number(mrb, run.count);
+  }
+#endif
+
+  mrb_value parser_obj = mrb_json_stream_parser_take(mrb, state);
+  auto *parser = mrb_cpp_get<dom::parser>(mrb, parser_obj);
+  mrb_value stream_obj;
+  auto *stream = mrb_json_hidden_new<dom::document_stream>(mrb, &stream_obj);
+
+  mrb_int count = 0;
+  int arena_index = mrb_gc_arena_save(mrb);
+  auto code = stream_documents(*parser, *stream, buf, len, batch_size, skip_invalid,
+    [&](const dom::document &doc) {
+      mrb_yield(mrb, block, convert_tape(mrb, state, doc, ctx, flags));
+      mrb_gc_arena_restore(mrb, arena_index);
+      count++;
+    });
+  if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+
+  mrb_iv_set(mrb, mrb_obj_value(state->json_mod), MRB_SYM(stream_parser), parser_obj);
+  return mrb_convert_number(mrb, count);
+}
+
+// One yield of the iterate_many handle. lent is the stream's document the
+// handle holds during the block, or null when the handle was iterated
+// directly. The ensure part hands it back and resets the handle even when
+// the block breaks or raises.
+struct HandleYield {
+  mrb_value block;
+  mrb_value handle;
+  ondemand::document *handle_doc;
+  LazyPath *path;
+  ondemand::document *lent;
+  int arena_index;
+};
+
+static mrb_value
+handle_yield_body(mrb_state *mrb, mrb_value data)
+{
+  auto *y = static_cast<HandleYield *>(mrb_cptr(data));
+  return mrb_yield(mrb, y->block, y->handle);
+}
+
+static mrb_value
+handle_yield_done(mrb_state *mrb, mrb_value data)
+{
+  auto *y = static_cast<HandleYield *>(mrb_cptr(data));
+  if (y->lent) std::swap(*y->handle_doc, *y->lent);
+  y->path->ids.clear();
+  y->path->generation = 0; // a handle kept past the block raises
+  mrb_gc_arena_restore(mrb, y->arena_index);
+  return mrb_nil_value();
+}
+
+static void
+yield_handle(mrb_state *mrb, HandleYield &y)
+{
+  y.path->restart(); // the parser is on the next document now
+  if (y.lent) std::swap(*y.handle_doc, *y.lent);
+  mrb_value data = mrb_cptr_value(mrb, &y);
+  mrb_ensure(mrb, handle_yield_body, data, handle_yield_done, data);
+}
+
+// JSON::Parser#iterate_many(input, batch_size: 1MB, skip_invalid: false, freeze: false) { |doc| }
+//
+// Iterates newline-delimited or concatenated JSON documents On-Demand and
+// yields one JSON::Document handle, re-pointed at each document in turn.
+// The handle is only valid inside the block. Returns the number of
+// documents yielded. skip_invalid: works like for JSON.each_document, but
+// only covers errors found while indexing; errors found while a document
+// is accessed still raise.
+static mrb_value
+mrb_ondemand_parser_iterate_many(mrb_state *mrb, mrb_value self)
+{
+  mrb_value input, block;
+  mrb_value kw_values[3] = {mrb_undef_value(), mrb_undef_value(), mrb_undef_value()};
+  mrb_sym kw_names[] = {MRB_SYM(batch_size), MRB_SYM(skip_invalid), MRB_SYM(freeze)};
+  mrb_kwargs kwargs = {3, 0, kw_names, kw_values, NULL};
+  mrb_get_args(mrb, "o:&!", &input, &kwargs, &block);
+
+  const size_t batch_size = size_kwarg(mrb, kw_values[0], ondemand::DEFAULT_BATCH_SIZE, "batch_size");
+  const bool skip_invalid = !mrb_undef_p(kw_values[1]) && mrb_test(kw_values[1]);
+
+  mrb_json_state *state = mrb_json_state_get(mrb);
+  mrb_value view_obj = mrb_json_view_arg(mrb, state, input);
+  auto *view = mrb_cpp_get<padded_string_view>(mrb, view_obj);
+  const char *buf = view->data();
+  const size_t len = view->length();
+  const size_t capacity = view->capacity();
+  auto *parser = mrb_cpp_get<ondemand::parser>(mrb, self);
+
+  // one handle for all documents
+  mrb_value handle = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_CDATA, state->document_class));
+  auto *handle_doc = mrb_cpp_new<ondemand::document>(mrb, handle);
+  mrb_iv_set(mrb, handle, MRB_SYM(view), view_obj);
+  mrb_iv_set(mrb, handle, MRB_SYM(parser), self);
+  mrb_json_doc_set_flags(mrb, handle, kw_values[2]);
+  LazyPath *handle_path = mrb_json_doc_started(mrb, handle, self);
+  handle_path->reiterable = false;
+
+  mrb_value stream_obj;
+  auto *stream = mrb_json_hidden_new<ondemand::document_stream>(mrb, &stream_obj);
+
+  mrb_int count = 0;
+  int arena_index = mrb_gc_arena_save(mrb);
+
+  size_t pos = 0;
+  while (pos < len) {
+    auto code = parser->iterate_many(reinterpret_cast<const uint8_t *>(buf) + pos,
+                                     len - pos, batch_size).get(*stream);
+    size_t done = pos; // end of the last document yielded
+    if (likely(code == SUCCESS)) {
+      for (auto it = stream->begin(); it != stream->end(); ++it) {
+        auto ref = *it;
+        code = ref.error();
+        if (unlikely(code != SUCCESS)) break;
+        done = pos + it.current_index() + it.source().size();
+
+        // Lend the stream's document to the handle for the block.
+        ondemand::document &doc = ref.value_unsafe();
+        HandleYield y = {block, handle, handle_doc, handle_path, &doc, arena_index};
+        yield_handle(mrb, y);
+        count++;
+      }
+      if (code == SUCCESS && stream->truncated_bytes() > 0) {
+        code = INCOMPLETE_ARRAY_OR_OBJECT;
+      }
+    }
+    if (likely(code == SUCCESS)) break;
+    if (!skip_invalid) raise_simdjson_error(mrb, code);
+
+    // Re-read line by line up to and including the first bad record.
+    pos = done;
+    while (pos < len) {
+      const size_t end = next_line_start(buf, pos, len);
+      auto line = parser->iterate(padded_string_view(buf + pos, end - pos, capacity - pos))
+                    .get(*handle_doc);
+      pos = end;
+      if (line == SUCCESS) {
+        HandleYield y = {block, handle, handle_doc, handle_path, nullptr, arena_index};
+        yield_handle(mrb, y);
+        count++;
+      } else if (line != EMPTY) {
+        break;
+      }
+    }
+  }
+
+  return mrb_convert_number(mrb, count);
+}
+
+// Reads the elements of one JSON array from a file or IO in fixed-size
+// windows. A byte scanner finds the array: the top-level value, or the one
+// a JSON pointer names. It also finds the bounds of each element. String,
+// escape and nesting state carry over from one window to the next, so
+// tokens may straddle a boundary. simdjson parses each element. Elements
+// that fit in one window are parsed in place; only those spanning a
+// boundary are copied. Memory is bounded by the window plus the largest
+// element, not by the input.
+//
+// Pointer tokens are compared with object keys as they appear in the
+// input, so keys written with escape sequences do not match.
+class StreamReader {
+public:
+  std::FILE *file = nullptr; // when reading a path; an IO is kept in @io
+  uint32_t flags = 0;
+  dom::parser parser;
+
+  StreamReader(size_t window, std::vector<PathStep> pointer)
+  : window(window), pointer(std::move(pointer)),
+    buf(new char[window + SIMDJSON_PADDING]()) {}
+
+  ~StreamReader() { close(); }
+
+  StreamReader(const StreamReader&) = delete;
+  StreamReader& operator=(const StreamReader&) = delete;
+
+  void close() {
+    if (file) std::fclose(file);
+    file = nullptr;
+  }
+
+  // Finds the next element of the array and points out at its text, which
+  // is followed by at least SIMDJSON_PADDING readable bytes. out stays empty
+  // once the array has ended.
+  error_code next(mrb_state *mrb, mrb_value io, std::string_view &out) {
+    out = std::string_view();
+    if (owned) {
+      element.clear();
+      owned = false;
+    }
+
+    while (phase != FINISHED) {
+      if (pos == len) {
+        if (start != npos) {
+          element.append(buf.get() + start, len - start);
+          start = 0;
+        }
+        if (!refill(mrb, io)) return end_of_input();
+        continue;
+      }
+
+      const char c = buf[pos];
+      if (phase == SEEK) {
+        pos++;
+        error_code code = seek(c);
+        if (unlikely(code != SUCCESS)) return code;
+        continue;
+      }
+
+      if (in_string) {
+        if (escape) escape = false;
+        else if (c == '\\') escape = true;
+        else if (c == '"') in_string = false;
+        pos++;
+        continue;
+      }
+      if (start == npos) {
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == ',') {
+          pos++;
+          continue;
+        }
+        if (c == ']') {
+          pos++;
+          phase = FINISHED;
+          break;
+        }
+        start = pos;
+        depth = 0;
+      }
+      switch (c) {
+      case '"':
+        in_string = true;
+        break;
+      case '[': case '{':
+        depth++;
+        break;
+      case ']': case '}':
+        // the array's closing bracket is consumed by the next call
+        if (depth == 0) return finish(out);
+        depth--;
+        break;
+      case ',':
+        if (depth == 0) {
+          finish(out);
+          pos++;
+          return SUCCESS;
+        }
+        break;
+      }
+      pos++;
+    }
+    return SUCCESS;
+  }
+
+private:
+  struct Frame {
+    std::string key; // key of the current member
+    size_t index;    // index of the current element
+    bool is_object;
+    bool expect_key;
+  };
+  enum Phase { SEEK, ELEMENTS, FINISHED };
+  static constexpr size_t npos = std::string_view::npos;
+
+  size_t window;
+  std::vector<PathStep> pointer; // compiled once, indexes already parsed
+  std::unique_ptr<char[]> buf;
+  size_t pos = 0, len = 0;
+  Phase phase = SEEK;
+  bool in_string = false, escape = false;
+  // SEEK: the containers around the scan position
+  std::vector<Frame> frames;
+  bool in_key = false, started = false;
+  // ELEMENTS: the element being scanned
+  size_t start = npos;  // its offset in buf, npos between elements
+  size_t depth = 0;
+  std::string element;  // its bytes from earlier windows
+  bool owned = false;   // out points into element
+
+  bool refill(mrb_state *mrb, mrb_value io) {
+    size_t n = 0;
+    if (file) {
+      n = std::fread(buf.get(), 1, window, file);
+      if (n == 0 && std::ferror(file)) mrb_sys_fail(mrb, "failed to read file");
+    } else if (!mrb_nil_p(io)) {
+      mrb_value arg = mrb_convert_number(mrb, static_cast<mrb_int>(window));
+      mrb_value chunk = mrb_funcall_argv(mrb, io, MRB_SYM(read), 1, &arg);
+      if (!mrb_nil_p(chunk)) {
+        mrb_ensure_string_type(mrb, chunk);
+        n = RSTRING_LEN(chunk);
+        if (unlikely(n > window)) {
+          mrb_raise(mrb, E_ARGUMENT_ERROR, "IO#read returned more than window bytes");
+        }
+        memcpy(buf.get(), RSTRING_PTR(chunk), n);
+      }
+    }
+    pos = 0;
+    len = n;
+    return n > 0;
+  }
+
+  error_code end_of_input() {
+    const Phase was = phase;
+    phase = FINISHED;
+    if (was == ELEMENTS) return INCOMPLETE_ARRAY_OR_OBJECT;
+    if (!started) return EMPTY;
+    return frames.empty() ? NO_SUCH_FIELD : INCOMPLETE_ARRAY_OR_OBJECT;
+  }
+
+  error_code finish(std::string_view &out) {
+    const char *p = buf.get() + start;
+    const size_t n = pos - start;
+    start = npos;
+    if (element.empty()) {
+      out = std::string_view(p, n);
+    } else {
+      element.append(p, n);
+      element.reserve(element.size() + SIMDJSON_PADDING);
+      out = element;
+      owned = true;
+    }
+    return SUCCESS;
+  }
+
+  bool at_pointer() const {
+    if (frames.size() != pointer.size()) return false;
+    for (size_t i = 0; i < frames.size(); i++) {
+      const Frame &f = frames[i];
+      if (f.is_object ? f.key != pointer[i].key : f.index != pointer[i].index) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Scans one byte on the way to the array.
+  error_code seek(char c) {
+    if (in_string) {
+      if (escape) escape = false;
+      else if (c == '\\') escape = true;
+      else if (c == '"') {
+        in_string = in_key = false;
+        return SUCCESS;
+      }
+      if (in_key) frames.back().key.push_back(c);
+      return SUCCESS;
+    }
+
+    Frame *top = frames.empty() ? nullptr : &frames.back();
+    switch (c) {
+    case ' ': case '\t': case '\n': case '\r': case ':':
+      return SUCCESS;
+    case ',':
+      if (top && top->is_object) {
+        top->expect_key = true;
+        top->key.clear();
+      } else if (top) {
+        top->index++;
+      }
+      return SUCCESS;
+    case ']': case '}':
+      if (top) frames.pop_back();
+      if (frames.empty()) {
+        phase = FINISHED;
+        return NO_SUCH_FIELD;
+      }
+      return SUCCESS;
+    case '"':
+      if (top && top->is_object && top->expect_key) {
+        top->expect_key = false;
+        in_string = in_key = true;
+        return SUCCESS;
+      }
+      in_string = true;
+      break;
+    }
+
+    // c starts a value, or continues a number or atom
+    started = true;
+    if (at_pointer()) {
+      if (c != '[') {
+        phase = FINISHED;
+        return INCORRECT_TYPE;
+      }
+      in_string = false;
+      phase = ELEMENTS;
+      return SUCCESS;
+    }
+    if (c == '{') frames.push_back({std::string(), 0, true, true});
+    else if (c == '[') frames.push_back({std::string(), 0, false, false});
+    return SUCCESS;
+  }
+};
+
+MRB_CPP_DEFINE_TYPE(StreamReader, stream_reader);
+
+// JSON::StreamReader.new(io_or_path, window: 64KB, pointer: "", **opts)
+static mrb_value
+mrb_stream_reader_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_value source;
+  mrb_value kw_values[6] = {mrb_undef_value(), mrb_undef_value(), mrb_undef_value(),
+                            mrb_undef_value(), mrb_undef_value(), mrb_undef_value()};
+  mrb_sym kw_names[] = {MRB_JSON_PARSE_KWARGS, MRB_SYM(window), MRB_SYM(pointer)};
+  mrb_kwargs kwargs = {6, 0, kw_names, kw_values, NULL};
+  mrb_get_args(mrb, "o:", &source, &kwargs);
+
+  const size_t window = size_kwarg(mrb, kw_values[4], 64 * 1024, "window");
+  CompiledPath pointer;
+  if (!mrb_undef_p(kw_values[5]) && !mrb_nil_p(kw_values[5])) {
+    mrb_value str = mrb_ensure_string_type(mrb, kw_values[5]);
+    auto code = compile_json_pointer(std::string_view(RSTRING_PTR(str), RSTRING_LEN(str)), pointer);
+    if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+  }
+
+  auto *reader = mrb_cpp_new<StreamReader>(mrb, self, window, std::move(pointer.steps));
+  reader->flags = flags_from_kwargs(kw_values);
+  if (mrb_string_p(source)) {
+    const char *path = mrb_string_value_cstr(mrb, &source);
+    reader->file = std::fopen(path, "rb");
+    if (!reader->file) mrb_sys_fail(mrb, path);
+  } else {
+    mrb_iv_set(mrb, self, MRB_SYM(io), source);
+  }
+  return self;
+}
+
+// JSON::StreamReader#each { |value| }
+//
+// Yields the converted elements one at a time. A reader can be iterated
+// once; the file is closed when the array ends.
+static mrb_value
+mrb_stream_reader_each(mrb_state *mrb, mrb_value self)
+{
+  mrb_value block;
+  mrb_get_args(mrb, "&!", &block);
+
+  auto *reader = mrb_cpp_get<StreamReader>(mrb, self);
+  mrb_json_state *state = mrb_json_state_get(mrb);
+  mrb_value io = mrb_iv_get(mrb, self, MRB_SYM(io));
+  const uint32_t flags = reader->flags;
+  ConvertCtx ctx(mrb, state, flags);
+
+  int arena_index = mrb_gc_arena_save(mrb);
+  for (;;) {
+    std::string_view element;
+    error_code code = reader->next(mrb, io, element);
+    if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+    if (element.data() == nullptr) break;
+
+    code = reader->parser.parse(element.data(), element.size(), false).error();
+    if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+    mrb_yield(mrb, block, convert_tape(mrb, state, reader->parser.doc, ctx, flags));
+    mrb_gc_arena_restore(mrb, arena_index);
+  }
+  reader->close();
+  return self;
+}
+
+static mrb_value
+mrb_stream_reader_close(mrb_state *mrb, mrb_value self)
+{
+  mrb_cpp_get<StreamReader>(mrb, self)->close();
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_json_load_lazy(mrb_state *mrb, mrb_value self)
+{
+  mrb_value path;
+  mrb_value parser_obj = mrb_undef_value();
+  mrb_value kw_values[1] = {mrb_undef_value()};
+  mrb_sym kw_names[] = {MRB_SYM(freeze)};
+  mrb_kwargs kwargs = {1, 0, kw_names, kw_values, NULL};
+  mrb_get_args(mrb, "S|o:", &path, &parser_obj, &kwargs);
+
+  mrb_json_state *state = mrb_json_state_get(mrb);
+
+  // 1. Load padded_string_view from file, or map big files
+  mrb_value view_obj;
+#ifndef _WIN32
+  if (mrb_json_should_map(mrb, state, path)) {
+    view_obj = mrb_json_mapped_view(mrb, state, path);
+  } else
+#endif
+  view_obj = mrb_funcall_argv(
+    mrb,
+    mrb_obj_value(state->padded_string_class),
+    MRB_SYM(load),
+    1,
+    &path
+  );
+
+  // 2. Create Parser if none provided
+  if (mrb_undef_p(parser_obj)) {
+    parser_obj = mrb_obj_new(mrb, state->parser_class, 0, NULL);
+  }
+
+  // 3. Create Document(view, parser)
+  mrb_value args[] = { view_obj, parser_obj };
+  mrb_value doc = mrb_obj_new(mrb, state->document_class, 2, args);
+  return mrb_json_doc_set_flags(mrb, doc, kw_values[0]);
+}
+
+static mrb_value convert_ondemand_value_to_mrb(mrb_state* mrb, ondemand::value& v,
+                                               ConvertCtx &ctx);
+
+static mrb_value
+convert_ondemand_array(mrb_state* mrb, ondemand::array arr, ConvertCtx &ctx)
+{
+  bool is_empty;
+  auto code = arr.is_empty().get(is_empty);
+  if (likely(code == SUCCESS)) {
+    mrb_value ary = mrb_ary_new(mrb);
+    if (!is_empty) {
+      int arena = mrb_gc_arena_save(mrb);
+      for (ondemand::value val : arr) {
+        mrb_ary_push(mrb, ary, convert_ondemand_value_to_mrb(mrb, val, ctx));
+        mrb_gc_arena_restore(mrb, arena);
+      }
+    }
+    return ctx.freeze ? mrb_obj_freeze(mrb, ary) : ary;
+  }
+
+  raise_simdjson_error(mrb, code);
+  return mrb_undef_value();
+}
+
+static mrb_value
+convert_ondemand_object(mrb_state* mrb, ondemand::object obj, ConvertCtx &ctx)
+{
+  bool is_empty;
+  auto code = obj.is_empty().get(is_empty);
+  if (likely(code == SUCCESS)) {
+    mrb_value hash = mrb_hash_new(mrb);
+    if (!is_empty) {
+      int arena = mrb_gc_arena_save(mrb);
+      for (auto field : obj) {
+        std::string_view k;
+        ondemand::value v;
+        code = field.unescaped_key().get(k);
+        if (likely(code == SUCCESS)) {
+          code = field.value().get(v);
+        }
+        if (likely(code == SUCCESS)) {
+          mrb_value key = ctx.keys.fetch(mrb, k);
+          mrb_value val = convert_ondemand_value_to_mrb(mrb, v, ctx);
+          mrb_hash_set(mrb, hash, key, val);
+          mrb_gc_arena_restore(mrb, arena);
+        } else {
+          raise_simdjson_error(mrb, code);
+        }
+      }
+    }
+    return ctx.freeze ? mrb_obj_freeze(mrb, hash) : hash;
+  }
+
+  raise_simdjson_error(mrb, code);
+  return mrb_undef_value();
+}
+
+// The raw text of the number at v, which a big integer is parsed from.
+static std::string_view
+ondemand_raw_token(ondemand::value &v)
+{
+  return v.raw_json_token();
+}
+
+static std::string_view
+ondemand_raw_token(ondemand::document &doc)
+{
+  std::string_view sv;
+  doc.raw_json_token().get(sv);
+  return sv;
+}
+
+// Converts the string, number, boolean or null at v, an ondemand::value or
+// a whole ondemand::document: scalar documents cannot be taken as a value,
+// but both have the same getters.
+template <typename Source>
+static mrb_value
+convert_ondemand_scalar(mrb_state *mrb, Source &v, ondemand::json_type type, ConvertCtx &ctx)
+{
+  using namespace ondemand;
+  error_code code;
+
+  switch (type) {
+    case json_type::string: {
+      std::string_view sv;
+      code = v.get_string().get(sv);
+      if (likely(code == SUCCESS)) return convert_string(mrb, sv, ctx);
+    } break;
+    case json_type::number: {
+      number num;
+      code = v.get_number().get(num);
+      if (likely(code == SUCCESS)) {
+        switch (num.get_number_type()) {
+          case number_type::floating_point_number:
+            return mrb_convert_number(mrb, num.get_double());
+          case number_type::signed_integer:
+            return mrb_convert_number(mrb, num.get_int64());
+          case number_type::unsigned_integer:
+            return mrb_convert_number(mrb, num.get_uint64());
+          case number_type::big_integer: {
+            std::string_view sv = ondemand_raw_token(v);
+            return mrb_str_to_integer(mrb, mrb_str_new_static(mrb, sv.data(), sv.size()), 0, 0);
+          }
+          default:
+            mrb_raise(mrb, mrb_json_error_class(mrb, NUMBER_ERROR), "unknown number type");
+        }
+      }
+    } break;
+    case json_type::boolean: {
+      bool b;
+      code = v.get_bool().get(b);
+      if (likely(code == SUCCESS)) return mrb_bool_value(b);
+    } break;
+    case json_type::null: {
+      bool is_null;
+      code = v.is_null().get(is_null);
+      if (likely(code == SUCCESS && is_null)) return mrb_nil_value();
+      if (code == SUCCESS) code = N_ATOM_ERROR;
+    } break;
+    default:
+      mrb_raise(mrb, E_TYPE_ERROR, "unknown JSON type");
+  }
+
+  raise_simdjson_error(mrb, code);
+  return mrb_undef_value();
+}
+
+static mrb_value
+convert_ondemand_value_to_mrb(mrb_state* mrb, ondemand::value& v, ConvertCtx &ctx)
+{
+  using namespace ondemand;
+  json_type type;
+  auto code = v.type().get(type);
+  if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+
+  switch (type) {
+    case json_type::object:
+      return convert_ondemand_object(mrb, v.get_object(), ctx);
+    case json_type::array:
+      return convert_ondemand_array(mrb, v.get_array(), ctx);
+    default:
+      return convert_ondemand_scalar(mrb, v, type, ctx);
+  }
+}
+
+// Conversion flags of a Document, set from the freeze: keyword of
+// JSON.parse_lazy, JSON.load_lazy and Parser#iterate.
+static uint32_t
+mrb_json_doc_flags(mrb_state *mrb, mrb_value self)
+{
+  mrb_value flags = mrb_iv_get(mrb, self, MRB_SYM(flags));
+  return mrb_integer_p(flags) ? static_cast<uint32_t>(mrb_integer(flags)) : 0;
+}
+
+static mrb_value
+convert_ondemand_value_to_mrb(mrb_state* mrb, mrb_value self, ondemand::value& v)
+{
+  ConvertCtx ctx(mrb, mrb_json_doc_flags(mrb, self));
+  return convert_ondemand_value_to_mrb(mrb, v, ctx);
+}
+
+// Converts a whole On-Demand document.
+static mrb_value
+convert_ondemand_document(mrb_state *mrb, ondemand::document &doc, ConvertCtx &ctx)
+{
+  using namespace ondemand;
+  json_type type;
+  auto code = doc.type().get(type);
+  if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+
+  switch (type) {
+    case json_type::object:
+      return convert_ondemand_object(mrb, doc.get_object(), ctx);
+    case json_type::array:
+      return convert_ondemand_array(mrb, doc.get_array(), ctx);
+    default:
+      return convert_ondemand_scalar(mrb, doc, type, ctx);
+  }
+}
+
+// Splits a byte stream that arrives in arbitrary fragments into JSON
+// documents. Bytes are appended to one padded buffer; a scanner that keeps
+// its string, escape and nesting state between feeds finds where each
+// document ends, so no byte is looked at twice. A complete document is
+// iterated in place by one ondemand::parser. Consumed bytes are dropped by
+// moving the unfinished tail to the front of the buffer, which only grows
+// to the largest document plus one fragment.
+//
+// A top-level number or atom such as 42 or true ends at the first
+// whitespace or structural character after it.
+class IncrementalParser {
+public:
+  ondemand::parser parser;
+  ondemand::document doc;
+  size_t max_buffer = SIZE_MAX; // limit for buffered plus appended bytes
+
+  // Appends len bytes, growing or compacting the buffer as needed. Returns
+  // false, appending nothing, when that would hold more than max_buffer.
+  bool append(const char *data, size_t len) {
+    if (len == 0) return true;
+    if (head == tail) head = tail = scan = 0;
+    if (unlikely(len > max_buffer || tail - head > max_buffer - len)) return false;
+    if (tail + len > capacity) {
+      const size_t used = tail - head;
+      if (used + len > capacity) {
+        size_t grown = std::max({capacity * 2, used + len, size_t(4096)});
+        grown = std::max(std::min(grown, max_buffer), used + len);
+        std::unique_ptr<char[]> bigger(new char[grown + SIMDJSON_PADDING]());
+        memcpy(bigger.get(), buf.get() + head, used);
+        buf = std::move(bigger);
+        capacity = grown;
+      } else {
+        memmove(buf.get(), buf.get() + head, used);
+      }
+      scan -= head;
+      if (start != npos) start -= head;
+      tail = used;
+      head = 0;
+    }
+    memcpy(buf.get() + tail, data, len);
+    tail += len;
+    return true;
+  }
+
+  // Scans the new bytes for the end of the next document. Returns false if
+  // none is complete yet; otherwise view covers it and it is consumed.
+  bool next(padded_string_view &view) {
+    while (scan < tail) {
+      const char c = buf[scan];
+      if (in_string) {
+        scan++;
+        if (escape) escape = false;
+        else if (c == '\\') escape = true;
+        else if (c == '"') {
+          in_string = false;
+          if (depth == 0) return take(scan, view);
+        }
+        continue;
+      }
+      if (start == npos) {
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+          scan++;
+          head = scan;
+          continue;
+        }
+        start = scan;
+        depth = 0;
+        atom = false;
+      }
+      if (atom) {
+        switch (c) {
+          case ' ': case '\t': case '\n': case '\r':
+          case '{': case '}': case '[': case ']': case ',': case ':': case '"':
+            return take(scan, view); // c starts the next document
+        }
+        scan++;
+        continue;
+      }
+      scan++;
+      switch (c) {
+        case '"':
+          in_string = true;
+          break;
+        case '{': case '[':
+          depth++;
+          break;
+        case '}': case ']':
+          if (depth > 0) depth--;
+          if (depth == 0) return take(scan, view);
+          break;
+        default:
+          if (depth == 0) atom = true;
+          break;
+      }
+    }
+    return false;
+  }
+
+  size_t buffered() const { return tail - head; }
+
+  void reset() {
+    head = tail = scan = 0;
+    start = npos;
+    depth = 0;
+    in_string = escape = atom = false;
+  }
+
+private:
+  static constexpr size_t npos = std::string_view::npos;
+
+  std::unique_ptr<char[]> buf;
+  size_t capacity = 0;
+  size_t head = 0;    // first byte not yet consumed
+  size_t tail = 0;    // end of the bytes fed so far
+  size_t scan = 0;    // first byte not yet scanned
+  size_t start = npos; // start of the document being scanned
+  size_t depth = 0;
+  bool in_string = false, escape = false, atom = false;
+
+  bool take(size_t end, padded_string_view &view) {
+    view = padded_string_view(buf.get() + start, end - start,
+                              capacity + SIMDJSON_PADDING - start);
+    start = npos;
+    head = end;
+    return true;
+  }
+};
+
+MRB_CPP_DEFINE_TYPE(IncrementalParser, incremental_parser);
+
+// JSON::IncrementalParser.new(freeze: false, max_buffer: nil)
+static mrb_value
+mrb_incremental_parser_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_value kw_values[2] = {mrb_undef_value(), mrb_undef_value()};
+  mrb_sym kw_names[] = {MRB_SYM(freeze), MRB_SYM(max_buffer)};
+  mrb_kwargs kwargs = {2, 0, kw_names, kw_values, NULL};
+  mrb_get_args(mrb, ":", &kwargs);
+
+  const size_t max_buffer = size_kwarg(mrb, kw_values[1], SIZE_MAX, "max_buffer");
+  auto *ip = mrb_cpp_new<IncrementalParser>(mrb, self);
+  ip->max_buffer = max_buffer;
+  return mrb_json_doc_set_flags(mrb, self, kw_values[0]);
+}
+
+struct IncrementalConvert {
+  IncrementalParser *ip;
+  padded_string_view view;
+  ConvertCtx *ctx;
+};
+
+static mrb_value
+incremental_convert(mrb_state *mrb, void *data)
+{
+  auto *c = static_cast<IncrementalConvert *>(data);
+  auto code = c->ip->parser.iterate(c->view).get(c->ip->doc);
+  if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+  return convert_ondemand_document(mrb, c->ip->doc, *c->ctx);
+}
+
+// JSON::IncrementalParser#feed(bytes) { |value| }
+//
+// Appends bytes and converts every document they complete. With a block
+// each value is yielded as soon as it is complete and the number of values
+// is returned; without one they are returned as an array. A malformed
+// document raises after it has been dropped, so feeding can continue.
+// Without a block, values converted before it are returned first and the
+// error is raised by the next feed, after its bytes were buffered.
+//
+// When the buffered bytes plus bytes would exceed max_buffer, the
+// unfinished document is dropped, nothing is appended and
+// JSON::CapacityError is raised.
+static mrb_value
+mrb_incremental_parser_feed(mrb_state *mrb, mrb_value self)
+{
+  const char *data;
+  mrb_int len;
+  mrb_value block = mrb_nil_value();
+  mrb_get_args(mrb, "s&", &data, &len, &block);
+
+  auto *ip = mrb_cpp_get<IncrementalParser>(mrb, self);
+  if (unlikely(!ip->append(data, static_cast<size_t>(len)))) {
+    ip->reset();
+    mrb_iv_set(mrb, self, MRB_SYM(pending_error), mrb_nil_value());
+    raise_simdjson_error(mrb, CAPACITY);
+  }
+  mrb_value pending = mrb_iv_get(mrb, self, MRB_SYM(pending_error));
+  if (unlikely(!mrb_nil_p(pending))) {
+    mrb_iv_set(mrb, self, MRB_SYM(pending_error), mrb_nil_value());
+    mrb_exc_raise(mrb, pending);
   }
 
-  mrb_cpp_new<padded_string>(
-    mrb,
-    self,
-    RSTRING_PTR(buf),
-    RSTRING_LEN(buf)
-  );
+  ConvertCtx ctx(mrb, mrb_json_doc_flags(mrb, self));
+  mrb_value result = mrb_nil_p(block) ? mrb_ary_new(mrb) : mrb_nil_value();
+  mrb_int count = 0;
+  int arena_index = mrb_gc_arena_save(mrb);
 
-  return self;
+  IncrementalConvert conv = {ip, padded_string_view(), &ctx};
+  while (ip->next(conv.view)) {
+    if (!mrb_nil_p(block)) {
+      mrb_yield(mrb, block, incremental_convert(mrb, &conv));
+    } else {
+      mrb_bool failed = FALSE;
+      mrb_value value = mrb_protect_error(mrb, incremental_convert, &conv, &failed);
+      if (unlikely(failed)) {
+        if (RARRAY_LEN(result) == 0) mrb_exc_raise(mrb, value);
+        mrb_iv_set(mrb, self, MRB_SYM(pending_error), value);
+        break;
+      }
+      mrb_ary_push(mrb, result, value);
+    }
+    mrb_gc_arena_restore(mrb, arena_index);
+    count++;
+  }
+  return mrb_nil_p(block) ? result : mrb_convert_number(mrb, count);
 }
 
+// Number of bytes fed but not yet part of a complete document.
 static mrb_value
-mrb_padded_string_s_load(mrb_state *mrb, mrb_value self)
+mrb_incremental_parser_buffered(mrb_state *mrb, mrb_value self)
 {
-  mrb_value path;
-  mrb_get_args(mrb, "S", &path);
+  return mrb_convert_number(mrb, mrb_cpp_get<IncrementalParser>(mrb, self)->buffered());
+}
 
-  std::string_view sv(RSTRING_PTR(path), RSTRING_LEN(path));
+// Drops any partial document, e.g. after a connection is reset.
+static mrb_value
+mrb_incremental_parser_reset(mrb_state *mrb, mrb_value self)
+{
+  mrb_cpp_get<IncrementalParser>(mrb, self)->reset();
+  mrb_iv_set(mrb, self, MRB_SYM(pending_error), mrb_nil_value());
+  return self;
+}
 
-  // 1. Load padded_string from file
-  padded_string loaded = padded_string::load(sv);
+// Returns the document of self, iterated again from the start when its
+// parser has moved on to another document since.
+static ondemand::document*
+mrb_json_doc_get(mrb_state* mrb, mrb_value self)
+{
+  ondemand::document *doc = mrb_cpp_get<ondemand::document>(mrb, self);
+  LazyPath *path = mrb_json_doc_lazy_path(mrb, self);
+  path->ids.clear();
 
-  // 2. Create Ruby PaddedString object to own the buffer
-  struct RClass *json_mod = mrb_module_get_id(mrb, MRB_SYM(JSON));
-  struct RClass *ps_class = mrb_class_ptr(self);
+  if (likely(doc->is_alive() && path->current())) {
+    return doc;
+  }
+  // the iterate_many handle has no document of its own to go back to
+  if (unlikely(!path->reiterable)) raise_simdjson_error(mrb, OUT_OF_ORDER_ITERATION);
 
-  mrb_value ps_obj = mrb_obj_new(mrb, ps_class, 0, NULL);
-  auto *ps = mrb_cpp_get<padded_string>(mrb, ps_obj);
-  *ps = std::move(loaded);
+  mrb_value view_obj   = mrb_iv_get(mrb, self, MRB_SYM(view));
+  mrb_value parser_obj = mrb_iv_get(mrb, self, MRB_SYM(parser));
 
-  // 3. Create padded_string_view from the padded_string
-  padded_string_view psv(*ps);
+  auto *view = mrb_cpp_get<padded_string_view>(mrb, view_obj);
+  auto *parser = mrb_cpp_get<ondemand::parser>(mrb, parser_obj);
 
-  // 4. Create Ruby PaddedStringView object
-  struct RClass *psv_class =
-    mrb_class_get_under_id(mrb, json_mod, MRB_SYM(PaddedStringView));
+  auto code = parser->iterate(*view).get(*doc);
+  if (likely(code == SUCCESS)) {
+    path->restart();
+    return doc;
+  }
 
-  mrb_value view_obj = mrb_obj_new(mrb, psv_class, 0, NULL);
-  auto *view_cpp = mrb_cpp_get<padded_string_view>(mrb, view_obj);
-  *view_cpp = std::move(psv);
+  raise_simdjson_error(mrb, code);
+  return nullptr;
+}
 
-  // 5. Store the padded_string inside the view for lifetime safety
-  mrb_iv_set(mrb, view_obj, MRB_SYM(buf), ps_obj);
+static bool
+is_lookup_miss(simdjson::error_code code)
+{
+  return code == NO_SUCH_FIELD ||
+         code == OUT_OF_BOUNDS ||
+         code == INDEX_OUT_OF_BOUNDS ||
+         code == INCORRECT_TYPE;
+}
 
-  return view_obj;
+// A String or Symbol key without allocating.
+static bool
+lookup_key(mrb_state *mrb, mrb_value key, std::string_view &out)
+{
+  if (mrb_string_p(key)) {
+    out = std::string_view(RSTRING_PTR(key), RSTRING_LEN(key));
+    return true;
+  }
+  if (mrb_symbol_p(key)) {
+    mrb_int len;
+    const char *name = mrb_sym_name_len(mrb, mrb_symbol(key), &len);
+    out = std::string_view(name, static_cast<size_t>(len));
+    return true;
+  }
+  return false;
 }
 
 static mrb_value
-mrb_padded_string_view_initialize(mrb_state *mrb, mrb_value self)
+mrb_json_doc_aref(mrb_state* mrb, mrb_value self)
 {
-  mrb_value buf = mrb_undef_value();
-  mrb_int capa = 0;
-  mrb_int argc = mrb_get_args(mrb, "|oi", &buf, &capa);
+  mrb_value key;
+  mrb_get_args(mrb, "o", &key);
 
-  if (argc == 0) {
-    mrb_cpp_new<padded_string_view>(mrb, self);
-    return self;
+  std::string_view k;
+  if (!lookup_key(mrb, key, k)) {
+    mrb_raise(mrb, E_TYPE_ERROR, "key must be a String or Symbol");
   }
+  auto *const doc = mrb_json_doc_get(mrb, self);
 
-  if (mrb_string_p(buf)) {
-    mrb_cpp_new<padded_string_view>(
-        mrb, self,
-        RSTRING_PTR(buf),
-        RSTRING_LEN(buf),
-        argc == 1 ? RSTRING_CAPA(buf) : capa);
-  } else {
-    auto *ps = mrb_cpp_get<padded_string>(mrb, buf);
-    auto psv = padded_string_view(*ps);
-    mrb_cpp_new<padded_string_view>(
-      mrb, self,
-      std::move(psv)
-    );
-  }
+  ondemand::value val;
+  auto code = (*doc)[k].get(val);
+  if (likely(code == SUCCESS)) return convert_ondemand_value_to_mrb(mrb, self, val);
 
-  mrb_iv_set(mrb, self, MRB_SYM(buf), buf);
+  if (is_lookup_miss(code))  return mrb_nil_value();
 
-  return self;
+  raise_simdjson_error(mrb, code);
+  return mrb_undef_value();
 }
 
 static mrb_value
-mrb_json_doc_initialize(mrb_state *mrb, mrb_value self)
+mrb_json_doc_fetch(mrb_state* mrb, mrb_value self)
 {
-  mrb_value view_obj;
-  mrb_value parser_obj = mrb_undef_value();
+  mrb_value key_or_index;
+  mrb_value default_val = mrb_undef_value();
+  mrb_value block = mrb_undef_value();
 
-  mrb_get_args(mrb, "o|o", &view_obj, &parser_obj);
-  auto *view = mrb_cpp_get<padded_string_view>(mrb, view_obj);
+  // accept any object as first arg, optional default, optional block
+  mrb_get_args(mrb, "o|o&", &key_or_index, &default_val, &block);
 
-  struct RClass *json_mod = mrb_module_get_id(mrb, MRB_SYM(JSON));
-  if (mrb_undef_p(parser_obj)) {
-    parser_obj = mrb_obj_new(
-      mrb,
-      mrb_class_get_under_id(mrb, json_mod, MRB_SYM(Parser)),
-      0, NULL
-    );
+  auto *const doc = mrb_json_doc_get(mrb, self);
+
+  // If first arg is an Integer -> array index path
+  if (mrb_integer_p(key_or_index)) {
+    mrb_int idx = mrb_integer(key_or_index);
+    ondemand::value val;
+    auto code = doc->at(static_cast<size_t>(idx)).get(val);
+
+    if (likely(code == SUCCESS)) {
+      return convert_ondemand_value_to_mrb(mrb, self, val);
+    }
+
+    if (is_lookup_miss(code)) {
+      if (!mrb_undef_p(default_val)) return default_val;
+      if (mrb_proc_p(block)) return mrb_yield(mrb, block, key_or_index);
+      mrb_raise(mrb, E_INDEX_ERROR, "index not found");
+    }
+
+    raise_simdjson_error(mrb, code);
+    return mrb_undef_value(); // unreachable
   }
 
-  auto *parser = mrb_cpp_get<ondemand::parser>(mrb, parser_obj);
-  auto *doc = mrb_cpp_new<ondemand::document>(mrb, self);
-  auto code = parser->iterate(*view).get(*doc);
+  // Otherwise treat as string key (convert to string view)
+  mrb_value key_str = mrb_obj_as_string(mrb, key_or_index);
+  std::string_view k(RSTRING_PTR(key_str), RSTRING_LEN(key_str));
+  ondemand::value val;
+  auto code = (*doc)[k].get(val);
+
   if (likely(code == SUCCESS)) {
-    // Store Ruby ivars for rehydration later
-    mrb_iv_set(mrb, self, MRB_SYM(view), view_obj);
-    mrb_iv_set(mrb, self, MRB_SYM(parser), parser_obj);
+    return convert_ondemand_value_to_mrb(mrb, self, val);
+  }
 
-    return self;
+  if (is_lookup_miss(code)) {
+    if (!mrb_undef_p(default_val)) return default_val;
+    if (mrb_proc_p(block)) return mrb_yield(mrb, block, key_or_index);
+    mrb_raise(mrb, E_KEY_ERROR, "key not found");
   }
+
   raise_simdjson_error(mrb, code);
-  return mrb_undef_value();
+  return mrb_undef_value(); // unreachable
 }
 
 static mrb_value
-mrb_json_parse_lazy(mrb_state *mrb, mrb_value self)
+mrb_json_doc_find_field(mrb_state* mrb, mrb_value self)
 {
-  mrb_value str;
-  mrb_value parser_obj = mrb_undef_value();
-  mrb_get_args(mrb, "S|o", &str, &parser_obj);
+  mrb_value key;
+  mrb_get_args(mrb, "S", &key);
 
-  struct RClass *json_mod = mrb_class_ptr(self);
+  auto *const doc = mrb_json_doc_get(mrb, self);
 
-  // 1. Build padded_string_view from Ruby string
-  mrb_value view_obj = make_padded_string_view_from_ruby_str(mrb, str);
+  std::string_view k(RSTRING_PTR(key), RSTRING_LEN(key));
+  ondemand::value val;
+  const auto code = doc->find_field(k).get(val);
+  if (likely(code == SUCCESS)) return convert_ondemand_value_to_mrb(mrb, self, val);
 
-  // 2. Create Parser
-  if (mrb_undef_p(parser_obj)) {
-    parser_obj = mrb_obj_new(
-      mrb,
-      mrb_class_get_under_id(mrb, json_mod, MRB_SYM(Parser)),
-      0, NULL
-    );
+  if (is_lookup_miss(code))  return mrb_nil_value();
+
+  raise_simdjson_error(mrb, code);
+  return mrb_undef_value(); // unreachable
+}
+
+static mrb_value
+mrb_json_doc_find_field_unordered(mrb_state* mrb, mrb_value self)
+{
+  mrb_value key;
+  mrb_get_args(mrb, "S", &key);
+
+  auto *const doc = mrb_json_doc_get(mrb, self);
+
+  std::string_view k(RSTRING_PTR(key), RSTRING_LEN(key));
+  ondemand::value val;
+  auto code = doc->find_field_unordered(k).get(val);
+  if (likely(code == SUCCESS)) return convert_ondemand_value_to_mrb(mrb, self, val);
+  if (is_lookup_miss(code))  return mrb_nil_value();
+
+  raise_simdjson_error(mrb, code);
+  return mrb_undef_value(); // unreachable
+}
+
+static mrb_value
+mrb_json_doc_at(mrb_state* mrb, mrb_value self)
+{
+  mrb_int index;
+  mrb_get_args(mrb, "i", &index);
+
+  auto *const doc = mrb_json_doc_get(mrb, self);
+
+  ondemand::value val;
+  const auto code = doc->at(index).get(val);
+  if (likely(code == SUCCESS)) {
+    return convert_ondemand_value_to_mrb(mrb, self, val);
   }
 
-  // 3. Create Document(view, parser)
-  mrb_value args[2] = { view_obj, parser_obj };
-  return mrb_obj_new(
-    mrb,
-    mrb_class_get_under_id(mrb, json_mod, MRB_SYM(Document)),
-    2, args
-  );
+  if (is_lookup_miss(code))  return mrb_nil_value();
+
+  raise_simdjson_error(mrb, code);
+  return mrb_undef_value(); // unreachable
+}
+
+// The compiled form of a path argument: a JSON::Pointer or JSON::Path, or
+// a String read as a JSON Pointer (or as a JSONPath when json_path is set)
+// and compiled through the state's cache.
+static PathRef
+mrb_json_path_arg(mrb_state *mrb, mrb_value arg, bool json_path)
+{
+  mrb_json_state *state = mrb_json_state_get(mrb);
+  if (mrb_string_p(arg)) {
+    PathCache &cache = json_path ? state->paths : state->pointers;
+    error_code code = SUCCESS;
+    PathRef path = cache.compile(std::string_view(RSTRING_PTR(arg), RSTRING_LEN(arg)),
+                                 json_path, &code);
+    if (unlikely(!path)) raise_simdjson_error(mrb, code);
+    return path;
+  }
+  if (!mrb_obj_is_kind_of(mrb, arg, state->pointer_class) &&
+      !mrb_obj_is_kind_of(mrb, arg, state->path_class)) {
+    mrb_raise(mrb, E_TYPE_ERROR, "path must be a String, JSON::Pointer or JSON::Path");
+  }
+  return PathRef(PathRef(), mrb_cpp_get<CompiledPath>(mrb, arg));
+}
+
+static mrb_value
+mrb_json_doc_at_compiled(mrb_state *mrb, mrb_value self, const CompiledPath &path, bool lazy);
+
+static mrb_value
+mrb_json_doc_at_pointer(mrb_state* mrb, mrb_value self)
+{
+  mrb_value ptr_val;
+  mrb_get_args(mrb, "o", &ptr_val);
+
+  return mrb_json_doc_at_compiled(mrb, self, *mrb_json_path_arg(mrb, ptr_val, false), false);
 }
 
 static mrb_value
-mrb_json_load_lazy(mrb_state *mrb, mrb_value self)
+mrb_json_doc_at_path(mrb_state* mrb, mrb_value self)
 {
-  mrb_value path;
-  mrb_value parser_obj = mrb_undef_value();
-  mrb_get_args(mrb, "S|o", &path, &parser_obj);
-
-  struct RClass *json_mod = mrb_class_ptr(self);
+  mrb_value path_val;
+  mrb_get_args(mrb, "o", &path_val);
 
-  // 1. Load padded_string_view from file
-  mrb_value view_obj = mrb_funcall_argv(
-    mrb,
-    mrb_obj_value(mrb_class_get_under_id(mrb, json_mod, MRB_SYM(PaddedString))),
-    MRB_SYM(load),
-    1,
-    &path
-  );
+  return mrb_json_doc_at_compiled(mrb, self, *mrb_json_path_arg(mrb, path_val, true), false);
+}
 
-  // 2. Create Parser if none provided
-  if (mrb_undef_p(parser_obj)) {
-    parser_obj = mrb_obj_new(
-      mrb,
-      mrb_class_get_under_id(mrb, json_mod, MRB_SYM(Parser)),
-      0, NULL
-    );
+// Where path_collect puts the values it reaches: pushed to out, or yielded
+// to block as each is found. token marks the walk in the Document's
+// LazyPath; a block that uses the Document drops it, and the walk stops.
+struct PathSink {
+  mrb_value out;
+  mrb_value block;
+  LazyPath *doc_path;
+  uint64_t token;
+
+  bool walk_intact() const {
+    return doc_path->current() && !doc_path->ids.empty() && doc_path->ids[0] == token;
   }
+};
 
-  // 3. Create Document(view, parser)
-  mrb_value args[] = { view_obj, parser_obj };
-  return mrb_obj_new(
-    mrb,
-    mrb_class_get_under_id(mrb, json_mod, MRB_SYM(Document)),
-    2, args
-  );
-}
-
-static mrb_value convert_ondemand_value_to_mrb(mrb_state* mrb, ondemand::value& v);
+template <typename T>
+static error_code
+path_collect(mrb_state *mrb, T &from, const CompiledPath &path, size_t i,
+             ConvertCtx &ctx, PathSink &sink);
 
+// Returns an Array of every value the path reaches; a branch of a
+// wildcard that misses adds nothing. With a block each value is yielded
+// as soon as it is reached instead, and self is returned. The block must
+// not use the Document; doing so raises OutOfOrderIterationError once it
+// returns.
 static mrb_value
-convert_ondemand_array(mrb_state* mrb, ondemand::array arr)
+mrb_json_doc_at_path_with_wildcard(mrb_state* mrb, mrb_value self)
 {
-  bool is_empty;
-  auto code = arr.is_empty().get(is_empty);
-  if (likely(code == SUCCESS)) {
-    if (is_empty) {
-      return mrb_ary_new(mrb);
-    }
+  mrb_value path_val;
+  mrb_value block = mrb_undef_value();
+  mrb_get_args(mrb, "o|&", &path_val, &block);
 
-    mrb_value ary = mrb_ary_new(mrb);
-    int arena = mrb_gc_arena_save(mrb);
-    for (ondemand::value val : arr) {
-      mrb_ary_push(mrb, ary, convert_ondemand_value_to_mrb(mrb, val));
-      mrb_gc_arena_restore(mrb, arena);
-    }
-    return ary;
-  }
+  PathRef path = mrb_json_path_arg(mrb, path_val, true);
+  auto *const doc = mrb_json_doc_get(mrb, self);
+  ConvertCtx ctx(mrb, mrb_json_doc_flags(mrb, self));
+  const bool yielding = mrb_proc_p(block);
+  LazyPath *doc_path = mrb_json_doc_lazy_path(mrb, self);
+  PathSink sink = {yielding ? mrb_nil_value() : mrb_ary_new(mrb), block,
+                   doc_path, doc_path->next_id++};
+  doc_path->ids.assign(1, sink.token);
+  doc->rewind();
+  auto code = path_collect(mrb, *doc, *path, 0, ctx, sink);
+  if (sink.walk_intact()) doc_path->ids.clear();
+  if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
 
-  raise_simdjson_error(mrb, code);
-  return mrb_undef_value();
+  return yielding ? self : sink.out;
 }
 
 static mrb_value
-convert_ondemand_object(mrb_state* mrb, ondemand::object obj)
+mrb_json_doc_array_each(mrb_state* mrb, mrb_value self)
 {
-  bool is_empty;
-  auto code = obj.is_empty().get(is_empty);
-  if (likely(code == SUCCESS)) {
-    if (is_empty) {
-      return mrb_hash_new(mrb);
-    }
+  mrb_value block = mrb_undef_value();
+  mrb_get_args(mrb, "|&", &block);
 
-    mrb_value hash = mrb_hash_new(mrb);
-    int arena = mrb_gc_arena_save(mrb);
-    for (auto field : obj) {
-      std::string_view k;
-      ondemand::value v;
-      code = field.unescaped_key().get(k);
-      if (likely(code == SUCCESS)) {
-        code = field.value().get(v);
+  auto *const doc = mrb_json_doc_get(mrb, self);
+  ondemand::array array;
+  auto code = doc->get_array().get(array);
+  if (likely(code == SUCCESS)) {
+    ConvertCtx ctx(mrb, mrb_json_doc_flags(mrb, self));
+    if (mrb_proc_p(block)) {
+      int arena = mrb_gc_arena_save(mrb);
+      for (ondemand::value v : array) {
+        mrb_value ruby_val = convert_ondemand_value_to_mrb(mrb, v, ctx);
+        mrb_yield(mrb, block, ruby_val);
+        mrb_gc_arena_restore(mrb, arena);
       }
+      return self;
+    } else {
+      size_t capa;
+      code = array.count_elements().get(capa);
       if (likely(code == SUCCESS)) {
-        mrb_value key = mrb_str_new(mrb, k.data(), k.size());
-        mrb_value val = convert_ondemand_value_to_mrb(mrb, v);
-        mrb_hash_set(mrb, hash, key, val);
-        mrb_gc_arena_restore(mrb, arena);
-      } else {
-        raise_simdjson_error(mrb, code);
+        mrb_value ary = mrb_ary_new_capa(mrb, capa);
+        int arena = mrb_gc_arena_save(mrb);
+        for (ondemand::value v : array) {
+          mrb_value ruby_val = convert_ondemand_value_to_mrb(mrb, v, ctx);
+          mrb_ary_push(mrb, ary, ruby_val);
+          mrb_gc_arena_restore(mrb, arena);
+        }
+        return ctx.freeze ? mrb_obj_freeze(mrb, ary) : ary;
       }
+      raise_simdjson_error(mrb, code);
     }
-    return hash;
   }
 
   raise_simdjson_error(mrb, code);
@@ -665,33 +3146,62 @@ convert_ondemand_object(mrb_state* mrb, ondemand::object obj)
 }
 
 static mrb_value
-convert_number_from_ondemand(mrb_state *mrb, ondemand::value& v)
+mrb_json_doc_object_each(mrb_state* mrb, mrb_value self)
 {
-  using namespace ondemand;
+  mrb_value block = mrb_undef_value();
+  mrb_get_args(mrb, "|&", &block);
 
-  number number;
-  auto code = v.get_number().get(number);
+  auto* const doc = mrb_json_doc_get(mrb, self);
+  ondemand::object object;
+  auto code = doc->get_object().get(object);
   if (likely(code == SUCCESS)) {
-    switch (number.get_number_type()) {
-      case number_type::floating_point_number: {
-        return mrb_convert_number(mrb, number.get_double());
-      } break;
-      case number_type::signed_integer: {
-        return mrb_convert_number(mrb, number.get_int64());
-      } break;
+    ConvertCtx ctx(mrb, mrb_json_doc_flags(mrb, self));
+    if (mrb_proc_p(block)) {
+      int arena = mrb_gc_arena_save(mrb);
+      for (auto field : object) {
+        std::string_view k;
+        ondemand::value v;
+        code = field.unescaped_key().get(k);
+        if (likely(code == SUCCESS)) {
+          code = field.value().get(v);
+        }
+        if (likely(code == SUCCESS)) {
 
-      case number_type::unsigned_integer: {
-        return mrb_convert_number(mrb, number.get_uint64());
-      } break;
+          mrb_value key = ctx.keys.fetch(mrb, k);
+          mrb_value val = convert_ondemand_value_to_mrb(mrb, v, ctx);
+
+          mrb_value argv[] = {key, val};
+          mrb_yield_argv(mrb, block, 2, argv);
 
-      case number_type::big_integer: {
-        auto sv = v.raw_json_token();
+          mrb_gc_arena_restore(mrb, arena);
+        } else {
+          raise_simdjson_error(mrb, code);
+        }
+      }
 
-        return mrb_str_to_integer(mrb, mrb_str_new_static(mrb, sv.data(), sv.size()), 0, 0);
-      } break;
+      return self;
+    } else {
+      mrb_value hash = mrb_hash_new(mrb);
+      int arena = mrb_gc_arena_save(mrb);
 
-      default:
-        mrb_raise(mrb, E_JSON_NUMBER_ERROR, "unknown number type");
+      for (auto field : object) {
+        std::string_view k;
+        ondemand::value v;
+        code = field.unescaped_key().get(k);
+        if (likely(code == SUCCESS)) {
+          code = field.value().get(v);
+        }
+        if (likely(code == SUCCESS)) {
+
+          mrb_value key = ctx.keys.fetch(mrb, k);
+          mrb_value val = convert_ondemand_value_to_mrb(mrb, v, ctx);
+
+          mrb_hash_set(mrb, hash, key, val);
+
+          mrb_gc_arena_restore(mrb, arena);
+        }
+      }
+      return ctx.freeze ? mrb_obj_freeze(mrb, hash) : hash;
     }
   }
 
@@ -700,424 +3210,944 @@ convert_number_from_ondemand(mrb_state *mrb, ondemand::value& v)
 }
 
 static mrb_value
-convert_string_from_ondemand(mrb_state* mrb, ondemand::value& v)
+mrb_json_doc_rewind(mrb_state* mrb, mrb_value self)
 {
-  std::string_view dec;
-  auto code = v.get_string().get(dec);
-
-  if (likely(code == SUCCESS)) {
-    return mrb_str_new(mrb, dec.data(), dec.size());
-  }
+  auto *const doc = mrb_json_doc_get(mrb, self);
+  doc->rewind();
 
-  raise_simdjson_error(mrb, code);
-  return mrb_undef_value();
+  return self;
 }
 
 static mrb_value
-convert_ondemand_value_to_mrb(mrb_state* mrb, ondemand::value& v)
+mrb_json_doc_reiterate(mrb_state *mrb, mrb_value self)
 {
-  using namespace ondemand;
-  switch (v.type()) {
-    case json_type::object:
-      return convert_ondemand_object(mrb, v.get_object());
-    case json_type::array:
-      return convert_ondemand_array(mrb, v.get_array());
-    case json_type::string:
-      return convert_string_from_ondemand(mrb, v);
-    case json_type::number:
-      return convert_number_from_ondemand(mrb, v);
-    case json_type::boolean:
-      return mrb_bool_value(v.get_bool());
-    case json_type::null:
-      return mrb_nil_value();
-    case json_type::unknown:
-    default:
-       mrb_raise(mrb, E_TYPE_ERROR, "unknown JSON type");
-       break;
-  }
-  return mrb_undef_value();
+  mrb_value view_obj = mrb_iv_get(mrb, self, MRB_SYM(view));
+  mrb_value parser_obj = mrb_iv_get(mrb, self, MRB_SYM(parser));
 
-}
+  auto *view   = mrb_cpp_get<padded_string_view>(mrb, view_obj);
+  auto *parser = mrb_cpp_get<ondemand::parser>(mrb, parser_obj);
 
-static ondemand::document*
-mrb_json_doc_get(mrb_state* mrb, mrb_value self)
-{
-  ondemand::document *doc = mrb_cpp_get<ondemand::document>(mrb, self);
+  mrb_json_doc_forget_values(mrb, self);
+  auto result = parser->iterate(*view);
+  if (likely(result.error() == SUCCESS)) {
+    auto *const doc_cpp = mrb_cpp_get<ondemand::document>(mrb, self);
+    *doc_cpp = std::move(result.value());
+    mrb_json_doc_started(mrb, self, parser_obj);
 
-  if (likely(doc->is_alive())) {
-    return doc;
+    return self;
   }
 
-  mrb_value view_obj   = mrb_iv_get(mrb, self, MRB_SYM(view));
-  mrb_value parser_obj = mrb_iv_get(mrb, self, MRB_SYM(parser));
-
-  auto *view = mrb_cpp_get<padded_string_view>(mrb, view_obj);
-  auto *parser = mrb_cpp_get<ondemand::parser>(mrb, parser_obj);
+  raise_simdjson_error(mrb, result.error());
+  return mrb_undef_value();
+}
 
-  auto code = parser->iterate(*view).get(*doc);
-  if (likely(code == SUCCESS)) {
+// A JSON::Value: an object or array inside a Document, left unconverted.
+// It holds the On-Demand position of the value, and its ivar keeps the
+// Document (with its parser and input) alive. Looking a key up in it
+// returns another JSON::Value for objects and arrays, or the converted
+// scalar, so a chain of lookups builds no Hash or Array on the way.
+struct LazyValue {
+  ondemand::value value;
+  LazyPath *path;
+  uint64_t id;
+  size_t depth;
+  bool is_object;
+  bool started = false;   // an object was searched or the value read
+  bool iterating = false; // inside #each
+
+  LazyValue(ondemand::value value, LazyPath *path, uint64_t id, size_t depth, bool is_object)
+  : value(value), path(path), id(id), depth(depth), is_object(is_object) {}
+
+  bool live() const {
+    return path->current() && path->ids.size() > depth && path->ids[depth] == id;
+  }
+};
+MRB_CPP_DEFINE_TYPE(LazyValue, lazy_value);
+MRB_CPP_DEFINE_TYPE(CompiledPath, compiled_path);
 
-    return doc;
+// Returns a JSON::Value at depth for an object or array v, and the
+// converted value otherwise. Handles at depth and below become stale.
+static mrb_value
+lazy_or_convert(mrb_state *mrb, mrb_value doc, LazyPath *path, size_t depth,
+                ondemand::value v, ConvertCtx &ctx)
+{
+  ondemand::json_type type;
+  auto code = v.type().get(type);
+  if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+  path->ids.resize(depth);
+  if (type != ondemand::json_type::object && type != ondemand::json_type::array) {
+    return convert_ondemand_value_to_mrb(mrb, v, ctx);
   }
 
-  raise_simdjson_error(mrb, code);
-  return nullptr;
+  mrb_json_state *state = mrb_json_state_get(mrb);
+  mrb_value obj = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_CDATA, state->value_class));
+  const uint64_t id = path->next_id++;
+  mrb_cpp_new<LazyValue>(mrb, obj, v, path, id, depth, type == ondemand::json_type::object);
+  mrb_iv_set(mrb, obj, MRB_SYM(doc), doc);
+  path->ids.push_back(id);
+  return obj;
 }
 
-static bool
-is_lookup_miss(simdjson::error_code code)
+static mrb_value
+lazy_or_convert(mrb_state *mrb, mrb_value doc, size_t depth, ondemand::value v)
 {
-  return code == NO_SUCH_FIELD ||
-         code == OUT_OF_BOUNDS ||
-         code == INDEX_OUT_OF_BOUNDS ||
-         code == INCORRECT_TYPE;
+  ConvertCtx ctx(mrb, mrb_json_doc_flags(mrb, doc));
+  return lazy_or_convert(mrb, doc, mrb_json_doc_lazy_path(mrb, doc), depth, v, ctx);
 }
 
+// Document#root -> JSON::Value, or the value of a scalar document
 static mrb_value
-mrb_json_doc_aref(mrb_state* mrb, mrb_value self)
+mrb_json_doc_root(mrb_state *mrb, mrb_value self)
+{
+  auto *const doc = mrb_json_doc_get(mrb, self);
+  ondemand::value val;
+  auto code = doc->get_value().get(val);
+  if (likely(code == SUCCESS)) return lazy_or_convert(mrb, self, 0, val);
+  if (code == SCALAR_DOCUMENT_AS_VALUE) {
+    ConvertCtx ctx(mrb, mrb_json_doc_flags(mrb, self));
+    return convert_ondemand_document(mrb, *doc, ctx);
+  }
+  raise_simdjson_error(mrb, code);
+  return mrb_undef_value();
+}
+
+// Document#value(key_or_index): like Document#[], but objects and arrays
+// come back as JSON::Value. Symbols are looked up by name.
+static mrb_value
+mrb_json_doc_value(mrb_state *mrb, mrb_value self)
 {
   mrb_value key;
-  mrb_get_args(mrb, "S", &key);
+  mrb_get_args(mrb, "o", &key);
 
   auto *const doc = mrb_json_doc_get(mrb, self);
-
-  std::string_view k(RSTRING_PTR(key), RSTRING_LEN(key));
   ondemand::value val;
-  auto code = (*doc)[k].get(val);
-  if (likely(code == SUCCESS)) return convert_ondemand_value_to_mrb(mrb, val);
-
-  if (is_lookup_miss(code))  return mrb_nil_value();
+  error_code code;
+  std::string_view k;
+  if (mrb_integer_p(key)) {
+    code = doc->at(static_cast<size_t>(mrb_integer(key))).get(val);
+  } else if (lookup_key(mrb, key, k)) {
+    code = (*doc)[k].get(val);
+  } else {
+    mrb_raise(mrb, E_TYPE_ERROR, "key must be a String, Symbol or Integer");
+  }
+  if (likely(code == SUCCESS)) return lazy_or_convert(mrb, self, 0, val);
+  if (is_lookup_miss(code)) return mrb_nil_value();
 
   raise_simdjson_error(mrb, code);
   return mrb_undef_value();
 }
 
+// Document#value_at_pointer(pointer)
 static mrb_value
-mrb_json_doc_fetch(mrb_state* mrb, mrb_value self)
+mrb_json_doc_value_at_pointer(mrb_state *mrb, mrb_value self)
 {
-  mrb_value key_or_index;
-  mrb_value default_val = mrb_undef_value();
-  mrb_value block = mrb_undef_value();
-
-  // accept any object as first arg, optional default, optional block
-  mrb_get_args(mrb, "o|o&", &key_or_index, &default_val, &block);
+  mrb_value ptr_val;
+  mrb_get_args(mrb, "o", &ptr_val);
 
-  auto *const doc = mrb_json_doc_get(mrb, self);
+  return mrb_json_doc_at_compiled(mrb, self, *mrb_json_path_arg(mrb, ptr_val, false), true);
+}
 
-  // If first arg is an Integer -> array index path
-  if (mrb_integer_p(key_or_index)) {
-    mrb_int idx = mrb_integer(key_or_index);
-    ondemand::value val;
-    auto code = doc->at(static_cast<size_t>(idx)).get(val);
+// Document#value_at_path(path)
+static mrb_value
+mrb_json_doc_value_at_path(mrb_state *mrb, mrb_value self)
+{
+  mrb_value path_val;
+  mrb_get_args(mrb, "o", &path_val);
 
-    if (likely(code == SUCCESS)) {
-      return convert_ondemand_value_to_mrb(mrb, val);
-    }
+  return mrb_json_doc_at_compiled(mrb, self, *mrb_json_path_arg(mrb, path_val, true), true);
+}
 
-    if (is_lookup_miss(code)) {
-      if (!mrb_undef_p(default_val)) return default_val;
-      if (mrb_proc_p(block)) return mrb_yield(mrb, block, key_or_index);
-      mrb_raise(mrb, E_INDEX_ERROR, "index not found");
+// One step of a compiled path from a document or value. Numeric steps
+// index arrays and name keys of objects; on an array, "" and "0…" are
+// INVALID_JSON_POINTER like simdjson's own at_pointer.
+template <typename T>
+static error_code
+path_step(T &from, const PathStep &step, ondemand::value &out)
+{
+  if (step.index != PathStep::no_index || step.bad_index) {
+    ondemand::json_type type;
+    auto code = from.type().get(type);
+    if (unlikely(code != SUCCESS)) return code;
+    if (type == ondemand::json_type::array) {
+      if (step.bad_index) return INVALID_JSON_POINTER;
+      return from.at(step.index).get(out);
     }
-
-    raise_simdjson_error(mrb, code);
-    return mrb_undef_value(); // unreachable
   }
+  return from[step.key].get(out);
+}
 
-  // Otherwise treat as string key (convert to string view)
-  mrb_value key_str = mrb_obj_as_string(mrb, key_or_index);
-  std::string_view k(RSTRING_PTR(key_str), RSTRING_LEN(key_str));
-  ondemand::value val;
-  auto code = (*doc)[k].get(val);
+static mrb_value
+convert_path_result(mrb_state *mrb, ondemand::document &doc, ConvertCtx &ctx)
+{
+  return convert_ondemand_document(mrb, doc, ctx);
+}
 
-  if (likely(code == SUCCESS)) {
-    return convert_ondemand_value_to_mrb(mrb, val);
+static mrb_value
+convert_path_result(mrb_state *mrb, ondemand::value &v, ConvertCtx &ctx)
+{
+  return convert_ondemand_value_to_mrb(mrb, v, ctx);
+}
+
+// Hands the values steps[i..] reach from `from` to sink.
+template <typename T>
+static error_code
+path_collect(mrb_state *mrb, T &from, const CompiledPath &path, size_t i,
+             ConvertCtx &ctx, PathSink &sink)
+{
+  if (i == path.steps.size()) {
+    int arena = mrb_gc_arena_save(mrb);
+    mrb_value value = convert_path_result(mrb, from, ctx);
+    if (mrb_nil_p(sink.out)) {
+      mrb_yield(mrb, sink.block, value);
+      if (unlikely(!sink.walk_intact())) return OUT_OF_ORDER_ITERATION;
+    } else {
+      mrb_ary_push(mrb, sink.out, value);
+    }
+    mrb_gc_arena_restore(mrb, arena);
+    return SUCCESS;
   }
 
-  if (is_lookup_miss(code)) {
-    if (!mrb_undef_p(default_val)) return default_val;
-    if (mrb_proc_p(block)) return mrb_yield(mrb, block, key_or_index);
-    mrb_raise(mrb, E_KEY_ERROR, "key not found");
+  const PathStep &step = path.steps[i];
+  ondemand::value v;
+  if (!step.wildcard) {
+    auto code = path_step(from, step, v);
+    if (likely(code == SUCCESS)) return path_collect(mrb, v, path, i + 1, ctx, sink);
+    return is_lookup_miss(code) ? SUCCESS : code;
   }
 
-  raise_simdjson_error(mrb, code);
-  return mrb_undef_value(); // unreachable
+  ondemand::json_type type;
+  auto code = from.type().get(type);
+  if (unlikely(code != SUCCESS)) return code;
+  if (type == ondemand::json_type::array) {
+    ondemand::array arr;
+    code = from.get_array().get(arr);
+    if (unlikely(code != SUCCESS)) return code;
+    for (auto element : arr) {
+      code = element.get(v);
+      if (likely(code == SUCCESS)) code = path_collect(mrb, v, path, i + 1, ctx, sink);
+      if (unlikely(code != SUCCESS)) return code;
+    }
+  } else if (type == ondemand::json_type::object) {
+    ondemand::object obj;
+    code = from.get_object().get(obj);
+    if (unlikely(code != SUCCESS)) return code;
+    for (auto field : obj) {
+      code = field.value().get(v);
+      if (likely(code == SUCCESS)) code = path_collect(mrb, v, path, i + 1, ctx, sink);
+      if (unlikely(code != SUCCESS)) return code;
+    }
+  }
+  return SUCCESS;
 }
 
+// The value a path without wildcards names, from the start of the
+// document like simdjson's at_pointer. With lazy set, objects and arrays
+// come back as JSON::Value.
 static mrb_value
-mrb_json_doc_find_field(mrb_state* mrb, mrb_value self)
+mrb_json_doc_at_compiled(mrb_state *mrb, mrb_value self, const CompiledPath &path, bool lazy)
 {
-  mrb_value key;
-  mrb_get_args(mrb, "S", &key);
-
+  if (unlikely(path.has_wildcard)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "wildcard paths need at_path_with_wildcard");
+  }
   auto *const doc = mrb_json_doc_get(mrb, self);
+  doc->rewind();
+  if (path.steps.empty()) {
+    if (lazy) return mrb_json_doc_root(mrb, self);
+    ConvertCtx ctx(mrb, mrb_json_doc_flags(mrb, self));
+    return convert_ondemand_document(mrb, *doc, ctx);
+  }
 
-  std::string_view k(RSTRING_PTR(key), RSTRING_LEN(key));
   ondemand::value val;
-  const auto code = doc->find_field(k).get(val);
-  if (likely(code == SUCCESS)) return convert_ondemand_value_to_mrb(mrb, val);
-
-  if (is_lookup_miss(code))  return mrb_nil_value();
+  auto code = path_step(*doc, path.steps[0], val);
+  for (size_t i = 1; likely(code == SUCCESS) && i < path.steps.size(); i++) {
+    code = path_step(val, path.steps[i], val);
+  }
+  if (likely(code == SUCCESS)) {
+    if (lazy) return lazy_or_convert(mrb, self, 0, val);
+    return convert_ondemand_value_to_mrb(mrb, self, val);
+  }
+  if (is_lookup_miss(code)) return mrb_nil_value();
 
   raise_simdjson_error(mrb, code);
-  return mrb_undef_value(); // unreachable
+  return mrb_undef_value();
 }
 
-static mrb_value
-mrb_json_doc_find_field_unordered(mrb_state* mrb, mrb_value self)
-{
-  mrb_value key;
-  mrb_get_args(mrb, "S", &key);
+// The paths of one Document#query_many call merged into a trie, so paths
+// sharing a prefix share the walk to it. Node 0 is the document.
+struct QueryNode {
+  std::string key;                // the step leading here
+  size_t index = PathStep::no_index;
+  bool wildcard = false;
+  std::vector<size_t> children;
+  std::vector<mrb_int> ends;      // paths that end here
+  uint64_t stamp = 0;             // see query_walk
+};
 
-  auto *const doc = mrb_json_doc_get(mrb, self);
+struct QueryTrie {
+  std::vector<QueryNode> nodes = std::vector<QueryNode>(1);
+  std::vector<bool> many;         // per path: has a wildcard, gives an Array
+  uint64_t stamps = 0;
+
+  // Adds path number id. Only a JSONPath has wildcards; "*" in a JSON
+  // Pointer is the key "*".
+  void add(const CompiledPath &path, mrb_int id) {
+    size_t node = 0;
+    bool has_wildcard = false;
+    for (const PathStep &step : path.steps) {
+      const bool wildcard = step.wildcard;
+      has_wildcard |= wildcard;
+      size_t next = 0;
+      for (size_t child : nodes[node].children) {
+        const QueryNode &c = nodes[child];
+        if (c.wildcard == wildcard && (wildcard || c.key == step.key)) {
+          next = child;
+          break;
+        }
+      }
+      if (next == 0) {
+        next = nodes.size();
+        QueryNode child;
+        child.key = step.key;
+        child.index = wildcard ? PathStep::no_index : step.index;
+        child.wildcard = wildcard;
+        nodes.push_back(std::move(child));
+        nodes[node].children.push_back(next);
+      }
+      node = next;
+    }
+    nodes[node].ends.push_back(id);
+    many.push_back(has_wildcard);
+  }
+};
+MRB_CPP_DEFINE_TYPE(QueryTrie, query_trie);
 
-  std::string_view k(RSTRING_PTR(key), RSTRING_LEN(key));
-  ondemand::value val;
-  auto code = doc->find_field_unordered(k).get(val);
-  if (likely(code == SUCCESS)) return convert_ondemand_value_to_mrb(mrb, val);
-  if (is_lookup_miss(code))  return mrb_nil_value();
+struct QueryCtx {
+  mrb_state *mrb;
+  QueryTrie &trie;
+  ConvertCtx &convert;
+  mrb_value results; // per path: a value (undef until found) or an Array
+};
 
-  raise_simdjson_error(mrb, code);
-  return mrb_undef_value(); // unreachable
+static void
+query_store(QueryCtx &q, const QueryNode &node, mrb_value v)
+{
+  for (mrb_int id : node.ends) {
+    mrb_value slot = mrb_ary_ref(q.mrb, q.results, id);
+    if (q.trie.many[id]) {
+      mrb_ary_push(q.mrb, slot, v);
+    } else if (mrb_undef_p(slot)) {
+      mrb_ary_set(q.mrb, q.results, id, v);
+    }
+  }
 }
 
-static mrb_value
-mrb_json_doc_at(mrb_state* mrb, mrb_value self)
+// Answers the paths below node from v, a value that was already converted
+// because a path ends at it or more than one step matched it.
+static void
+query_ruby(QueryCtx &q, size_t id, mrb_value v)
 {
-  mrb_int index;
-  mrb_get_args(mrb, "i", &index);
+  mrb_state *mrb = q.mrb;
+  query_store(q, q.trie.nodes[id], v);
+  for (size_t i = 0; i < q.trie.nodes[id].children.size(); i++) {
+    const size_t child_id = q.trie.nodes[id].children[i];
+    const QueryNode &child = q.trie.nodes[child_id];
+    if (child.wildcard) {
+      mrb_value items = mrb_hash_p(v) ? mrb_hash_values(mrb, v) : v;
+      if (!mrb_array_p(items)) continue;
+      for (mrb_int j = 0; j < RARRAY_LEN(items); j++) {
+        query_ruby(q, child_id, RARRAY_PTR(items)[j]);
+      }
+    } else if (mrb_hash_p(v)) {
+      mrb_value key = mrb_str_new(mrb, child.key.data(), child.key.size());
+      if (mrb_hash_key_p(mrb, v, key)) query_ruby(q, child_id, mrb_hash_get(mrb, v, key));
+    } else if (mrb_array_p(v) && child.index < static_cast<size_t>(RARRAY_LEN(v))) {
+      query_ruby(q, child_id, RARRAY_PTR(v)[child.index]);
+    }
+  }
+}
 
-  auto *const doc = mrb_json_doc_get(mrb, self);
+// Walks the value at node once, front to back. A field or element that
+// one child step matches is walked in place. One that several match (a
+// key and a wildcard) or that a path ends at is converted, and the paths
+// below it are answered from the Ruby value. Objects are left as soon as
+// every named key was seen, unless a wildcard needs the rest.
+template <typename T>
+static error_code
+query_walk(QueryCtx &q, T &from, size_t id)
+{
+  if (!q.trie.nodes[id].ends.empty()) {
+    int arena = mrb_gc_arena_save(q.mrb);
+    query_ruby(q, id, convert_path_result(q.mrb, from, q.convert));
+    mrb_gc_arena_restore(q.mrb, arena);
+    return SUCCESS;
+  }
 
-  ondemand::value val;
-  const auto code = doc->at(index).get(val);
-  if (likely(code == SUCCESS)) {
-    return convert_ondemand_value_to_mrb(mrb, val);
+  ondemand::json_type type;
+  auto code = from.type().get(type);
+  if (unlikely(code != SUCCESS)) return code;
+  const bool is_object = type == ondemand::json_type::object;
+  if (!is_object && type != ondemand::json_type::array) return SUCCESS;
+
+  // A stamp per visit marks the named children already matched, so a
+  // repeated key in the JSON is only read the first time.
+  const uint64_t stamp = ++q.trie.stamps;
+  size_t named = 0;
+  bool any_wildcard = false;
+  for (size_t child : q.trie.nodes[id].children) {
+    if (q.trie.nodes[child].wildcard) any_wildcard = true;
+    else named++;
   }
 
-  if (is_lookup_miss(code))  return mrb_nil_value();
+  auto visit = [&](std::string_view key, size_t index, auto &&get_value) -> error_code {
+    size_t named_hit = 0, wildcard_hit = 0; // 0 is the root, never a child
+    for (size_t child : q.trie.nodes[id].children) {
+      QueryNode &c = q.trie.nodes[child];
+      if (c.wildcard) {
+        wildcard_hit = child;
+      } else if (c.stamp != stamp && (is_object ? c.key == key : c.index == index)) {
+        c.stamp = stamp;
+        named_hit = child;
+        named--;
+      }
+    }
+    if (named_hit == 0 && wildcard_hit == 0) return SUCCESS;
+
+    ondemand::value v;
+    auto code = get_value(v);
+    if (unlikely(code != SUCCESS)) return code;
+    if (named_hit == 0) return query_walk(q, v, wildcard_hit);
+    if (wildcard_hit == 0) return query_walk(q, v, named_hit);
+
+    int arena = mrb_gc_arena_save(q.mrb);
+    mrb_value rv = convert_ondemand_value_to_mrb(q.mrb, v, q.convert);
+    query_ruby(q, named_hit, rv);
+    query_ruby(q, wildcard_hit, rv);
+    mrb_gc_arena_restore(q.mrb, arena);
+    return SUCCESS;
+  };
 
-  raise_simdjson_error(mrb, code);
-  return mrb_undef_value(); // unreachable
+  if (is_object) {
+    ondemand::object obj;
+    code = from.get_object().get(obj);
+    if (unlikely(code != SUCCESS)) return code;
+    for (auto field : obj) {
+      std::string_view k;
+      code = field.unescaped_key().get(k);
+      if (likely(code == SUCCESS)) {
+        code = visit(k, PathStep::no_index, [&](ondemand::value &v) { return field.value().get(v); });
+      }
+      if (unlikely(code != SUCCESS)) return code;
+      if (named == 0 && !any_wildcard) break;
+    }
+  } else {
+    ondemand::array arr;
+    code = from.get_array().get(arr);
+    if (unlikely(code != SUCCESS)) return code;
+    size_t index = 0;
+    for (auto element : arr) {
+      code = visit(std::string_view(), index++, [&](ondemand::value &v) { return element.get(v); });
+      if (unlikely(code != SUCCESS)) return code;
+      if (named == 0 && !any_wildcard) break;
+    }
+  }
+  return SUCCESS;
 }
 
+// Document#query_many(paths) -> { path => value }
+//
+// Evaluates JSON Pointers and JSONPaths (Strings, JSON::Pointer or
+// JSON::Path) in a single pass over the document. Paths with a wildcard
+// map to an Array of their matches, others to the value or nil.
 static mrb_value
-mrb_json_doc_at_pointer(mrb_state* mrb, mrb_value self)
+mrb_json_doc_query_many(mrb_state *mrb, mrb_value self)
 {
-  mrb_value ptr_val;
-  mrb_get_args(mrb, "S", &ptr_val);
+  mrb_value paths;
+  mrb_get_args(mrb, "A", &paths);
+
+  const mrb_int n = RARRAY_LEN(paths);
+  mrb_value trie_obj;
+  auto *trie = mrb_json_hidden_new<QueryTrie>(mrb, &trie_obj);
+  for (mrb_int i = 0; i < n; i++) {
+    mrb_value p = RARRAY_PTR(paths)[i];
+    const bool json_path = mrb_string_p(p) && RSTRING_LEN(p) > 0 && RSTRING_PTR(p)[0] == '$';
+    trie->add(*mrb_json_path_arg(mrb, p, json_path), i);
+  }
 
-  auto *const doc = mrb_json_doc_get(mrb, self);
+  mrb_value results = mrb_ary_new_capa(mrb, n);
+  for (mrb_int i = 0; i < n; i++) {
+    mrb_ary_push(mrb, results, trie->many[i] ? mrb_ary_new(mrb) : mrb_undef_value());
+  }
 
-  std::string_view json_pointer(RSTRING_PTR(ptr_val), RSTRING_LEN(ptr_val));
-  ondemand::value value;
-  auto code = doc->at_pointer(json_pointer).get(value);
-  if (likely(code == SUCCESS)) {
-    return convert_ondemand_value_to_mrb(mrb, value);
+  auto *const doc = mrb_json_doc_get(mrb, self);
+  doc->rewind();
+  ConvertCtx ctx(mrb, mrb_json_doc_flags(mrb, self));
+  QueryCtx q{mrb, *trie, ctx, results};
+  auto code = query_walk(q, *doc, 0);
+  if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+
+  mrb_value hash = mrb_hash_new_capa(mrb, n);
+  for (mrb_int i = 0; i < n; i++) {
+    mrb_value v = RARRAY_PTR(results)[i];
+    mrb_hash_set(mrb, hash, RARRAY_PTR(paths)[i], mrb_undef_p(v) ? mrb_nil_value() : v);
   }
+  return hash;
+}
 
-  if (is_lookup_miss(code))  return mrb_nil_value();
+// Compiles the String argument into self. The compiled path is fixed once
+// made: documents and query tries refer to it while they apply it.
+static mrb_value
+mrb_json_compiled_path_init(mrb_state *mrb, mrb_value self, bool json_path)
+{
+  mrb_value src;
+  mrb_get_args(mrb, "S", &src);
+  if (unlikely(DATA_PTR(self) != nullptr)) {
+    mrb_raise(mrb, E_TYPE_ERROR, "already initialized");
+  }
 
-  raise_simdjson_error(mrb, code);
-  return mrb_undef_value(); // unreachable
+  CompiledPath path;
+  std::string_view sv(RSTRING_PTR(src), RSTRING_LEN(src));
+  auto code = json_path ? compile_json_path(sv, path) : compile_json_pointer(sv, path);
+  if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+  mrb_cpp_new<CompiledPath>(mrb, self, std::move(path));
+  mrb_iv_set(mrb, self, MRB_SYM(source), mrb_obj_freeze(mrb, mrb_str_dup(mrb, src)));
+  return self;
 }
 
+// JSON::Pointer.new(pointer) / JSON::Pointer.compile(pointer)
 static mrb_value
-mrb_json_doc_at_path(mrb_state* mrb, mrb_value self)
+mrb_json_pointer_initialize(mrb_state *mrb, mrb_value self)
 {
-  mrb_value path_val;
-  mrb_get_args(mrb, "S", &path_val);
+  return mrb_json_compiled_path_init(mrb, self, false);
+}
 
-  auto *const doc = mrb_json_doc_get(mrb, self);
+// JSON::Path.new(path) / JSON::Path.compile(path)
+static mrb_value
+mrb_json_path_initialize(mrb_state *mrb, mrb_value self)
+{
+  return mrb_json_compiled_path_init(mrb, self, true);
+}
 
-  std::string_view json_path(RSTRING_PTR(path_val), RSTRING_LEN(path_val));
-  ondemand::value value;
-  auto code = doc->at_path(json_path).get(value);
-  if (likely(code == SUCCESS)) {
-    return convert_ondemand_value_to_mrb(mrb, value);
-  }
+// JSON::Pointer#to_s / JSON::Path#to_s
+static mrb_value
+mrb_json_compiled_path_to_s(mrb_state *mrb, mrb_value self)
+{
+  return mrb_iv_get(mrb, self, MRB_SYM(source));
+}
 
-  if (is_lookup_miss(code))  return mrb_nil_value();
+// JSON::Path#wildcard?
+static mrb_value
+mrb_json_compiled_path_wildcard_p(mrb_state *mrb, mrb_value self)
+{
+  return mrb_bool_value(mrb_cpp_get<CompiledPath>(mrb, self)->has_wildcard);
+}
 
-  raise_simdjson_error(mrb, code);
-  return mrb_undef_value();
+// One step of Document#dig from a document or value.
+template <typename T>
+static error_code
+dig_step(mrb_state *mrb, T &from, mrb_value key, ondemand::value &out)
+{
+  if (mrb_integer_p(key)) {
+    const mrb_int index = mrb_integer(key);
+    if (index < 0) return INDEX_OUT_OF_BOUNDS;
+    return from.at(static_cast<size_t>(index)).get(out);
+  }
+  std::string_view k;
+  if (unlikely(!lookup_key(mrb, key, k))) {
+    mrb_raise(mrb, E_TYPE_ERROR, "dig keys must be Strings, Symbols or Integers");
+  }
+  return from[k].get(out);
 }
 
+// Document#dig(*keys): walks String and Symbol keys and Integer indices in
+// one call and converts only the value at the end. Returns nil when a step
+// is missing or reaches a scalar. Negative indices are not supported and
+// miss.
 static mrb_value
-mrb_json_doc_at_path_with_wildcard(mrb_state* mrb, mrb_value self)
+mrb_json_doc_dig(mrb_state *mrb, mrb_value self)
 {
-  mrb_value path_val;
-  mrb_value block = mrb_undef_value();
-  mrb_get_args(mrb, "S|&", &path_val, &block);
+  const mrb_value *keys;
+  mrb_int argc;
+  mrb_get_args(mrb, "*", &keys, &argc);
+  if (argc == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong number of arguments (given 0, expected 1+)");
+  }
 
   auto *const doc = mrb_json_doc_get(mrb, self);
+  ondemand::value val;
+  auto code = dig_step(mrb, *doc, keys[0], val);
+  for (mrb_int i = 1; likely(code == SUCCESS) && i < argc; i++) {
+    code = dig_step(mrb, val, keys[i], val);
+  }
+  if (likely(code == SUCCESS)) return convert_ondemand_value_to_mrb(mrb, self, val);
+  if (is_lookup_miss(code)) return mrb_nil_value();
 
-  std::string_view json_path(RSTRING_PTR(path_val), RSTRING_LEN(path_val));
-  std::vector<ondemand::value> values;
-  auto code = doc->at_path_with_wildcard(json_path).get(values);
-  if (likely(code == SUCCESS)) {
-    if (mrb_proc_p(block)) {
-      int arena = mrb_gc_arena_save(mrb);
-      for (auto v : values) {
-        mrb_yield(mrb, block, convert_ondemand_value_to_mrb(mrb, v));
-        mrb_gc_arena_restore(mrb, arena);
-      }
-      return self;
+  raise_simdjson_error(mrb, code);
+  return mrb_undef_value();
+}
+
+// The keys wanted by Document#values_at and #extract. Each distinct key
+// gets a slot. Up to inline_keys keys are compared in place, which is
+// faster than hashing for the handful of fields usually asked for, and
+// needs no heap so the set can live on the stack. Past that the keys go
+// into a hash table; such a set is owned by a GC object.
+class FieldSet {
+public:
+  static constexpr size_t inline_keys = 16;
+  static constexpr size_t npos = std::string_view::npos;
+
+  size_t add(std::string_view k) {
+    size_t slot = find(k);
+    if (slot != npos) return slot;
+    slot = n++;
+    if (slot < inline_keys) {
+      small[slot] = k;
     } else {
-      mrb_value ary = mrb_ary_new_capa(mrb, values.size());
-      int arena = mrb_gc_arena_save(mrb);
-      for (auto v : values) {
-        mrb_ary_push(mrb, ary, convert_ondemand_value_to_mrb(mrb, v));
-        mrb_gc_arena_restore(mrb, arena);
+      if (!index) {
+        index = std::make_unique<std::unordered_map<std::string_view, size_t>>();
+        for (size_t i = 0; i < inline_keys; i++) index->emplace(small[i], i);
       }
-      return ary;
+      index->emplace(k, slot);
     }
+    return slot;
   }
-  if (is_lookup_miss(code))  return mrb_nil_value();
 
-  raise_simdjson_error(mrb, code);
-  return mrb_undef_value();
-}
+  size_t find(std::string_view k) const {
+    if (index) {
+      auto it = index->find(k);
+      return it == index->end() ? npos : it->second;
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (small[i].size() == k.size() && memcmp(small[i].data(), k.data(), k.size()) == 0) {
+        return i;
+      }
+    }
+    return npos;
+  }
 
-static mrb_value
-mrb_json_doc_array_each(mrb_state* mrb, mrb_value self)
+  size_t size() const { return n; }
+
+private:
+  std::string_view small[inline_keys];
+  size_t n = 0;
+  std::unique_ptr<std::unordered_map<std::string_view, size_t>> index;
+};
+MRB_CPP_DEFINE_TYPE(FieldSet, field_set);
+
+static FieldSet*
+field_set_for(mrb_state *mrb, mrb_int count, FieldSet &local, mrb_value *holder)
 {
-  mrb_value block = mrb_undef_value();
-  mrb_get_args(mrb, "|&", &block);
+  if (static_cast<size_t>(count) <= FieldSet::inline_keys) return &local;
+  return mrb_json_hidden_new<FieldSet>(mrb, holder);
+}
 
+// Reads the root object of the Document self once, storing the value of
+// each wanted key in its slot of out, an Array of nils. It stops as soon as
+// every slot is filled; of duplicate keys in the JSON the first counts.
+// types, when not nil, holds the JSON::Type each slot must have (nil for
+// any), and names the key to report on a mismatch. A root that is not an
+// object leaves every slot nil.
+static void
+extract_fields(mrb_state *mrb, mrb_value self, const FieldSet &set, mrb_value out,
+               mrb_value types, mrb_value names)
+{
   auto *const doc = mrb_json_doc_get(mrb, self);
-  ondemand::array array;
-  auto code = doc->get_array().get(array);
-  if (likely(code == SUCCESS)) {
-    if (mrb_proc_p(block)) {
-      int arena = mrb_gc_arena_save(mrb);
-      for (ondemand::value v : array) {
-        mrb_value ruby_val = convert_ondemand_value_to_mrb(mrb, v);
-        mrb_yield(mrb, block, ruby_val);
-        mrb_gc_arena_restore(mrb, arena);
-      }
-      return self;
-    } else {
-      size_t capa;
-      code = array.count_elements().get(capa);
-      if (likely(code == SUCCESS)) {
-        mrb_value ary = mrb_ary_new_capa(mrb, capa);
-        int arena = mrb_gc_arena_save(mrb);
-        for (ondemand::value v : array) {
-          mrb_value ruby_val = convert_ondemand_value_to_mrb(mrb, v);
-          mrb_ary_push(mrb, ary, ruby_val);
-          mrb_gc_arena_restore(mrb, arena);
-        }
-        return ary;
+  // start from the root wherever earlier lookups left the cursor
+  doc->rewind();
+  ondemand::object obj;
+  auto code = doc->get_object().get(obj);
+  if (code == INCORRECT_TYPE) return;
+  if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+
+  ConvertCtx ctx(mrb, mrb_json_doc_flags(mrb, self));
+  const size_t wanted = set.size();
+  size_t found = 0;
+  int arena = mrb_gc_arena_save(mrb);
+  for (auto field : obj) {
+    std::string_view k;
+    code = field.unescaped_key().get(k);
+    if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+    const size_t slot = set.find(k);
+    if (slot == FieldSet::npos) continue;
+    const mrb_int i = static_cast<mrb_int>(slot);
+    if (!mrb_undef_p(mrb_ary_ref(mrb, out, i))) continue;
+
+    ondemand::value v;
+    code = field.value().get(v);
+    if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+    if (!mrb_nil_p(types)) {
+      mrb_value expected = mrb_ary_ref(mrb, types, i);
+      ondemand::json_type type;
+      code = v.type().get(type);
+      if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+      if (!mrb_nil_p(expected) && static_cast<mrb_int>(type) != mrb_integer(expected)) {
+        mrb_raisef(mrb, E_TYPE_ERROR, "JSON isn't expected type for %v",
+                   mrb_ary_ref(mrb, names, i));
       }
-      raise_simdjson_error(mrb, code);
     }
+    mrb_ary_set(mrb, out, i, convert_ondemand_value_to_mrb(mrb, v, ctx));
+    mrb_gc_arena_restore(mrb, arena);
+    if (++found == wanted) break;
   }
-
-  raise_simdjson_error(mrb, code);
-  return mrb_undef_value();
 }
 
+// An Array of n undef slots; extract_fields turns the unfilled ones to nil.
 static mrb_value
-mrb_json_doc_object_each(mrb_state* mrb, mrb_value self)
+field_slots_new(mrb_state *mrb, size_t n)
 {
-  mrb_value block = mrb_undef_value();
-  mrb_get_args(mrb, "|&", &block);
+  mrb_value out = mrb_ary_new_capa(mrb, static_cast<mrb_int>(n));
+  for (size_t i = 0; i < n; i++) mrb_ary_push(mrb, out, mrb_undef_value());
+  return out;
+}
 
-  auto* const doc = mrb_json_doc_get(mrb, self);
-  ondemand::object object;
-  auto code = doc->get_object().get(object);
-  if (likely(code == SUCCESS)) {
-    if (mrb_proc_p(block)) {
-      int arena = mrb_gc_arena_save(mrb);
-      for (auto field : object) {
-        std::string_view k;
-        ondemand::value v;
-        code = field.unescaped_key().get(k);
-        if (likely(code == SUCCESS)) {
-          code = field.value().get(v);
-        }
-        if (likely(code == SUCCESS)) {
+static void
+field_slots_finish(mrb_state *mrb, mrb_value out)
+{
+  for (mrb_int i = 0; i < RARRAY_LEN(out); i++) {
+    if (mrb_undef_p(RARRAY_PTR(out)[i])) mrb_ary_set(mrb, out, i, mrb_nil_value());
+  }
+}
 
-          mrb_value key = mrb_str_new(mrb, k.data(), k.size());
-          mrb_value val = convert_ondemand_value_to_mrb(mrb, v);
+// Document#values_at(*keys): the values of the given String or Symbol keys
+// of the root object, in one pass over it. Missing keys give nil.
+static mrb_value
+mrb_json_doc_values_at(mrb_state *mrb, mrb_value self)
+{
+  const mrb_value *keys;
+  mrb_int argc;
+  mrb_get_args(mrb, "*", &keys, &argc);
+
+  FieldSet local;
+  mrb_value holder;
+  FieldSet *set = field_set_for(mrb, argc, local, &holder);
+  for (mrb_int i = 0; i < argc; i++) {
+    std::string_view k;
+    if (unlikely(!lookup_key(mrb, keys[i], k))) {
+      mrb_raise(mrb, E_TYPE_ERROR, "key must be a String or Symbol");
+    }
+    set->add(k);
+  }
 
-          mrb_value argv[] = {key, val};
-          mrb_yield_argv(mrb, block, 2, argv);
+  mrb_value out = field_slots_new(mrb, set->size());
+  extract_fields(mrb, self, *set, out, mrb_nil_value(), mrb_nil_value());
+  field_slots_finish(mrb, out);
+  if (set->size() == static_cast<size_t>(argc)) return out;
+
+  // repeated keys share a slot
+  mrb_value result = mrb_ary_new_capa(mrb, argc);
+  for (mrb_int i = 0; i < argc; i++) {
+    std::string_view k;
+    lookup_key(mrb, keys[i], k);
+    mrb_ary_push(mrb, result, mrb_ary_ref(mrb, out, static_cast<mrb_int>(set->find(k))));
+  }
+  return result;
+}
 
-          mrb_gc_arena_restore(mrb, arena);
-        } else {
-          raise_simdjson_error(mrb, code);
-        }
-      }
+// Document#extract({ key => JSON::Type::X or nil }): a Hash from each
+// given key to its value in the root object, read in one pass. A value of
+// another JSON type than asked for raises TypeError; missing keys give nil.
+static mrb_value
+mrb_json_doc_extract(mrb_state *mrb, mrb_value self)
+{
+  mrb_value spec;
+  mrb_get_args(mrb, "H", &spec);
+
+  mrb_value names = mrb_hash_keys(mrb, spec);
+  const mrb_int n = RARRAY_LEN(names);
+  FieldSet local;
+  mrb_value holder;
+  FieldSet *set = field_set_for(mrb, n, local, &holder);
+  mrb_value types = mrb_ary_new_capa(mrb, n);
+  mrb_value slot_names = mrb_ary_new_capa(mrb, n);
+  for (mrb_int i = 0; i < n; i++) {
+    mrb_value name = RARRAY_PTR(names)[i];
+    mrb_value type = mrb_hash_get(mrb, spec, name);
+    std::string_view k;
+    if (unlikely(!lookup_key(mrb, name, k))) {
+      mrb_raise(mrb, E_TYPE_ERROR, "key must be a String or Symbol");
+    }
+    if (unlikely(!mrb_nil_p(type) && !mrb_integer_p(type))) {
+      mrb_raise(mrb, E_TYPE_ERROR, "type must be a JSON::Type constant or nil");
+    }
+    const size_t before = set->size();
+    if (set->add(k) == before) {
+      mrb_ary_push(mrb, types, type);
+      mrb_ary_push(mrb, slot_names, name);
+    }
+  }
 
-      return self;
-    } else {
-      mrb_value hash = mrb_hash_new(mrb);
-      int arena = mrb_gc_arena_save(mrb);
+  mrb_value out = field_slots_new(mrb, set->size());
+  extract_fields(mrb, self, *set, out, types, slot_names);
+  field_slots_finish(mrb, out);
 
-      for (auto field : object) {
-        std::string_view k;
-        ondemand::value v;
-        code = field.unescaped_key().get(k);
-        if (likely(code == SUCCESS)) {
-          code = field.value().get(v);
-        }
-        if (likely(code == SUCCESS)) {
+  mrb_value result = mrb_hash_new_capa(mrb, n);
+  for (mrb_int i = 0; i < n; i++) {
+    mrb_value name = RARRAY_PTR(names)[i];
+    std::string_view k;
+    lookup_key(mrb, name, k);
+    mrb_hash_set(mrb, result, name, mrb_ary_ref(mrb, out, static_cast<mrb_int>(set->find(k))));
+  }
+  return result;
+}
 
-          mrb_value key = mrb_str_new(mrb, k.data(), k.size());
-          mrb_value val = convert_ondemand_value_to_mrb(mrb, v);
+// Returns the LazyValue of self, raising OutOfOrderIterationError if the
+// Document has moved on since it was returned.
+static LazyValue*
+mrb_json_value_get(mrb_state *mrb, mrb_value self)
+{
+  auto *lv = mrb_cpp_get<LazyValue>(mrb, self);
+  if (unlikely(!lv->live() || lv->iterating)) {
+    raise_simdjson_error(mrb, OUT_OF_ORDER_ITERATION);
+  }
+  return lv;
+}
 
-          mrb_hash_set(mrb, hash, key, val);
+// Takes the whole value for reading. Objects may be searched repeatedly,
+// but once that started, or the value was read, it cannot be read again.
+static LazyValue*
+mrb_json_value_take(mrb_state *mrb, mrb_value self)
+{
+  auto *lv = mrb_json_value_get(mrb, self);
+  if (unlikely(lv->started)) raise_simdjson_error(mrb, OUT_OF_ORDER_ITERATION);
+  lv->started = true;
+  lv->path->ids.resize(lv->depth + 1);
+  return lv;
+}
 
-          mrb_gc_arena_restore(mrb, arena);
-        }
-      }
-      return hash;
+// JSON::Value#[](key_or_index)
+static mrb_value
+mrb_json_value_aref(mrb_state *mrb, mrb_value self)
+{
+  mrb_value key;
+  mrb_get_args(mrb, "o", &key);
+
+  auto *lv = mrb_json_value_get(mrb, self);
+  mrb_value doc = mrb_iv_get(mrb, self, MRB_SYM(doc));
+  ondemand::value val;
+  error_code code;
+  std::string_view k;
+  if (lv->is_object) {
+    if (!lookup_key(mrb, key, k)) {
+      if (mrb_integer_p(key)) return mrb_nil_value();
+      mrb_raise(mrb, E_TYPE_ERROR, "key must be a String or Symbol");
     }
+    lv->path->ids.resize(lv->depth + 1);
+    lv->started = true;
+    code = lv->value.find_field_unordered(k).get(val);
+  } else {
+    if (!mrb_integer_p(key)) {
+      if (mrb_string_p(key) || mrb_symbol_p(key)) return mrb_nil_value();
+      mrb_raise(mrb, E_TYPE_ERROR, "index must be an Integer");
+    }
+    // an array is read front to back once
+    mrb_json_value_take(mrb, self);
+    code = lv->value.at(static_cast<size_t>(mrb_integer(key))).get(val);
   }
+  if (likely(code == SUCCESS)) return lazy_or_convert(mrb, doc, lv->depth + 1, val);
+  if (is_lookup_miss(code)) return mrb_nil_value();
 
   raise_simdjson_error(mrb, code);
   return mrb_undef_value();
 }
 
+// JSON::Value#each { |element| } / { |key, value| }: nested objects and
+// arrays are yielded as JSON::Value, each valid until the next one.
+static mrb_value
+mrb_json_value_each(mrb_state *mrb, mrb_value self)
+{
+  mrb_value block;
+  mrb_get_args(mrb, "&!", &block);
+
+  auto *lv = mrb_json_value_take(mrb, self);
+  mrb_value doc = mrb_iv_get(mrb, self, MRB_SYM(doc));
+  ConvertCtx ctx(mrb, mrb_json_doc_flags(mrb, doc));
+  const size_t depth = lv->depth + 1;
+  int arena = mrb_gc_arena_save(mrb);
+
+  // the loop must not touch the iterator again if the block moved the
+  // document elsewhere
+  auto yield = [&](mrb_int argc, const mrb_value *argv) {
+    lv->iterating = true;
+    mrb_yield_argv(mrb, block, argc, argv);
+    lv->iterating = false;
+    if (unlikely(!lv->live())) raise_simdjson_error(mrb, OUT_OF_ORDER_ITERATION);
+    mrb_gc_arena_restore(mrb, arena);
+  };
+
+  if (lv->is_object) {
+    ondemand::object obj;
+    auto code = lv->value.get_object().get(obj);
+    if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+    for (auto field : obj) {
+      std::string_view k;
+      ondemand::value v;
+      code = field.unescaped_key().get(k);
+      if (likely(code == SUCCESS)) code = field.value().get(v);
+      if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+      mrb_value argv[2];
+      argv[0] = ctx.keys.fetch(mrb, k);
+      argv[1] = lazy_or_convert(mrb, doc, lv->path, depth, v, ctx);
+      yield(2, argv);
+    }
+  } else {
+    ondemand::array arr;
+    auto code = lv->value.get_array().get(arr);
+    if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+    for (auto element : arr) {
+      ondemand::value v;
+      code = element.get(v);
+      if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+      mrb_value arg = lazy_or_convert(mrb, doc, lv->path, depth, v, ctx);
+      yield(1, &arg);
+    }
+  }
+  lv->path->ids.resize(depth);
+  return self;
+}
+
+// JSON::Value#to_ruby: converts the whole value to a Hash or Array
 static mrb_value
-mrb_json_doc_rewind(mrb_state* mrb, mrb_value self)
+mrb_json_value_to_ruby(mrb_state *mrb, mrb_value self)
 {
-  auto *const doc = mrb_cpp_get<ondemand::document>(mrb, self);
-
-  doc->rewind();
-
-  return self;
+  auto *lv = mrb_json_value_take(mrb, self);
+  mrb_value doc = mrb_iv_get(mrb, self, MRB_SYM(doc));
+  return convert_ondemand_value_to_mrb(mrb, doc, lv->value);
 }
 
+// JSON::Value#raw_json: the value's JSON text as it appears in the input
 static mrb_value
-mrb_json_doc_reiterate(mrb_state *mrb, mrb_value self)
+mrb_json_value_raw_json(mrb_state *mrb, mrb_value self)
 {
-  mrb_value view_obj = mrb_iv_get(mrb, self, MRB_SYM(view));
-  mrb_value parser_obj = mrb_iv_get(mrb, self, MRB_SYM(parser));
-
-  auto *view   = mrb_cpp_get<padded_string_view>(mrb, view_obj);
-  auto *parser = mrb_cpp_get<ondemand::parser>(mrb, parser_obj);
-
-  auto result = parser->iterate(*view);
-  if (likely(result.error() == SUCCESS)) {
-    auto *const doc_cpp = mrb_cpp_get<ondemand::document>(mrb, self);
-    *doc_cpp = std::move(result.value());
+  auto *lv = mrb_json_value_take(mrb, self);
+  std::string_view raw;
+  auto code = lv->value.raw_json().get(raw);
+  if (unlikely(code != SUCCESS)) raise_simdjson_error(mrb, code);
+  return mrb_str_new(mrb, raw.data(), raw.size());
+}
 
-    return self;
-  }
+// JSON::Value#type -> :object or :array
+static mrb_value
+mrb_json_value_type(mrb_state *mrb, mrb_value self)
+{
+  auto *lv = mrb_cpp_get<LazyValue>(mrb, self);
+  return mrb_symbol_value(lv->is_object ? MRB_SYM(object) : MRB_SYM(array));
+}
 
-  raise_simdjson_error(mrb, result.error());
-  return mrb_undef_value();
+// JSON::Value#alive? -> whether the value can still be navigated
+static mrb_value
+mrb_json_value_alive_p(mrb_state *mrb, mrb_value self)
+{
+  auto *lv = mrb_cpp_get<LazyValue>(mrb, self);
+  return mrb_bool_value(lv->live() && !lv->iterating);
 }
 
 class MrubyDeserialize {
 public:
   mrb_state *mrb;
   mrb_value self;
+  ConvertCtx *ctx;
 
-  explicit MrubyDeserialize(mrb_state *mrb, mrb_value self) : mrb(mrb), self(self) {}
+  explicit MrubyDeserialize(mrb_state *mrb, mrb_value self, ConvertCtx *ctx)
+  : mrb(mrb), self(self), ctx(ctx) {}
 };
 
 static inline bool valid_schema_entry(mrb_state *mrb,
@@ -1206,8 +4236,9 @@ auto tag_invoke(deserialize_tag, simdjson_value &val, MrubyDeserialize& mruby) {
   struct Ctx {
     mrb_value self;
     object *obj;
+    ConvertCtx *convert;
     error_code error = INCORRECT_TYPE;
-  } ctx{self, &obj};
+  } ctx{self, &obj, mruby.ctx};
 
   mrb_hash_foreach(
     mrb,
@@ -1227,7 +4258,7 @@ auto tag_invoke(deserialize_tag, simdjson_value &val, MrubyDeserialize& mruby) {
             get_type(json_field, type, ctx->error) &&
             types_match(mrb, type, expected_type)
       )) {
-          mrb_value ruby_value = convert_ondemand_value_to_mrb(mrb, json_field);
+          mrb_value ruby_value = convert_ondemand_value_to_mrb(mrb, json_field, *ctx->convert);
           mrb_iv_set(mrb, ctx->self, mrb_symbol(key), ruby_value);
           ctx->error = SUCCESS;
           return 0;
@@ -1252,9 +4283,10 @@ mrb_document_deserialize(mrb_state *mrb, mrb_value self)
 {
   mrb_value into;
   mrb_get_args(mrb, "o", &into);
-  MrubyDeserialize mruby(mrb, into);
+  ConvertCtx ctx(mrb, mrb_json_doc_flags(mrb, self));
+  MrubyDeserialize mruby(mrb, into, &ctx);
 
-  ondemand::document *doc = mrb_cpp_get<ondemand::document>(mrb, self);
+  ondemand::document *doc = mrb_json_doc_get(mrb, self);
 
   auto code = doc->get(mruby);
   if (likely(code == SUCCESS)) {
@@ -1287,14 +4319,130 @@ static inline void json_encode_true(builder::string_builder &builder) {
   builder.append(true);
 }
 
-static inline void json_encode_string(mrb_value v, builder::string_builder &builder) {
+// Returns the length of the ASCII-only prefix of p.
+static size_t
+ascii_prefix(const char *p, size_t len)
+{
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, p + i, sizeof(word));
+    if (word & UINT64_C(0x8080808080808080)) break;
+  }
+  while (i < len && static_cast<unsigned char>(p[i]) < 0x80) i++;
+  return i;
+}
+
+// Checks a string for valid UTF-8 right before it is escaped, instead of
+// validating the whole output afterwards. ASCII-only strings get mruby's
+// ASCII flag, which mruby clears when the string changes, so later dumps
+// skip them. Long frozen strings with multibyte characters are remembered
+// in the state's Utf8Cache.
+static void
+json_check_utf8(mrb_state *mrb, mrb_value v)
+{
+  struct RString *s = mrb_str_ptr(v);
+  if (likely(RSTR_ASCII_P(s))) return;
+
+  const char *p = RSTR_PTR(s);
+  const size_t len = RSTR_LEN(s);
+  const size_t ascii = ascii_prefix(p, len);
+  if (ascii == len) {
+    RSTR_SET_ASCII_FLAG(s);
+    return;
+  }
+
+  Utf8Cache *cache = nullptr;
+  if (mrb_frozen_p(mrb_obj_ptr(v)) && len >= Utf8Cache::min_length) {
+    cache = &mrb_json_state_get(mrb)->utf8;
+    if (cache->contains(s)) return;
+  }
+  // the ASCII prefix ends on a character boundary
+  if (unlikely(!validate_utf8(p + ascii, len - ascii))) {
+    mrb_raise(mrb, mrb_json_error_class(mrb, UTF8_ERROR), "invalid utf-8");
+  }
+  if (cache) cache->add(mrb, v);
+}
+
+static inline void json_encode_string(mrb_state *mrb, mrb_value v,
+                                      builder::string_builder &builder) {
+  json_check_utf8(mrb, v);
   std::string_view sv(RSTRING_PTR(v), RSTRING_LEN(v));
   builder.escape_and_append_with_quotes(sv);
 }
 
-static inline void json_encode_symbol(mrb_state *mrb, mrb_value v,
+// Appends str escaped and quoted, followed by a colon, and returns what was
+// appended for the key cache.
+static std::string_view
+json_append_key(mrb_state *mrb, mrb_value str, builder::string_builder &builder)
+{
+  const size_t before = builder.size();
+  json_encode_string(mrb, str, builder);
+  builder.append_colon();
+  std::string_view all = builder.view();
+  return all.substr(before);
+}
+
+// Appends an object key and the colon after it. Symbols and frozen strings
+// come from the state's EscapedKeyCache; integers, true, false and nil are
+// formatted in place. Only other keys are converted with #to_s.
+static void
+json_encode_key(mrb_state *mrb, mrb_value key, builder::string_builder &builder,
+                EscapedKeyCache &cache)
+{
+  switch (mrb_type(key)) {
+    case MRB_TT_SYMBOL: {
+      const mrb_sym sym = mrb_symbol(key);
+      if (const std::string *hit = cache.find(sym)) {
+        builder.append_raw(*hit);
+      } else {
+        cache.add(sym, json_append_key(mrb, mrb_sym_str(mrb, sym), builder));
+      }
+    } break;
+    case MRB_TT_STRING: {
+      const std::string_view sv(RSTRING_PTR(key), RSTRING_LEN(key));
+      if (!mrb_frozen_p(mrb_obj_ptr(key)) || sv.size() > EscapedKeyCache::max_key_length) {
+        json_append_key(mrb, key, builder);
+      } else if (const std::string *hit = cache.find(sv)) {
+        builder.append_raw(*hit);
+      } else {
+        cache.add(mrb, key, json_append_key(mrb, key, builder));
+      }
+    } break;
+    case MRB_TT_INTEGER: {
+      builder.append_raw("\"", 1);
+      builder.append(mrb_integer(key));
+      builder.append_raw("\":", 2);
+    } break;
+    case MRB_TT_TRUE: {
+      builder.append_raw("\"true\":", 7);
+    } break;
+    case MRB_TT_FALSE: {
+      if (mrb_nil_p(key)) builder.append_raw("\"\":", 3);
+      else builder.append_raw("\"false\":", 8);
+    } break;
+    default: {
+      json_append_key(mrb, mrb_obj_as_string(mrb, key), builder);
+    }
+  }
+}
+
+// Symbol values share the key cache; an entry without its colon is the
+// quoted name.
+static void json_encode_symbol(mrb_state *mrb, mrb_value v,
                                builder::string_builder &builder) {
-  json_encode_string(mrb_sym_str(mrb, mrb_symbol(v)), builder);
+  EscapedKeyCache &cache = mrb_json_state_get(mrb)->dump_keys;
+  const mrb_sym sym = mrb_symbol(v);
+  if (const std::string *hit = cache.find(sym)) {
+    builder.append_raw(hit->data(), hit->size() - 1);
+    return;
+  }
+  const size_t before = builder.size();
+  json_encode_string(mrb, mrb_sym_str(mrb, sym), builder);
+  std::string_view all = builder.view();
+  std::string entry(all.substr(before));
+  entry.push_back(':');
+  cache.add(sym, entry);
 }
 #ifndef MRB_NO_FLOAT
 static inline void json_encode_float(mrb_value v,
@@ -1307,13 +4455,91 @@ static inline void json_encode_integer(mrb_value v,
   builder.append(mrb_integer(v));
 }
 
+#ifdef MRB_USE_BIGINT
+// Integers beyond mrb_int. Those up to UINT64_MAX, such as unsigned 64-bit
+// IDs, are written by the builder's integer formatter without allocating.
+// Larger ones are formatted by mruby-bigint, which exposes no way to write
+// digits elsewhere; its temporary string is released from the arena at once.
+static void json_encode_bigint(mrb_state *mrb, mrb_value v,
+                               builder::string_builder &builder) {
+  mrb_json_state *state = mrb_json_state_get(mrb);
+  if (mrb_bint_cmp(mrb, v, mrb_fixnum_value(0)) > 0 &&
+      mrb_bint_cmp(mrb, v, state->uint64_max) <= 0) {
+    builder.append(mrb_bint_as_uint64(mrb, v));
+    return;
+  }
+  int arena_index = mrb_gc_arena_save(mrb);
+  mrb_value digits = mrb_bint_to_s(mrb, v, 10);
+  builder.append_raw(std::string_view(RSTRING_PTR(digits), RSTRING_LEN(digits)));
+  mrb_gc_arena_restore(mrb, arena_index);
+}
+#endif
+
+// Where JSON.dump(obj, io) and JSON.dump_to_fd send their output. The
+// encoder hands the builder's contents over whenever they reach chunk
+// bytes, so memory stays around one chunk plus the largest single string.
+struct DumpSink {
+  int fd;         // -1 to call io.write instead
+  mrb_value io;
+  size_t chunk;
+  size_t written = 0;
+  size_t peak = 0; // largest builder size flushed, about its capacity
+};
+
+static void
+json_write_fd(mrb_state *mrb, int fd, const char *p, size_t len)
+{
+  while (len > 0) {
+#ifdef _WIN32
+    const int n = _write(fd, p, static_cast<unsigned int>(std::min<size_t>(len, INT_MAX)));
+#else
+    const ssize_t n = ::write(fd, p, len);
+#endif
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      mrb_sys_fail(mrb, "failed to write JSON");
+    }
+    p += n;
+    len -= static_cast<size_t>(n);
+  }
+}
+
+static void
+json_dump_flush(mrb_state *mrb, builder::string_builder &builder, DumpSink &sink)
+{
+  std::string_view sv = builder.view();
+  if (sv.empty()) return;
+  if (sink.fd >= 0) {
+    json_write_fd(mrb, sink.fd, sv.data(), sv.size());
+  } else {
+    int arena_index = mrb_gc_arena_save(mrb);
+    mrb_value chunk = mrb_str_new(mrb, sv.data(), sv.size());
+    mrb_funcall_argv(mrb, sink.io, MRB_SYM(write), 1, &chunk);
+    mrb_gc_arena_restore(mrb, arena_index);
+  }
+  sink.written += sv.size();
+  sink.peak = std::max(sink.peak, sv.size());
+  builder.clear();
+}
+
+static inline void
+json_dump_maybe_flush(mrb_state *mrb, builder::string_builder &builder, DumpSink *sink)
+{
+  if (unlikely(sink != nullptr) && builder.size() >= sink->chunk) {
+    json_dump_flush(mrb, builder, *sink);
+  }
+}
+
 struct DumpHashCtx {
   builder::string_builder &builder;
+  EscapedKeyCache &keys;
+  DumpSink *sink;
   bool first;
 };
 
 static void json_encode(mrb_state *mrb, mrb_value v,
-                        builder::string_builder &builder);
+                        builder::string_builder &builder,
+                        DumpSink *sink = nullptr);
 
 static int dump_hash_cb(mrb_state *mrb, mrb_value key, mrb_value val,
                         void * const data) {
@@ -1324,40 +4550,67 @@ static int dump_hash_cb(mrb_state *mrb, mrb_value key, mrb_value val,
   else
     ctx->builder.append_comma();
 
-  json_encode(mrb, mrb_obj_as_string(mrb, key), ctx->builder);
-  ctx->builder.append_colon();
-  json_encode(mrb, val, ctx->builder);
+  json_encode_key(mrb, key, ctx->builder, ctx->keys);
+  json_encode(mrb, val, ctx->builder, ctx->sink);
+  json_dump_maybe_flush(mrb, ctx->builder, ctx->sink);
 
   return 0; // continue iteration
 }
 
 static void json_encode_hash(mrb_state *mrb, mrb_value v,
-                             builder::string_builder &builder) {
+                             builder::string_builder &builder,
+                             DumpSink *sink = nullptr) {
   builder.start_object();
-  DumpHashCtx ctx{builder, true};
+  DumpHashCtx ctx{builder, mrb_json_state_get(mrb)->dump_keys, sink, true};
   mrb_hash_foreach(mrb, mrb_hash_ptr(v), dump_hash_cb, &ctx);
   builder.end_object();
 }
 
 static void json_encode_array(mrb_state *mrb, mrb_value v,
-                              builder::string_builder &builder) {
+                              builder::string_builder &builder,
+                              DumpSink *sink = nullptr) {
   builder.start_array();
   const mrb_int n = RARRAY_LEN(v);
 
   if (n > 0) {
-    json_encode(mrb, mrb_ary_ref(mrb, v, 0), builder);
+    json_encode(mrb, mrb_ary_ref(mrb, v, 0), builder, sink);
+    json_dump_maybe_flush(mrb, builder, sink);
 
     for (mrb_int i = 1; i < n; ++i) {
       builder.append_comma();
-      json_encode(mrb, mrb_ary_ref(mrb, v, i), builder);
+      json_encode(mrb, mrb_ary_ref(mrb, v, i), builder, sink);
+      json_dump_maybe_flush(mrb, builder, sink);
     }
   }
 
   builder.end_array();
 }
 
+static void json_encode_numeric_array(mrb_state *mrb, mrb_value v,
+                                      builder::string_builder &builder) {
+  mrb_value data = mrb_iv_get(mrb, v, MRB_SYM(data));
+  const bool is_float = mrb_symbol(mrb_iv_get(mrb, v, MRB_SYM(type))) == MRB_SYM(float64);
+  const char *p = RSTRING_PTR(data);
+  const mrb_int n = RSTRING_LEN(data) / sizeof(int64_t);
+
+  builder.start_array();
+  for (mrb_int i = 0; i < n; ++i, p += sizeof(int64_t)) {
+    if (i > 0) builder.append_comma();
+    if (is_float) {
+      double d;
+      memcpy(&d, p, sizeof(d));
+      builder.append(d);
+    } else {
+      int64_t x;
+      memcpy(&x, p, sizeof(x));
+      builder.append(x);
+    }
+  }
+  builder.end_array();
+}
+
 static void json_encode(mrb_state *mrb, mrb_value v,
-                        builder::string_builder &builder) {
+                        builder::string_builder &builder, DumpSink *sink) {
   switch (mrb_type(v)) {
     case MRB_TT_FALSE: {
       json_encode_false_type(v, builder);
@@ -1376,102 +4629,467 @@ static void json_encode(mrb_state *mrb, mrb_value v,
     case MRB_TT_INTEGER: {
       json_encode_integer(v, builder);
     } break;
+  #ifdef MRB_USE_BIGINT
+    case MRB_TT_BIGINT: {
+      json_encode_bigint(mrb, v, builder);
+    } break;
+  #endif
     case MRB_TT_HASH: {
-      json_encode_hash(mrb, v, builder);
+      json_encode_hash(mrb, v, builder, sink);
     } break;
     case MRB_TT_ARRAY: {
-      json_encode_array(mrb, v, builder);
+      json_encode_array(mrb, v, builder, sink);
     } break;
     case MRB_TT_STRING: {
-      json_encode_string(v, builder);
+      json_encode_string(mrb, v, builder);
     } break;
     default: {
-      json_encode_string(mrb_obj_as_string(mrb, v), builder);
+      if (mrb_obj_class(mrb, v) == mrb_json_state_get(mrb)->numeric_array_class) {
+        json_encode_numeric_array(mrb, v, builder);
+      } else {
+        json_encode_string(mrb, mrb_obj_as_string(mrb, v), builder);
+      }
     }
   }
 }
 
-MRB_API mrb_value mrb_json_dump(mrb_state *mrb, mrb_value obj) {
-  builder::string_builder sb;
-  json_encode(mrb, obj, sb);
-  if (likely(sb.validate_unicode())) {
-    std::string_view sv = sb.view();
+MRB_CPP_DEFINE_TYPE(builder::string_builder, string_builder);
+
+// Builders that grew past this are dropped after use rather than kept, so
+// one huge dump does not pin its buffer for the life of the state.
+static constexpr size_t max_retained_builder = 1 << 20;
+
+// The builder for JSON.dump and #to_json. It keeps its capacity from one
+// call to the next. While in use it is taken out of the state, so a nested
+// dump (from a #to_s called during encoding) gets its own. Until it is
+// given back only the GC arena refers to it, which keeps it alive through
+// any GC that #to_s or #write run; a builder lost to an exception is freed
+// once the arena is restored.
+static builder::string_builder*
+mrb_json_builder_take(mrb_state *mrb, mrb_json_state *state, mrb_value *obj)
+{
+  mrb_value json = mrb_obj_value(state->json_mod);
+  *obj = mrb_iv_get(mrb, json, MRB_SYM(dump_builder));
+  if (mrb_nil_p(*obj)) {
+    return mrb_json_hidden_new<builder::string_builder>(mrb, obj);
+  }
+  mrb_gc_protect(mrb, *obj);
+  mrb_iv_set(mrb, json, MRB_SYM(dump_builder), mrb_nil_value());
+  auto *sb = mrb_cpp_get<builder::string_builder>(mrb, *obj);
+  sb->clear();
+  return sb;
+}
+
+// Puts the builder back into the state unless it grew too large. peak is
+// the most it held at once; a builder only grows, so that is about its
+// capacity even when it was flushed and is empty now.
+static void
+mrb_json_builder_give_back(mrb_state *mrb, mrb_json_state *state, mrb_value sb_obj,
+                           size_t peak)
+{
+  if (peak <= max_retained_builder) {
+    mrb_iv_set(mrb, mrb_obj_value(state->json_mod), MRB_SYM(dump_builder), sb_obj);
+    state->dump_builder_capacity = peak;
+  }
+}
+
+// Returns the builder's output in out, or in a new string when out is nil.
+// Strings were checked for valid UTF-8 while they were encoded. A given out
+// keeps its buffer and only grows it, so dumping into the same string again
+// does not allocate. The output is still copied once: simdjson's builder
+// owns its buffer through new[] and can neither write into nor hand it over
+// to a string from mruby's allocator.
+static mrb_value
+mrb_json_builder_finish(mrb_state *mrb, mrb_json_state *state, mrb_value sb_obj,
+                        builder::string_builder &sb, mrb_value out)
+{
+  mrb_json_builder_give_back(mrb, state, sb_obj, sb.size());
+
+  std::string_view sv = sb.view();
+  if (mrb_nil_p(out)) {
     return mrb_str_new(mrb, sv.data(), sv.size());
   }
+  mrb_str_modify(mrb, mrb_str_ptr(out));
+  mrb_str_resize(mrb, out, static_cast<mrb_int>(sv.size()));
+  memcpy(RSTRING_PTR(out), sv.data(), sv.size());
+  return out;
+}
+
+MRB_API mrb_value
+mrb_json_dump_into(mrb_state *mrb, mrb_value obj, mrb_value out)
+{
+  mrb_json_state *state = mrb_json_state_get(mrb);
+  mrb_value sb_obj;
+  builder::string_builder &sb = *mrb_json_builder_take(mrb, state, &sb_obj);
+  json_encode(mrb, obj, sb);
+  return mrb_json_builder_finish(mrb, state, sb_obj, sb, out);
+}
+
+MRB_API mrb_value mrb_json_dump(mrb_state *mrb, mrb_value obj) {
+  return mrb_json_dump_into(mrb, obj, mrb_nil_value());
+}
+
+static constexpr size_t default_dump_chunk = 64 * 1024;
+
+static mrb_int
+mrb_json_dump_to_sink(mrb_state *mrb, mrb_value obj, DumpSink &sink)
+{
+  mrb_json_state *state = mrb_json_state_get(mrb);
+  mrb_value sb_obj;
+  builder::string_builder &sb = *mrb_json_builder_take(mrb, state, &sb_obj);
+  json_encode(mrb, obj, sb, &sink);
+  json_dump_flush(mrb, sb, sink);
+  mrb_json_builder_give_back(mrb, state, sb_obj, sink.peak);
+  return static_cast<mrb_int>(sink.written);
+}
 
-   mrb_raise(mrb, E_JSON_UTF8_ERROR, "invalid utf-8");
-   return mrb_undef_value();
+MRB_API mrb_int
+mrb_json_dump_fd(mrb_state *mrb, mrb_value obj, int fd, size_t chunk_size)
+{
+  if (fd < 0) mrb_raise(mrb, E_ARGUMENT_ERROR, "negative file descriptor");
+  DumpSink sink{fd, mrb_nil_value(), chunk_size > 0 ? chunk_size : default_dump_chunk};
+  return mrb_json_dump_to_sink(mrb, obj, sink);
 }
 
+// JSON.dump(obj, io = nil, into: nil, chunk_size: 65536)
+//
+// With io, the JSON goes to io in chunk_size pieces while it is encoded and
+// the number of bytes written is returned. An io with #fileno is flushed and
+// then written through its descriptor directly; anything else gets #write
+// calls.
 static mrb_value mrb_json_dump_m(mrb_state *mrb, mrb_value self) {
-  mrb_value obj;
-  mrb_get_args(mrb, "o", &obj);
+  mrb_value obj, io = mrb_nil_value();
+  mrb_value kw_values[2] = {mrb_undef_value(), mrb_undef_value()};
+  mrb_sym kw_names[] = {MRB_SYM(into), MRB_SYM(chunk_size)};
+  mrb_kwargs kwargs = {2, 0, kw_names, kw_values, NULL};
+  mrb_get_args(mrb, "o|o:", &obj, &io, &kwargs);
+
+  const bool has_into = !mrb_undef_p(kw_values[0]) && !mrb_nil_p(kw_values[0]);
+  if (!mrb_nil_p(io)) {
+    if (has_into) mrb_raise(mrb, E_ARGUMENT_ERROR, "io and into: are exclusive");
+    DumpSink sink{-1, io, size_kwarg(mrb, kw_values[1], default_dump_chunk, "chunk_size")};
+    if (mrb_respond_to(mrb, io, MRB_SYM(fileno))) {
+      if (mrb_respond_to(mrb, io, MRB_SYM(flush))) {
+        mrb_funcall_argv(mrb, io, MRB_SYM(flush), 0, NULL);
+      }
+      mrb_value fd = mrb_funcall_argv(mrb, io, MRB_SYM(fileno), 0, NULL);
+      if (mrb_integer_p(fd) && mrb_integer(fd) >= 0) {
+        sink.fd = static_cast<int>(mrb_integer(fd));
+      }
+    }
+    return mrb_convert_number(mrb, mrb_json_dump_to_sink(mrb, obj, sink));
+  }
+
+  mrb_value out = mrb_nil_value();
+  if (has_into) {
+    out = mrb_ensure_string_type(mrb, kw_values[0]);
+  }
+  return mrb_json_dump_into(mrb, obj, out);
+}
 
-  return mrb_json_dump(mrb, obj);
+// JSON.dump_to_fd(obj, fd, chunk_size: 65536) -> bytes written
+static mrb_value
+mrb_json_dump_to_fd_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_value obj;
+  mrb_int fd;
+  mrb_value kw_values[1] = {mrb_undef_value()};
+  mrb_sym kw_names[] = {MRB_SYM(chunk_size)};
+  mrb_kwargs kwargs = {1, 0, kw_names, kw_values, NULL};
+  mrb_get_args(mrb, "oi:", &obj, &fd, &kwargs);
+
+  if (fd < 0 || fd > INT_MAX) mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid file descriptor");
+  DumpSink sink{static_cast<int>(fd), mrb_nil_value(), size_kwarg(mrb, kw_values[0], default_dump_chunk, "chunk_size")};
+  return mrb_convert_number(mrb, mrb_json_dump_to_sink(mrb, obj, sink));
 }
 
 #define DEFINE_MRB_TO_JSON(func_name, ENCODER_CALL)                            \
   static mrb_value func_name(mrb_state *mrb, mrb_value o) {                    \
-    builder::string_builder sb;                                                \
+    mrb_json_state *state = mrb_json_state_get(mrb);                           \
+    mrb_value sb_obj;                                                          \
+    builder::string_builder &sb = *mrb_json_builder_take(mrb, state, &sb_obj); \
     ENCODER_CALL;                                                              \
-    if (unlikely(!sb.validate_unicode())) {                                    \
-      mrb_raise(mrb, E_JSON_UTF8_ERROR, "invalid utf-8");                      \
-    }                                                                          \
-    std::string_view sv = sb.view();                                           \
-    return mrb_str_new(mrb, sv.data(), sv.size());                             \
+    return mrb_json_builder_finish(mrb, state, sb_obj, sb, mrb_nil_value());  \
   }
 
-DEFINE_MRB_TO_JSON(mrb_string_to_json, json_encode_string(o, sb));
+DEFINE_MRB_TO_JSON(mrb_string_to_json, json_encode_string(mrb, o, sb));
 DEFINE_MRB_TO_JSON(mrb_array_to_json, json_encode_array(mrb, o, sb));
 DEFINE_MRB_TO_JSON(mrb_hash_to_json, json_encode_hash(mrb, o, sb));
 #ifndef MRB_NO_FLOAT
 DEFINE_MRB_TO_JSON(mrb_float_to_json, json_encode_float(o, sb));
 #endif
-DEFINE_MRB_TO_JSON(mrb_integer_to_json, json_encode_integer(o, sb));
+DEFINE_MRB_TO_JSON(mrb_integer_to_json, json_encode(mrb, o, sb));
 DEFINE_MRB_TO_JSON(mrb_true_to_json, json_encode_true(sb));
 DEFINE_MRB_TO_JSON(mrb_false_to_json, json_encode_false(sb));
 DEFINE_MRB_TO_JSON(mrb_nil_to_json, json_encode_nil(sb));
 DEFINE_MRB_TO_JSON(mrb_symbol_to_json, json_encode_symbol(mrb, o, sb));
 
 MRB_API mrb_value
-mrb_json_load(mrb_state *mrb, mrb_value path_str, mrb_bool symbolize_names)
+mrb_json_load_flags(mrb_state *mrb, mrb_value path_str, uint32_t flags)
 {
-  std::string_view path(RSTRING_PTR(path_str), RSTRING_LEN(path_str));
-  auto res = padded_string::load(path);
-  if (unlikely(res.error() != SUCCESS)) {
-    mrb_sys_fail(mrb, "failed to read file");
+  auto *state = mrb_json_state_get(mrb);
+#ifndef _WIN32
+  if (mrb_json_should_map(mrb, state, path_str)) {
+    mrb_value file_obj;
+    auto *file = mrb_json_map_file(mrb, path_str, &file_obj);
+    auto result = state->parser.parse(file->view());
+    // the tape and string buffer no longer refer to the input
+    file->unmap();
+    return convert_dom_result(mrb, state, result, flags);
   }
+#endif
+  auto view = mrb_json_state_load_file(mrb, state, path_str);
+  return convert_dom_result(mrb, state, state->parser.parse(view), flags);
+}
 
-  dom::parser parser;
-  auto result = parser.parse(res.value());
+MRB_API mrb_value
+mrb_json_load(mrb_state *mrb, mrb_value path_str, mrb_bool symbolize_names)
+{
+  return mrb_json_load_flags(mrb, path_str, symbolize_names ? MRB_JSON_SYMBOLIZE_NAMES : 0);
+}
 
-  if (unlikely(result.error() != SUCCESS)) {
-    raise_simdjson_error(mrb, result.error());
+// JSON.try_parse(str, **opts): like JSON.parse, but returns the error class
+// name as a Symbol instead of raising. A JSON value is never a Symbol.
+static mrb_value
+mrb_json_try_parse_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_value str;
+  uint32_t flags = get_parse_flags(mrb, &str);
+
+  int error;
+  mrb_value result = mrb_json_try_parse(mrb, str, flags, &error);
+  if (likely(error == SUCCESS)) return result;
+  return mrb_symbol_value(mrb_json_error_name(mrb, error));
+}
+
+// JSON.valid?(str): whether str is well-formed JSON in valid UTF-8. Nothing
+// is converted, so only the reused parser's tape is written.
+static mrb_value
+mrb_json_valid_p(mrb_state *mrb, mrb_value self)
+{
+  mrb_value str;
+  mrb_get_args(mrb, "S", &str);
+  return mrb_bool_value(mrb_json_validate(mrb, str) == SUCCESS);
+}
+
+// JSON.validate_many(strings): validates every string with the same parser
+// and returns an array holding true for each valid one and the name of the
+// error class, as JSON.try_parse returns it, for each invalid one.
+static mrb_value
+mrb_json_validate_many(mrb_state *mrb, mrb_value self)
+{
+  mrb_value strings;
+  mrb_get_args(mrb, "A", &strings);
+
+  mrb_json_state *state = mrb_json_state_get(mrb);
+  const mrb_int len = RARRAY_LEN(strings);
+  mrb_value results = mrb_ary_new_capa(mrb, len);
+  int arena_index = mrb_gc_arena_save(mrb);
+
+  for (mrb_int i = 0; i < RARRAY_LEN(strings); i++) {
+    mrb_value str = mrb_ensure_string_type(mrb, RARRAY_PTR(strings)[i]);
+    error_code code = validate_string(mrb, state, str);
+    mrb_ary_push(mrb, results, code == SUCCESS
+                 ? mrb_true_value() : mrb_symbol_value(mrb_json_error_name(mrb, code)));
+    mrb_gc_arena_restore(mrb, arena_index);
   }
+  return results;
+}
 
-  return convert_element(mrb, result.value(), symbolize_names);
+// JSON.minify(str, buffer = nil)
+static mrb_value
+mrb_json_minify(mrb_state *mrb, mrb_value self)
+{
+  mrb_value str, buffer = mrb_nil_value();
+  mrb_get_args(mrb, "S|o", &str, &buffer);
+  return minify_into(mrb, RSTRING_PTR(str), RSTRING_LEN(str), buffer);
 }
 
 static mrb_value
 mrb_json_load_m(mrb_state *mrb, mrb_value self)
 {
   mrb_value path_str;
-  mrb_value kw_values[1] = {
-      mrb_undef_value()}; // default value for symbolize_names
-  mrb_sym kw_names[] = {MRB_SYM(symbolize_names)};
-  mrb_kwargs kwargs = {1, // num: number of keywords
-                       0, // required: none required
-                       kw_names, kw_values, NULL};
+  uint32_t flags = get_parse_flags(mrb, &path_str);
+
+  return mrb_json_load_flags(mrb, path_str, flags);
+}
+
+static mrb_value
+numeric_array_at(mrb_state *mrb, mrb_value data, bool is_float, mrb_int index)
+{
+  const char *p = RSTRING_PTR(data) + index * sizeof(int64_t);
+  if (is_float) {
+    double d;
+    memcpy(&d, p, sizeof(d));
+    return mrb_convert_number(mrb, d);
+  }
+  int64_t i;
+  memcpy(&i, p, sizeof(i));
+  return mrb_convert_number(mrb, i);
+}
+
+static mrb_value
+mrb_numeric_array_size(mrb_state *mrb, mrb_value self)
+{
+  mrb_value data = mrb_iv_get(mrb, self, MRB_SYM(data));
+  return mrb_convert_number(mrb, RSTRING_LEN(data) / static_cast<mrb_int>(sizeof(int64_t)));
+}
+
+static mrb_value
+mrb_numeric_array_aref(mrb_state *mrb, mrb_value self)
+{
+  mrb_int index;
+  mrb_get_args(mrb, "i", &index);
+
+  mrb_value data = mrb_iv_get(mrb, self, MRB_SYM(data));
+  const mrb_int n = RSTRING_LEN(data) / sizeof(int64_t);
+  if (index < 0) index += n;
+  if (index < 0 || index >= n) return mrb_nil_value();
+
+  const bool is_float = mrb_symbol(mrb_iv_get(mrb, self, MRB_SYM(type))) == MRB_SYM(float64);
+  return numeric_array_at(mrb, data, is_float, index);
+}
+
+static mrb_value
+mrb_numeric_array_to_a(mrb_state *mrb, mrb_value self)
+{
+  mrb_value data = mrb_iv_get(mrb, self, MRB_SYM(data));
+  const bool is_float = mrb_symbol(mrb_iv_get(mrb, self, MRB_SYM(type))) == MRB_SYM(float64);
+  const mrb_int n = RSTRING_LEN(data) / sizeof(int64_t);
+
+  mrb_value ary = mrb_ary_new_capa(mrb, n);
+  int arena = mrb_gc_arena_save(mrb);
+  for (mrb_int i = 0; i < n; ++i) {
+    mrb_ary_push(mrb, ary, numeric_array_at(mrb, data, is_float, i));
+    mrb_gc_arena_restore(mrb, arena);
+  }
+  return ary;
+}
+
+static mrb_value
+mrb_numeric_array_type(mrb_state *mrb, mrb_value self)
+{
+  return mrb_iv_get(mrb, self, MRB_SYM(type));
+}
+
+static mrb_value
+mrb_numeric_array_data(mrb_state *mrb, mrb_value self)
+{
+  return mrb_iv_get(mrb, self, MRB_SYM(data));
+}
+
+static mrb_value
+mrb_json_get_zero_copy_parsing(mrb_state *mrb, mrb_value self)
+{
+  return mrb_bool_value(mrb_json_state_get(mrb)->zero_copy_parsing);
+}
+
+static mrb_value
+mrb_json_set_zero_copy_parsing(mrb_state *mrb, mrb_value self)
+{
+  mrb_value val;
+  mrb_get_args(mrb, "o", &val);
+  mrb_json_state_get(mrb)->zero_copy_parsing = mrb_test(val);
+  return val;
+}
 
-  mrb_get_args(mrb, "S:", &path_str, &kwargs);
+static mrb_value
+mrb_json_get_mmap_threshold(mrb_state *mrb, mrb_value self)
+{
+  int64_t threshold = mrb_json_state_get(mrb)->mmap_threshold;
+  return threshold < 0 ? mrb_nil_value() : mrb_convert_number(mrb, threshold);
+}
 
-  // Fallback default
-  mrb_bool symbolize_names = FALSE;
-  if (!mrb_undef_p(kw_values[0])) {
-    symbolize_names = mrb_bool(kw_values[0]); // cast to mrb_bool
+static mrb_value
+mrb_json_set_mmap_threshold(mrb_state *mrb, mrb_value self)
+{
+  mrb_value val;
+  mrb_get_args(mrb, "o", &val);
+  int64_t threshold = -1;
+  if (!mrb_nil_p(val)) {
+    threshold = mrb_as_int(mrb, val);
+    if (threshold < 0) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "mmap_threshold must not be negative");
+    }
   }
+  mrb_json_state_get(mrb)->mmap_threshold = threshold;
+  return val;
+}
+
+static mrb_value
+mrb_json_get_cache_keys(mrb_state *mrb, mrb_value self)
+{
+  return mrb_bool_value(mrb_json_state_get(mrb)->cache_keys);
+}
+
+static mrb_value
+mrb_json_set_cache_keys(mrb_state *mrb, mrb_value self)
+{
+  mrb_value val;
+  mrb_get_args(mrb, "o", &val);
+  mrb_json_state_get(mrb)->cache_keys = mrb_test(val);
+  return val;
+}
+
+// Sizes of everything the state keeps between calls: the parsers and
+// buffers in bytes, the caches in entries.
+static mrb_value
+mrb_json_parser_stats(mrb_state *mrb, mrb_value self)
+{
+  auto *state = mrb_json_state_get(mrb);
+  mrb_value json = mrb_obj_value(state->json_mod);
+  mrb_value stream_obj = mrb_iv_get(mrb, json, MRB_SYM(stream_parser));
+  const bool builder_kept = !mrb_nil_p(mrb_iv_get(mrb, json, MRB_SYM(dump_builder)));
+
+  mrb_value stats = mrb_hash_new_capa(mrb, 11);
+  mrb_hash_set(mrb, stats, mrb_symbol_value(MRB_SYM(capacity)),
+               mrb_convert_number(mrb, state->parser.capacity()));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(MRB_SYM(max_depth)),
+               mrb_convert_number(mrb, state->parser.max_depth()));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(MRB_SYM(buffer_capacity)),
+               mrb_convert_number(mrb, state->buffer.size()));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(MRB_SYM(stream_parser_capacity)),
+               mrb_convert_number(mrb, mrb_nil_p(stream_obj) ? 0 :
+                 mrb_cpp_get<dom::parser>(mrb, stream_obj)->capacity()));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(MRB_SYM(dump_builder_capacity)),
+               mrb_convert_number(mrb, builder_kept ? state->dump_builder_capacity : 0));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(MRB_SYM(frames_capacity)),
+               mrb_convert_number(mrb, state->frames.capacity() * sizeof(TapeFrame)));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(MRB_SYM(cached_keys)),
+               mrb_convert_number(mrb, state->keys.size()));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(MRB_SYM(cached_values)),
+               mrb_convert_number(mrb, state->values.size()));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(MRB_SYM(cached_utf8)),
+               mrb_convert_number(mrb, state->utf8.size()));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(MRB_SYM(cached_dump_keys)),
+               mrb_convert_number(mrb, state->dump_keys.size()));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(MRB_SYM(cached_paths)),
+               mrb_convert_number(mrb, state->pointers.size() + state->paths.size()));
+  return stats;
+}
 
-  return mrb_json_load(mrb, path_str, symbolize_names);
+// Drops everything the state keeps between calls. A stream parser or dump
+// builder in use was taken out of the state and is not affected.
+static mrb_value
+mrb_json_reset_parser(mrb_state *mrb, mrb_value self)
+{
+  auto *state = mrb_json_state_get(mrb);
+  mrb_value json = mrb_obj_value(state->json_mod);
+
+  state->parser = dom::parser();
+  state->buffer = padded_string();
+  state->frames = std::vector<TapeFrame>();
+  state->keys.clear();
+  state->values.clear();
+  state->utf8.clear();
+  state->dump_keys.clear();
+  state->pointers.clear();
+  state->paths.clear();
+  mrb_iv_set(mrb, json, MRB_SYM(stream_parser), mrb_nil_value());
+  mrb_iv_set(mrb, json, MRB_SYM(dump_builder), mrb_nil_value());
+  state->dump_builder_capacity = 0;
+
+  return mrb_nil_value();
 }
 
 MRB_BEGIN_DECL
@@ -1492,64 +5110,117 @@ void mrb_mruby_fast_json_gem_init(mrb_state *mrb) {
   auto impl = simdjson::get_active_implementation()->description();
   mrb_value impl_name = mrb_str_new(mrb, impl.data(), impl.size());
   mrb_define_const_id(mrb, json_mod, MRB_SYM(SIMD_IMPLEMENTATION),  impl_name);
+
+  mrb_value state_obj = mrb_obj_value(mrb_data_object_alloc(mrb, mrb->object_class, NULL, NULL));
+  auto *state = mrb_cpp_new<mrb_json_state>(mrb, state_obj);
+  state->keys.keep = mrb_ary_new(mrb);
+  mrb_iv_set(mrb, state_obj, MRB_SYM(keys), state->keys.keep);
+  state->values.keep = mrb_ary_new(mrb);
+  mrb_iv_set(mrb, state_obj, MRB_SYM(values), state->values.keep);
+  state->utf8.keep = mrb_ary_new(mrb);
+  mrb_iv_set(mrb, state_obj, MRB_SYM(utf8_strings), state->utf8.keep);
+  state->dump_keys.keep = mrb_ary_new(mrb);
+  mrb_iv_set(mrb, state_obj, MRB_SYM(dump_keys), state->dump_keys.keep);
+#ifdef MRB_USE_BIGINT
+  state->uint64_max = mrb_bint_new_uint64(mrb, UINT64_MAX);
+  mrb_iv_set(mrb, state_obj, MRB_SYM(uint64_max), state->uint64_max);
+#endif
+  mrb_iv_set(mrb, mrb_obj_value(json_mod), MRB_SYM(json_state), state_obj);
+
+  state->json_mod = json_mod;
+
   struct RClass *json_error = mrb_define_class_under_id(
       mrb, json_mod, MRB_SYM(ParserError), mrb->eStandardError_class);
+  state->parser_error = json_error;
 
 #define DEFINE_JSON_ERROR(NAME)                                                \
   mrb_define_class_under_id(mrb, json_mod, MRB_SYM(NAME##Error), json_error)
+#define DEFINE_JSON_ERROR_FOR(NAME, CODE)                                      \
+  state->error_names[CODE] = MRB_SYM(NAME##Error);                             \
+  state->error_classes[CODE] = DEFINE_JSON_ERROR(NAME)
 
-  DEFINE_JSON_ERROR(Tape);
-  DEFINE_JSON_ERROR(String);
-  DEFINE_JSON_ERROR(UnclosedString);
+  DEFINE_JSON_ERROR_FOR(Tape, TAPE_ERROR);
+  DEFINE_JSON_ERROR_FOR(String, STRING_ERROR);
+  DEFINE_JSON_ERROR_FOR(UnclosedString, UNCLOSED_STRING);
   DEFINE_JSON_ERROR(MemoryAllocation);
-  DEFINE_JSON_ERROR(Depth);
-  DEFINE_JSON_ERROR(UTF8);
-  DEFINE_JSON_ERROR(Number);
-  DEFINE_JSON_ERROR(Capacity);
+  DEFINE_JSON_ERROR_FOR(Depth, DEPTH_ERROR);
+  DEFINE_JSON_ERROR_FOR(UTF8, UTF8_ERROR);
+  DEFINE_JSON_ERROR_FOR(Number, NUMBER_ERROR);
+  DEFINE_JSON_ERROR_FOR(Capacity, CAPACITY);
   DEFINE_JSON_ERROR(IncorrectType);
-  DEFINE_JSON_ERROR(EmptyInput);
+  DEFINE_JSON_ERROR_FOR(EmptyInput, EMPTY);
 
-  DEFINE_JSON_ERROR(TAtom);
-  DEFINE_JSON_ERROR(FAtom);
-  DEFINE_JSON_ERROR(NAtom);
+  DEFINE_JSON_ERROR_FOR(TAtom, T_ATOM_ERROR);
+  DEFINE_JSON_ERROR_FOR(FAtom, F_ATOM_ERROR);
+  DEFINE_JSON_ERROR_FOR(NAtom, N_ATOM_ERROR);
 
-  DEFINE_JSON_ERROR(BigInt);
-  DEFINE_JSON_ERROR(NumberOutOfRange);
+  DEFINE_JSON_ERROR_FOR(BigInt, BIGINT_ERROR);
+  DEFINE_JSON_ERROR_FOR(NumberOutOfRange, NUMBER_OUT_OF_RANGE);
 
-  DEFINE_JSON_ERROR(UnescapedChars);
+  DEFINE_JSON_ERROR_FOR(UnescapedChars, UNESCAPED_CHARS);
 
-  DEFINE_JSON_ERROR(Uninitialized);
-  DEFINE_JSON_ERROR(ParserInUse);
-  DEFINE_JSON_ERROR(ScalarDocumentAsValue);
+  DEFINE_JSON_ERROR_FOR(Uninitialized, UNINITIALIZED);
+  DEFINE_JSON_ERROR_FOR(ParserInUse, PARSER_IN_USE);
+  DEFINE_JSON_ERROR_FOR(ScalarDocumentAsValue, SCALAR_DOCUMENT_AS_VALUE);
 
-  DEFINE_JSON_ERROR(IncompleteArrayOrObject);
-  DEFINE_JSON_ERROR(TrailingContent);
+  DEFINE_JSON_ERROR_FOR(IncompleteArrayOrObject, INCOMPLETE_ARRAY_OR_OBJECT);
+  DEFINE_JSON_ERROR_FOR(TrailingContent, TRAILING_CONTENT);
 
-  DEFINE_JSON_ERROR(OutOfCapacity);
-  DEFINE_JSON_ERROR(InsufficientPadding);
+  DEFINE_JSON_ERROR_FOR(OutOfCapacity, OUT_OF_CAPACITY);
+  DEFINE_JSON_ERROR_FOR(InsufficientPadding, INSUFFICIENT_PADDING);
 
   DEFINE_JSON_ERROR(IndexOutOfBounds);
-  DEFINE_JSON_ERROR(OutOfBounds);
-  DEFINE_JSON_ERROR(OutOfOrderIteration);
-  DEFINE_JSON_ERROR(NoSuchField);
+  DEFINE_JSON_ERROR_FOR(OutOfBounds, OUT_OF_BOUNDS);
+  DEFINE_JSON_ERROR_FOR(OutOfOrderIteration, OUT_OF_ORDER_ITERATION);
+  DEFINE_JSON_ERROR_FOR(NoSuchField, NO_SUCH_FIELD);
 
-  DEFINE_JSON_ERROR(IO);
-  DEFINE_JSON_ERROR(InvalidJSONPointer);
-  DEFINE_JSON_ERROR(InvalidURIFragment);
+  DEFINE_JSON_ERROR_FOR(IO, IO_ERROR);
+  DEFINE_JSON_ERROR_FOR(InvalidJSONPointer, INVALID_JSON_POINTER);
+  DEFINE_JSON_ERROR_FOR(InvalidURIFragment, INVALID_URI_FRAGMENT);
 
-  DEFINE_JSON_ERROR(UnsupportedArchitecture);
-  DEFINE_JSON_ERROR(Unexpected);
+  DEFINE_JSON_ERROR_FOR(UnsupportedArchitecture, UNSUPPORTED_ARCHITECTURE);
+  DEFINE_JSON_ERROR_FOR(Unexpected, UNEXPECTED_ERROR);
 
   mrb_define_module_function_id(mrb, json_mod, MRB_SYM(parse), mrb_json_parse_m,
-                             MRB_ARGS_REQ(1) | MRB_ARGS_KEY(1, 0));
+                             MRB_ARGS_REQ(1) | MRB_ARGS_KEY(4, 0));
   mrb_define_module_function_id(mrb, json_mod, MRB_SYM(dump), mrb_json_dump_m,
-                             MRB_ARGS_REQ(1));
+                             MRB_ARGS_ARG(1, 1) | MRB_ARGS_KEY(2, 0));
+  mrb_define_module_function_id(mrb, json_mod, MRB_SYM(dump_to_fd), mrb_json_dump_to_fd_m,
+                             MRB_ARGS_REQ(2) | MRB_ARGS_KEY(1, 0));
   mrb_define_module_function_id(mrb, json_mod, MRB_SYM(parse_lazy), mrb_json_parse_lazy,
-                             MRB_ARGS_ARG(1, 1));
+                             MRB_ARGS_ARG(1, 1) | MRB_ARGS_KEY(1, 0));
     mrb_define_module_function_id(mrb, json_mod, MRB_SYM(load_lazy), mrb_json_load_lazy,
-                             MRB_ARGS_ARG(1, 1));
+                             MRB_ARGS_ARG(1, 1) | MRB_ARGS_KEY(1, 0));
   mrb_define_module_function_id(mrb, json_mod, MRB_SYM(load), mrb_json_load_m,
-                             MRB_ARGS_REQ(1) | MRB_ARGS_KEY(1, 0));
+                             MRB_ARGS_REQ(1) | MRB_ARGS_KEY(4, 0));
+  mrb_define_module_function_id(mrb, json_mod, MRB_SYM(try_parse), mrb_json_try_parse_m,
+                             MRB_ARGS_REQ(1) | MRB_ARGS_KEY(4, 0));
+  mrb_define_module_function_id(mrb, json_mod, MRB_SYM_Q(valid), mrb_json_valid_p,
+                                MRB_ARGS_REQ(1));
+  mrb_define_module_function_id(mrb, json_mod, MRB_SYM(minify), mrb_json_minify,
+                                MRB_ARGS_ARG(1, 1));
+  mrb_define_module_function_id(mrb, json_mod, MRB_SYM(validate_many), mrb_json_validate_many,
+                                MRB_ARGS_REQ(1));
+  mrb_define_module_function_id(mrb, json_mod, MRB_SYM(try_parse_lazy), mrb_json_try_parse_lazy,
+                             MRB_ARGS_ARG(1, 1) | MRB_ARGS_KEY(1, 0));
+  mrb_define_module_function_id(mrb, json_mod, MRB_SYM(each_document), mrb_json_each_document,
+                             MRB_ARGS_REQ(1) | MRB_ARGS_KEY(8, 0) | MRB_ARGS_BLOCK());
+  mrb_define_module_function_id(mrb, json_mod, MRB_SYM(parser_stats), mrb_json_parser_stats,
+                             MRB_ARGS_NONE());
+  mrb_define_module_function_id(mrb, json_mod, MRB_SYM(reset_parser), mrb_json_reset_parser,
+                             MRB_ARGS_NONE());
+  mrb_define_module_function_id(mrb, json_mod, MRB_SYM(zero_copy_parsing),
+                             mrb_json_get_zero_copy_parsing, MRB_ARGS_NONE());
+  mrb_define_module_function_id(mrb, json_mod, MRB_SYM_E(zero_copy_parsing),
+                             mrb_json_set_zero_copy_parsing, MRB_ARGS_REQ(1));
+  mrb_define_module_function_id(mrb, json_mod, MRB_SYM(mmap_threshold),
+                             mrb_json_get_mmap_threshold, MRB_ARGS_NONE());
+  mrb_define_module_function_id(mrb, json_mod, MRB_SYM_E(mmap_threshold),
+                             mrb_json_set_mmap_threshold, MRB_ARGS_REQ(1));
+  mrb_define_module_function_id(mrb, json_mod, MRB_SYM(cache_keys),
+                             mrb_json_get_cache_keys, MRB_ARGS_NONE());
+  mrb_define_module_function_id(mrb, json_mod, MRB_SYM_E(cache_keys),
+                             mrb_json_set_cache_keys, MRB_ARGS_REQ(1));
 
   mrb_define_method_id(mrb, mrb->object_class, MRB_SYM(to_json), mrb_json_dump,
                        MRB_ARGS_NONE());
@@ -1580,13 +5251,17 @@ void mrb_mruby_fast_json_gem_init(mrb_state *mrb) {
   struct RClass *parser_cls =
     mrb_define_class_under_id(mrb, json_mod, MRB_SYM(Parser), mrb->object_class);
   MRB_SET_INSTANCE_TT(parser_cls, MRB_TT_CDATA);
+  state->parser_class = parser_cls;
 
   mrb_define_method_id(mrb, parser_cls, MRB_SYM(initialize),
                        mrb_ondemand_parser_initialize, MRB_ARGS_OPT(1));
   mrb_define_method_id(mrb, parser_cls, MRB_SYM(allocate),
                        mrb_ondemand_parser_allocate, MRB_ARGS_OPT(1));
   mrb_define_method_id(mrb, parser_cls, MRB_SYM(iterate),
-                       mrb_ondemand_parser_iterate, MRB_ARGS_REQ(1));
+                       mrb_ondemand_parser_iterate, MRB_ARGS_REQ(1) | MRB_ARGS_KEY(1, 0));
+  mrb_define_method_id(mrb, parser_cls, MRB_SYM(iterate_many),
+                       mrb_ondemand_parser_iterate_many,
+                       MRB_ARGS_REQ(1) | MRB_ARGS_KEY(3, 0) | MRB_ARGS_BLOCK());
 
   //
   // JSON::PaddedString
@@ -1594,10 +5269,13 @@ void mrb_mruby_fast_json_gem_init(mrb_state *mrb) {
   struct RClass *ps_cls =
     mrb_define_class_under_id(mrb, json_mod, MRB_SYM(PaddedString), mrb->object_class);
   MRB_SET_INSTANCE_TT(ps_cls, MRB_TT_CDATA);
+  state->padded_string_class = ps_cls;
 
   mrb_define_method_id(mrb, ps_cls, MRB_SYM(initialize),
                        mrb_padded_string_initialize, MRB_ARGS_REQ(1));
   mrb_define_class_method_id(mrb, ps_cls, MRB_SYM(load), mrb_padded_string_s_load, MRB_ARGS_REQ(1));
+  mrb_define_class_method_id(mrb, ps_cls, MRB_SYM(mmap), mrb_padded_string_s_mmap, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, ps_cls, MRB_SYM(minify), mrb_padded_string_minify, MRB_ARGS_OPT(1));
 
   //
   // JSON::PaddedStringView
@@ -1605,6 +5283,7 @@ void mrb_mruby_fast_json_gem_init(mrb_state *mrb) {
   struct RClass *psv_cls =
     mrb_define_class_under_id(mrb, json_mod, MRB_SYM(PaddedStringView), mrb->object_class);
   MRB_SET_INSTANCE_TT(psv_cls, MRB_TT_CDATA);
+  state->padded_string_view_class = psv_cls;
 
   mrb_define_method_id(mrb, psv_cls, MRB_SYM(initialize),
                        mrb_padded_string_view_initialize, MRB_ARGS_ARG(0, 2));
@@ -1612,6 +5291,7 @@ void mrb_mruby_fast_json_gem_init(mrb_state *mrb) {
   struct RClass* doc_cls =
     mrb_define_class_under_id(mrb, json_mod, MRB_SYM(Document), mrb->object_class);
   MRB_SET_INSTANCE_TT(doc_cls, MRB_TT_CDATA);
+  state->document_class = doc_cls;
 
   mrb_define_method_id(mrb, doc_cls, MRB_SYM(initialize),
                       mrb_json_doc_initialize, MRB_ARGS_ARG(1, 1));
@@ -1643,6 +5323,114 @@ void mrb_mruby_fast_json_gem_init(mrb_state *mrb) {
                       mrb_json_doc_object_each, MRB_ARGS_BLOCK());
   mrb_define_method_id(mrb, doc_cls, MRB_SYM(into),
                       mrb_document_deserialize, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, doc_cls, MRB_SYM(dig),
+                      mrb_json_doc_dig, MRB_ARGS_ANY());
+  mrb_define_method_id(mrb, doc_cls, MRB_SYM(values_at),
+                      mrb_json_doc_values_at, MRB_ARGS_ANY());
+  mrb_define_method_id(mrb, doc_cls, MRB_SYM(extract),
+                      mrb_json_doc_extract, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, doc_cls, MRB_SYM(query_many),
+                      mrb_json_doc_query_many, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, doc_cls, MRB_SYM(root),
+                      mrb_json_doc_root, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, doc_cls, MRB_SYM(value),
+                      mrb_json_doc_value, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, doc_cls, MRB_SYM(value_at_pointer),
+                      mrb_json_doc_value_at_pointer, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, doc_cls, MRB_SYM(value_at_path),
+                      mrb_json_doc_value_at_path, MRB_ARGS_REQ(1));
+
+  //
+  // JSON::Pointer, JSON::Path
+  //
+  struct RClass *pointer_cls =
+    mrb_define_class_under_id(mrb, json_mod, MRB_SYM(Pointer), mrb->object_class);
+  MRB_SET_INSTANCE_TT(pointer_cls, MRB_TT_CDATA);
+  state->pointer_class = pointer_cls;
+  mrb_define_method_id(mrb, pointer_cls, MRB_SYM(initialize),
+                       mrb_json_pointer_initialize, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, pointer_cls, MRB_SYM(to_s),
+                       mrb_json_compiled_path_to_s, MRB_ARGS_NONE());
+
+  struct RClass *path_cls =
+    mrb_define_class_under_id(mrb, json_mod, MRB_SYM(Path), mrb->object_class);
+  MRB_SET_INSTANCE_TT(path_cls, MRB_TT_CDATA);
+  state->path_class = path_cls;
+  mrb_define_method_id(mrb, path_cls, MRB_SYM(initialize),
+                       mrb_json_path_initialize, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, path_cls, MRB_SYM(to_s),
+                       mrb_json_compiled_path_to_s, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, path_cls, MRB_SYM_Q(wildcard),
+                       mrb_json_compiled_path_wildcard_p, MRB_ARGS_NONE());
+
+  //
+  // JSON::Value
+  //
+  struct RClass *value_cls =
+    mrb_define_class_under_id(mrb, json_mod, MRB_SYM(Value), mrb->object_class);
+  MRB_SET_INSTANCE_TT(value_cls, MRB_TT_CDATA);
+  mrb_undef_class_method_id(mrb, value_cls, MRB_SYM(new));
+  state->value_class = value_cls;
+  mrb_define_method_id(mrb, value_cls, MRB_OPSYM(aref),
+                       mrb_json_value_aref, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, value_cls, MRB_SYM(each),
+                       mrb_json_value_each, MRB_ARGS_BLOCK());
+  mrb_define_method_id(mrb, value_cls, MRB_SYM(to_ruby),
+                       mrb_json_value_to_ruby, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, value_cls, MRB_SYM(raw_json),
+                       mrb_json_value_raw_json, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, value_cls, MRB_SYM(type),
+                       mrb_json_value_type, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, value_cls, MRB_SYM_Q(alive),
+                       mrb_json_value_alive_p, MRB_ARGS_NONE());
+
+  //
+  // JSON::StreamReader
+  //
+  struct RClass *stream_reader_cls =
+    mrb_define_class_under_id(mrb, json_mod, MRB_SYM(StreamReader), mrb->object_class);
+  MRB_SET_INSTANCE_TT(stream_reader_cls, MRB_TT_CDATA);
+  mrb_define_method_id(mrb, stream_reader_cls, MRB_SYM(initialize),
+                       mrb_stream_reader_initialize, MRB_ARGS_REQ(1) | MRB_ARGS_KEY(6, 0));
+  mrb_define_method_id(mrb, stream_reader_cls, MRB_SYM(each),
+                       mrb_stream_reader_each, MRB_ARGS_BLOCK());
+  mrb_define_method_id(mrb, stream_reader_cls, MRB_SYM(close),
+                       mrb_stream_reader_close, MRB_ARGS_NONE());
+
+  //
+  // JSON::IncrementalParser
+  //
+  struct RClass *incremental_cls =
+    mrb_define_class_under_id(mrb, json_mod, MRB_SYM(IncrementalParser), mrb->object_class);
+  MRB_SET_INSTANCE_TT(incremental_cls, MRB_TT_CDATA);
+  mrb_define_method_id(mrb, incremental_cls, MRB_SYM(initialize),
+                       mrb_incremental_parser_initialize, MRB_ARGS_KEY(1, 0));
+  mrb_define_method_id(mrb, incremental_cls, MRB_SYM(feed),
+                       mrb_incremental_parser_feed, MRB_ARGS_REQ(1) | MRB_ARGS_BLOCK());
+  mrb_define_method_id(mrb, incremental_cls, MRB_SYM(buffered_bytes),
+                       mrb_incremental_parser_buffered, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, incremental_cls, MRB_SYM(reset),
+                       mrb_incremental_parser_reset, MRB_ARGS_NONE());
+
+  //
+  // JSON::NumericArray
+  //
+  struct RClass *numeric_array_cls =
+    mrb_define_class_under_id(mrb, json_mod, MRB_SYM(NumericArray), mrb->object_class);
+  mrb_undef_class_method_id(mrb, numeric_array_cls, MRB_SYM(new));
+  state->numeric_array_class = numeric_array_cls;
+  mrb_define_method_id(mrb, numeric_array_cls, MRB_SYM(size),
+                       mrb_numeric_array_size, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, numeric_array_cls, MRB_SYM(length),
+                       mrb_numeric_array_size, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, numeric_array_cls, MRB_OPSYM(aref),
+                       mrb_numeric_array_aref, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, numeric_array_cls, MRB_SYM(to_a),
+                       mrb_numeric_array_to_a, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, numeric_array_cls, MRB_SYM(type),
+                       mrb_numeric_array_type, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, numeric_array_cls, MRB_SYM(data),
+                       mrb_numeric_array_data, MRB_ARGS_NONE());
 
   struct RClass *json_type_mod = mrb_define_module_under_id(mrb, json_mod, MRB_SYM(Type));
   mrb_define_const_id(mrb, json_type_mod, MRB_SYM(Array), mrb_convert_number(mrb, ondemand::json_type::array));
@@ -1654,5 +5442,7 @@ void mrb_mruby_fast_json_gem_init(mrb_state *mrb) {
 
 }
 
-void mrb_mruby_fast_json_gem_final(mrb_state *mrb) {}
+void mrb_mruby_fast_json_gem_final(mrb_state *mrb) {
+  json_state_epoch.fetch_add(1, std::memory_order_acq_rel);
+}
 MRB_END_DECL
@@ -63,6 +63,228 @@ assert("JSON.parse - empty array and object") do
   assert_equal({}, JSON.parse("{}"))
 end
 
+assert("JSON.parse - per-state parser is reused") do
+  JSON.reset_parser
+  JSON.parse(('{"a":[1,2,3],"b":"' + ("x" * 1000) + '"}').freeze)
+  stats = JSON.parser_stats
+  assert_true stats[:capacity] >= 1000
+  assert_true stats[:buffer_capacity] >= 1000
+
+  assert_equal({"c"=>1}, JSON.parse('{"c":1}'.freeze))
+  assert_equal stats, JSON.parser_stats
+end
+
+assert("JSON.reset_parser - releases scratch buffers") do
+  JSON.parse('[1,2,3]'.freeze)
+  JSON.reset_parser
+  stats = JSON.parser_stats
+  assert_equal 0, stats[:capacity]
+  assert_equal 0, stats[:buffer_capacity]
+  assert_equal [1,2,3], JSON.parse('[1,2,3]')
+
+  JSON.each_document(%Q({"a":1}\n{"a":2}\n)) { |d| d }
+  JSON.dump({ sym: :val, "k" => [1] })
+  JSON.parse_lazy('{"a":{"b":1}}').at_pointer("/a/b")
+  JSON.parse_lazy('{"a":{"b":1}}').at_path("$.a.b")
+  stats = JSON.parser_stats
+  assert_true stats[:stream_parser_capacity] > 0
+  assert_true stats[:dump_builder_capacity] > 0
+  assert_true stats[:frames_capacity] > 0
+  assert_true stats[:cached_dump_keys] > 0
+  assert_equal 2, stats[:cached_paths]
+  JSON.reset_parser
+  stats = JSON.parser_stats
+  [:capacity, :buffer_capacity, :stream_parser_capacity, :dump_builder_capacity,
+   :frames_capacity, :cached_keys, :cached_values, :cached_utf8,
+   :cached_dump_keys, :cached_paths].each { |k| assert_equal 0, stats[k], k.to_s }
+  assert_equal %Q({"sym":"val"}), JSON.dump({ sym: :val })
+  assert_equal 1, JSON.parse_lazy('{"a":{"b":1}}').at_pointer("/a/b")
+end
+
+assert("JSON.parse - repeated keys share one frozen string") do
+  arr = JSON.parse('[{"id":1,"name":"a"},{"id":2,"name":"b"}]')
+  k1 = arr[0].keys.first
+  k2 = arr[1].keys.first
+  assert_true k1.frozen?
+  assert_same k1, k2
+end
+
+assert("JSON.cache_keys - keeps key strings across calls") do
+  JSON.cache_keys = true
+  begin
+    k1 = JSON.parse('{"cached":1}').keys.first
+    k2 = JSON.parse('{"cached":2}').keys.first
+    assert_same k1, k2
+  ensure
+    JSON.cache_keys = false
+    JSON.reset_parser
+  end
+end
+
+assert("JSON.zero_copy_parsing - setting") do
+  assert_false JSON.zero_copy_parsing
+  JSON.zero_copy_parsing = true
+  begin
+    assert_true JSON.zero_copy_parsing
+    assert_equal({ "a" => 1 }, JSON.parse('{"a":1}'))
+  ensure
+    JSON.zero_copy_parsing = nil
+  end
+  assert_false JSON.zero_copy_parsing
+end
+
+assert("JSON.parse - shared_strings") do
+  long = "y" * 100
+  json = '{"a":"' + long + '","b":["short","' + long + 'z","esc\\n\\u00e9"]}'
+  obj = JSON.parse(json, shared_strings: true)
+  assert_equal long, obj["a"]
+  assert_equal ["short", long + "z", "esc\n\u00e9"], obj["b"]
+  assert_false obj["a"].frozen?
+
+  obj["a"] << "!"
+  assert_equal long + "!", obj["a"]
+  assert_equal long + "z", obj["b"][1]
+end
+
+assert("JSON.parse - shared_strings without strings") do
+  assert_equal [1, 2.5, true, nil], JSON.parse('[1,2.5,true,null]', shared_strings: true)
+end
+
+assert("JSON.parse - freeze: true returns a deep-frozen tree") do
+  obj = JSON.parse('{"a":[{"status":"active"},{"status":"active"}],"b":"x"}', freeze: true)
+  assert_true obj.frozen?
+  assert_true obj["a"].frozen?
+  assert_true obj["a"][0].frozen?
+  assert_true obj["b"].frozen?
+  assert_same obj["a"][0]["status"], obj["a"][1]["status"]
+  assert_raise(FrozenError) { obj["c"] = 1 }
+end
+
+assert("JSON.parse - freeze: true with shared_strings") do
+  long = "z" * 100
+  obj = JSON.parse('["' + long + '","' + long + '"]', freeze: true, shared_strings: true)
+  assert_equal [long, long], obj
+  assert_true obj[0].frozen?
+end
+
+assert("JSON.parse - deeply nested containers") do
+  depth = 500
+  obj = JSON.parse(('[{"a":' * depth) + '1' + ('}]' * depth))
+  depth.times { obj = obj[0]["a"] }
+  assert_equal 1, obj
+end
+
+assert("JSON.parse - mixed nesting with symbolize_names") do
+  json = '{"a":[1,{"b":[true,false,null],"c":{}},[]],"d":{"e":"f"},"g":-1.5,"h":18446744073709551615}'
+  expected = { a: [1, { b: [true, false, nil], c: {} }, []], d: { e: "f" }, g: -1.5, h: 18446744073709551615 }
+  assert_equal expected, JSON.parse(json, symbolize_names: true)
+end
+
+assert("JSON.parse - packed_numbers: true") do
+  obj = JSON.parse('{"i":[1,2,-3],"f":[1.5,2],"m":[1,"a"],"n":[[1,2],[3,4]],"e":[]}', packed_numbers: true)
+
+  i = obj["i"]
+  assert_kind_of JSON::NumericArray, i
+  assert_equal :int64, i.type
+  assert_equal 3, i.size
+  assert_equal 2, i[1]
+  assert_equal(-3, i[-1])
+  assert_nil i[3]
+  assert_equal [1, 2, -3], i.to_a
+  assert_equal 0, i.inject(0) { |a, b| a + b }
+  assert_equal 24, i.data.bytesize
+  assert_true i.data.frozen?
+
+  f = obj["f"]
+  assert_equal :float64, f.type
+  assert_equal [1.5, 2.0], f.to_a
+
+  assert_equal [1, "a"], obj["m"]
+  assert_kind_of Array, obj["n"]
+  assert_equal [3, 4], obj["n"][1].to_a
+  assert_equal [], obj["e"]
+end
+
+assert("JSON.parse - packed_numbers keeps integers exact") do
+  big = '[9007199254740993,1.5]'
+  assert_kind_of Array, JSON.parse(big, packed_numbers: true)
+  assert_equal :int64, JSON.parse('[9007199254740993]', packed_numbers: true).type
+end
+
+assert("JSON.dump - the reused builder survives a GC run during encoding") do
+  gc_to_s = Class.new do
+    def to_s
+      GC.start
+      "x"
+    end
+  end
+  JSON.dump([1]) # leaves a builder in the state for the next dump
+  with_gc = {}
+  plain = {}
+  300.times do |i|
+    with_gc["k#{i}"] = [i, gc_to_s.new, "v" * 64]
+    plain["k#{i}"] = [i, "x", "v" * 64]
+  end
+  expected = JSON.dump(plain)
+  assert_equal expected, JSON.dump(with_gc)
+  assert_equal expected, with_gc.to_json
+end
+
+assert("JSON.dump - NumericArray") do
+  obj = JSON.parse('{"a":[1,2,3],"b":[0.5,1.5]}', packed_numbers: true)
+  assert_equal '{"a":[1,2,3],"b":[0.5,1.5]}', JSON.dump(obj)
+end
+
+assert("JSON.try_parse - returns the value") do
+  assert_equal({ "a" => [1, 2] }, JSON.try_parse('{"a":[1,2]}'))
+  assert_equal({ a: 1 }, JSON.try_parse('{"a":1}', symbolize_names: true))
+  assert_nil JSON.try_parse('null')
+end
+
+assert("JSON.try_parse - returns the error name instead of raising") do
+  assert_equal :TapeError, JSON.try_parse('[1,2,]')
+  assert_equal :EmptyInputError, JSON.try_parse('')
+  assert_equal :UnclosedStringError, JSON.try_parse('"abc')
+  assert_kind_of Class, JSON.const_get(JSON.try_parse('{'))
+  assert_equal [1], JSON.try_parse('[1]')
+end
+
+assert("JSON.try_parse_lazy") do
+  doc = JSON.try_parse_lazy('{"a":1}')
+  assert_kind_of JSON::Document, doc
+  assert_equal 1, doc["a"]
+  assert_equal :UnclosedStringError, JSON.try_parse_lazy('{"a":"b}')
+end
+
+assert("JSON.valid? and JSON.validate_many") do
+  assert_true JSON.valid?('{"a":[1,2,{"b":null}]}')
+  assert_false JSON.valid?('{"a":1,}')
+  assert_false JSON.valid?("\"\xff\"")
+  assert_false JSON.valid?('')
+  frozen = '[1]'.freeze
+  assert_true JSON.valid?(frozen)
+
+  results = JSON.validate_many(['[1]', '[1,2,]', '"x"', "\"\xc3\""])
+  assert_equal [true, :TapeError, true, :UTF8Error], results
+  assert_equal [], JSON.validate_many([])
+  assert_raise(TypeError) { JSON.validate_many([1]) }
+end
+
+assert("JSON.minify") do
+  pretty = "{\n  \"a\" : [ 1, 2 ],\n  \"s\" : \" keep  this \\\" \"\n}\n"
+  assert_equal '{"a":[1,2],"s":" keep  this \\" "}', JSON.minify(pretty)
+  assert_equal "", JSON.minify("  ")
+
+  buf = "previous contents that are longer than the output"
+  assert_same buf, JSON.minify("[ true ,null ]", buf)
+  assert_equal "[true,null]", buf
+  assert_raise(FrozenError) { JSON.minify("[1]", "x".freeze) }
+  assert_raise(JSON::ParserError) { JSON.minify('{"a":"open') }
+
+  ps = JSON::PaddedString.new("{ \"x\" : 1 }")
+  assert_equal '{"x":1}', ps.minify
+end
+
 assert("JSON.parse - error: trailing comma") do
   assert_raise JSON::ParserError do
     JSON.parse('{"a":1,}')
@@ -87,6 +309,58 @@ assert("JSON.dump - array serialization") do
   assert_equal '[true,null,"text"]', json
 end
 
+assert("JSON.dump - into: reuses the given string") do
+  buf = "x" * 100
+  assert_same buf, JSON.dump({ "a" => [1, 2] }, into: buf)
+  assert_equal '{"a":[1,2]}', buf
+  JSON.dump("s" * 200, into: buf)
+  assert_equal 202, buf.bytesize
+  assert_raise(FrozenError) { JSON.dump(1, into: "".freeze) }
+end
+
+assert("JSON.dump - nested dump from #to_s and reuse after errors") do
+  class DumpsWhileDumped
+    def to_s
+      JSON.dump(["inner"])
+    end
+  end
+  assert_equal '{"k":"[\\"inner\\"]"}', JSON.dump({ "k" => DumpsWhileDumped.new })
+  assert_raise(JSON::UTF8Error) { JSON.dump(["\xff"]) }
+  assert_equal '[1,"a"]', JSON.dump([1, "a"])
+  assert_equal '"b"', "b".to_json
+  big = "y" * (2 << 20)
+  assert_equal big.bytesize + 2, JSON.dump(big).bytesize
+  assert_equal "[]", JSON.dump([])
+end
+
+assert("JSON.dump - streams to an IO or file descriptor in chunks") do
+  data = { "rows" => (1..2000).map { |i| { "id" => i, "name" => "row#{i}" } } }
+  expected = JSON.dump(data)
+  n = File.open("tmp_dump.json", "w") { |f| JSON.dump(data, f, chunk_size: 512) }
+  assert_equal expected.bytesize, n
+  assert_equal expected, File.open("tmp_dump.json", "r") { |f| f.read }
+  n = File.open("tmp_dump.json", "w") { |f| JSON.dump_to_fd([1, "a"], f.fileno) }
+  assert_equal 7, n
+  assert_equal '[1,"a"]', File.open("tmp_dump.json", "r") { |f| f.read }
+  assert_raise(ArgumentError) { JSON.dump(1, [], into: "") }
+  assert_raise(ArgumentError) { JSON.dump_to_fd(1, 1, chunk_size: 0) }
+end
+
+assert("JSON.dump - streams to any object with #write") do
+  class ChunkCollector
+    attr_reader :chunks
+    def initialize; @chunks = []; end
+    def write(s); @chunks << s; s.bytesize; end
+  end
+  sink = ChunkCollector.new
+  data = (1..1000).map { |i| "value #{i}" }
+  n = JSON.dump(data, sink, chunk_size: 256)
+  assert_equal JSON.dump(data), sink.chunks.join
+  assert_equal n, sink.chunks.join.bytesize
+  assert_true sink.chunks.size > 1
+  assert_true sink.chunks.all? { |c| c.bytesize < 256 + 16 }
+end
+
 assert("JSON.dump - deeply nested structure") do
   obj = {"a" => {"b" => {"c" => {"d" => 42}}}}
   json = JSON.dump(obj)
@@ -162,6 +436,30 @@ assert("String#valid_utf8? detects bad sequences") do
   end
 end
 
+assert("JSON.dump - symbol, string and non-string keys") do
+  obj = { id: 1, "na\"me": :sym, "str" => :"q\"uote", 7 => 1, nil => 2, true => 3, false => 4, 1.5 => 5 }
+  expected = '{"id":1,"na\\"me":"sym","str":"q\\"uote","7":1,"":2,"true":3,"false":4,"1.5":5}'
+  assert_equal expected, JSON.dump(obj)
+  assert_equal expected, JSON.dump(obj) # served from the key cache
+  assert_equal '[{"id":2},{"id":3}]', JSON.dump([{ id: 2 }, { "id" => 3 }])
+  assert_equal '"sym"', :sym.to_json
+  assert_raise(JSON::UTF8Error) { JSON.dump({ "\xff".to_sym => 1 }) }
+end
+
+assert("JSON.dump - UTF-8 is checked per string") do
+  ascii = "plain"
+  assert_equal '"plain"', JSON.dump(ascii)
+  ascii << "\xff" # modifying the string drops what the first dump learned
+  assert_raise(JSON::UTF8Error) { JSON.dump(ascii) }
+  assert_raise(JSON::UTF8Error) { JSON.dump({ "ok\xff" => 1 }) }
+  assert_raise(JSON::UTF8Error) { JSON.dump("\xe2\x82") }
+
+  frozen = ("é" * 40).freeze
+  assert_equal "\"#{frozen}\"", JSON.dump([frozen])[1..-2]
+  assert_equal "\"#{frozen}\"", JSON.dump(frozen)
+  assert_equal '"ab€"', JSON.dump("ab€")
+end
+
 # test/json_escape_paths.rb
 
 # 1. printable ASCII → pass-through
@@ -217,6 +515,22 @@ assert("JSON.parse - uint64_t larger than INT64_MAX becomes BigInt") do
   assert_equal 9223372036854775808, val
 end
 
+assert("JSON.dump - big integers are written as numbers") do
+  ids = [9223372036854775808, 18446744073709551615, 18446744073709551616,
+         -9223372036854775809, 123456789012345678901234567890]
+  json = JSON.dump(ids)
+  assert_equal "[9223372036854775808,18446744073709551615,18446744073709551616," \
+               "-9223372036854775809,123456789012345678901234567890]", json
+  # simdjson reads integers up to UINT64_MAX; wider ones are BigIntError
+  in_range = [9223372036854775808, 18446744073709551615, -9223372036854775808]
+  assert_equal in_range, JSON.parse(JSON.dump(in_range))
+  assert_raise(JSON::BigIntError) { JSON.parse(json) }
+  assert_equal "18446744073709551615", 18446744073709551615.to_json
+
+  doc = JSON.parse_lazy('{"id":18446744073709551615}')
+  assert_equal '{"id":18446744073709551615}', JSON.dump({ "id" => doc["id"] })
+end
+
 assert("JSON.parse - TAtomError") do
   assert_raise JSON::TAtomError do
     JSON.parse('tru')
@@ -337,6 +651,183 @@ assert("JSON.parse_lazy - at_path_with_wildcard") do
   doc = JSON.parse_lazy('{"items":[{"id":1},{"id":2},{"id":3}]}')
   ids = doc.at_path_with_wildcard("$.items[*].id")
   assert_equal [1,2,3], ids
+  seen = []
+  doc.at_path_with_wildcard("$.items[*].id") { |id| seen << id; break if id == 2 }
+  assert_equal [1,2], seen
+  assert_raise(JSON::OutOfOrderIterationError) do
+    doc.at_path_with_wildcard("$.items[*].id") { |id| doc["items"] }
+  end
+  assert_equal [1,2,3], doc.at_path_with_wildcard("$.items[*].id")
+end
+
+assert("JSON::Document#value - chained lookups without conversion") do
+  doc = JSON.parse_lazy('{"meta":{"id":1},"user":{"name":"Alice","tags":["a",{"b":2}],"age":30}}')
+  user = doc.value("user")
+  assert_kind_of JSON::Value, user
+  assert_equal :object, user.type
+  assert_equal "Alice", user[:name]
+  assert_equal 30, user["age"]
+  tags = user["tags"]
+  assert_equal :array, tags.type
+  out = []
+  tags.each { |t| out << (t.is_a?(JSON::Value) ? t.to_ruby : t) }
+  assert_equal ["a", { "b" => 2 }], out
+  assert_nil user["missing"]
+  assert_equal '{"id":1}', doc.value_at_pointer("/meta").raw_json
+  assert_equal 42, JSON.parse_lazy("42").root
+  assert_equal [1, 2], JSON.parse_lazy("[1,2]").root.to_ruby
+end
+
+assert("JSON::Document#dig - mixed key types in one call") do
+  doc = JSON.parse_lazy('{"user":{"name":"Alice","tags":["a",{"b":[7,8]}]},"n":1}')
+  assert_equal "Alice", doc.dig(:user, "name")
+  assert_equal 8, doc.dig("user", :tags, 1, "b", 1)
+  assert_equal({ "b" => [7, 8] }, doc.dig(:user, :tags, 1))
+  assert_nil doc.dig(:user, :missing, 0)
+  assert_nil doc.dig(:n, :x)
+  assert_nil doc.dig(:user, :tags, -1)
+  assert_equal 1, doc[:n]
+  assert_raise(ArgumentError) { doc.dig }
+  assert_raise(TypeError) { doc.dig(:user, 1.5) }
+end
+
+assert("JSON::Document#values_at and #extract - one pass over the object") do
+  json = '{"id":7,"name":"Bob","tags":["x"],"id":8,"meta":{"a":1},"ok":null}'
+  doc = JSON.parse_lazy(json)
+  assert_equal [7, "Bob", nil, ["x"]], doc.values_at(:id, "name", :missing, :tags)
+  assert_equal ["Bob", "Bob"], doc.values_at(:name, "name")
+  assert_equal [nil], JSON.parse_lazy("[1]").values_at(:a)
+  keys = (1..40).map { |i| "k#{i}" }
+  wide = JSON.parse_lazy(JSON.dump(Hash[keys.map { |k| [k, k.size] }]))
+  assert_equal keys.map(&:size), wide.values_at(*keys)
+
+  h = doc.extract("id" => JSON::Type::Number, :meta => JSON::Type::Object, :ok => nil, :nope => nil)
+  assert_equal({ "id" => 7, :meta => { "a" => 1 }, :ok => nil, :nope => nil }, h)
+  assert_raise(TypeError) { doc.extract(name: JSON::Type::Number) }
+  assert_raise(TypeError) { doc.extract(name: String) }
+end
+
+assert("JSON::Document#values_at and #extract - start at the root after other lookups") do
+  doc = JSON.parse_lazy('{"id":1,"name":"Bob","meta":{"a":{"b":2}},"tail":true}')
+  assert_equal "Bob", doc["name"]
+  assert_equal [1, "Bob", true], doc.values_at(:id, :name, :tail)
+  assert_equal 2, doc.dig("meta", "a", "b")
+  assert_equal [1, true], doc.values_at("id", "tail")
+  assert_equal true, doc["tail"]
+  assert_equal({ "id" => 1, "name" => "Bob" }, doc.extract("id" => nil, "name" => nil))
+  assert_equal 2, doc.dig(:meta, :a, :b)
+  assert_equal({ :id => 1 }, doc.extract(id: JSON::Type::Number))
+end
+
+assert("JSON::Value - stale handles raise instead of reading the wrong place") do
+  doc = JSON.parse_lazy('{"a":{"x":1},"b":[1,2,3]}')
+  a = doc.value("a")
+  assert_equal 3, doc["b"].size
+  assert_false a.alive?
+  assert_raise(JSON::OutOfOrderIterationError) { a["x"] }
+  b = doc.value("b")
+  assert_equal 2, b[1]
+  assert_raise(JSON::OutOfOrderIterationError) { b[2] }
+  assert_raise(JSON::OutOfOrderIterationError) { b.to_ruby }
+  doc.rewind
+  assert_raise(JSON::OutOfOrderIterationError) { b.each {} }
+end
+
+assert("JSON::Value - handles go stale when their parser starts another document") do
+  parser = JSON::Parser.new
+  first = parser.iterate('{"a":{"x":1}}')
+  a = first.value("a")
+  second = parser.iterate('{"a":{"x":2}}')
+  assert_false a.alive?
+  assert_raise(JSON::OutOfOrderIterationError) { a["x"] }
+  assert_equal 2, second["a"]["x"]
+  assert_equal 1, first["a"]["x"] # iterated again from the start
+  assert_equal 2, second["a"]["x"]
+
+  kept = nil
+  value = nil
+  parser.iterate_many(%Q({"v":{"n":1}}\n{"v":{"n":2}}\n)) do |doc|
+    kept = doc
+    value = doc.value("v")
+  end
+  assert_false value.alive?
+  assert_raise(JSON::OutOfOrderIterationError) { kept["v"] }
+  assert_raise(JSON::OutOfOrderIterationError) do
+    parser.iterate_many(%Q({"v":{"n":1}}\n)) { |doc| break doc.value("v") }["n"]
+  end
+end
+
+assert("JSON::Pointer and JSON::Path - compiled once, applied to many documents") do
+  ptr = JSON::Pointer.compile("/a~1b/m~0n/1")
+  path = JSON::Path.compile("$['a/b'].list[1].id")
+  ids = JSON::Path.compile("$.items[*].id")
+  assert_equal "/a~1b/m~0n/1", ptr.to_s
+  assert_true ids.wildcard?
+  assert_false path.wildcard?
+  3.times do |i|
+    doc = JSON.parse_lazy(%Q({"a/b":{"m~n":[0,#{i}],"list":[{},{"id":#{i}}]},"items":[{"id":1},{"x":0},{"id":#{i}}]}))
+    assert_equal i, doc.at_pointer(ptr)
+    assert_equal i, doc.at_path(path)
+    assert_equal i, doc.at_pointer("/a~1b/list/1/id")
+    assert_equal [1, i], doc.at_path_with_wildcard(ids)
+    assert_equal({ "id" => i }, doc.value_at_path("$['a/b'].list[1]").to_ruby)
+  end
+  doc = JSON.parse_lazy('{"0":"key","arr":["idx"]}')
+  assert_equal "key", doc.at_pointer("/0")
+  assert_equal "idx", doc.at_pointer("/arr/0")
+  assert_raise(JSON::InvalidJSONPointerError) { doc.at_pointer("/arr/01") }
+  assert_raise(JSON::InvalidJSONPointerError) { doc.at_pointer("/arr/") }
+  assert_nil doc.at_pointer("/arr/-")
+  assert_nil doc.at_pointer("/arr/x")
+  assert_nil doc.at_pointer("/arr/1")
+  assert_raise(JSON::InvalidJSONPointerError) { doc.at_path("$.arr[01]") }
+  esc = JSON.parse_lazy('{"a/b":{"~1":1,"01":2},"~":[3]}')
+  assert_equal 1, esc.at_pointer("/a~1b/~01")
+  assert_equal 2, esc.at_pointer("/a~1b/01")
+  assert_equal 3, esc.at_pointer("/~0/0")
+  assert_nil esc.at_pointer("/a~1b/~1")
+  assert_equal({ "0" => "key", "arr" => ["idx"] }, doc.at_pointer(""))
+  assert_raise(JSON::InvalidJSONPointerError) { JSON::Pointer.compile("a") }
+  assert_raise(TypeError) { ptr.__send__(:initialize, "/x") }
+  assert_raise(TypeError) { path.__send__(:initialize, "$.x") }
+  assert_equal "/a~1b/m~0n/1", ptr.to_s
+  assert_raise(JSON::InvalidJSONPointerError) { doc.at_pointer("/~2") }
+  assert_raise(JSON::InvalidJSONPointerError) { JSON::Path.compile("$.a[") }
+  assert_raise(ArgumentError) { doc.at_path(ids) }
+  assert_raise(TypeError) { doc.at_pointer(:a) }
+  300.times { |i| doc.at_pointer("/k#{i}") }
+  assert_equal "idx", doc.at_pointer("/arr/0")
+end
+
+assert("JSON::Document#query_many - several paths in one pass") do
+  json = '{"meta":{"id":"m1","ts":5,"x":[1]},"payload":{"items":[{"sku":"a","n":1},{"n":2},{"sku":"c"}],"total":9}}'
+  doc = JSON.parse_lazy(json)
+  total = JSON::Pointer.compile("/payload/total")
+  r = doc.query_many(["/meta/id", "/meta/ts", "$.payload.items[*].sku", total, "/nope", "$.payload.items[0]"])
+  assert_equal "m1", r["/meta/id"]
+  assert_equal 5, r["/meta/ts"]
+  assert_equal ["a", "c"], r["$.payload.items[*].sku"]
+  assert_equal 9, r[total]
+  assert_nil r["/nope"]
+  assert_equal({ "sku" => "a", "n" => 1 }, r["$.payload.items[0]"])
+
+  # a path ending where others continue, and an index next to a wildcard
+  r = doc.query_many(["/meta", "/meta/x/0", "/payload/items/0/n", "$.payload.items[*].n", "$.meta.*"])
+  assert_equal({ "id" => "m1", "ts" => 5, "x" => [1] }, r["/meta"])
+  assert_equal 1, r["/meta/x/0"]
+  assert_equal 1, r["/payload/items/0/n"]
+  assert_equal [1, 2], r["$.payload.items[*].n"]
+  assert_equal ["m1", 5, [1]], r["$.meta.*"]
+  assert_equal({}, doc.query_many([]))
+  assert_raise(JSON::InvalidJSONPointerError) { doc.query_many(["x"]) }
+  assert_raise(JSON::InvalidJSONPointerError) { doc.query_many([".meta"]) }
+
+  # "*" in a JSON Pointer is a key
+  doc = JSON.parse_lazy('{"*":{"a":1},"b":{"a":2},"arr":[{"a":3}]}')
+  r = doc.query_many(["/*/a", "/arr/*/a", "$.*.a"])
+  assert_equal 1, r["/*/a"]
+  assert_nil r["/arr/*/a"]
+  assert_equal [1, 2], r["$.*.a"]
 end
 
 # ---------------------------------------------------------
@@ -357,6 +848,122 @@ assert("JSON.parse_lazy - object_each") do
   assert_equal({"a"=>1,"b"=>2}, h)
 end
 
+assert("JSON.parse_lazy - array_each shares keys between records") do
+  doc = JSON.parse_lazy('[{"id":1},{"id":2}]')
+  keys = doc.array_each.map { |h| h.keys.first }
+  assert_same keys[0], keys[1]
+end
+
+assert("JSON.parse_lazy - freeze: true") do
+  doc = JSON.parse_lazy('[{"s":"on"},{"s":"on"}]', freeze: true)
+  rows = doc.array_each
+  assert_true rows.frozen?
+  assert_true rows[0].frozen?
+  assert_same rows[0]["s"], rows[1]["s"]
+end
+
+# ---------------------------------------------------------
+# Document streams
+# ---------------------------------------------------------
+
+assert("JSON.each_document - newline-delimited") do
+  out = []
+  n = JSON.each_document(%Q({"a":1}\n{"a":2}\n[3]\n"x"\n)) { |v| out << v }
+  assert_equal 4, n
+  assert_equal [{ "a" => 1 }, { "a" => 2 }, [3], "x"], out
+end
+
+assert("JSON.each_document - concatenated, small batches and options") do
+  out = []
+  JSON.each_document('{"a":1} {"a":2}{"a":3}', batch_size: 64, symbolize_names: true) { |v| out << v }
+  assert_equal [{ a: 1 }, { a: 2 }, { a: 3 }], out
+end
+
+assert("JSON.each_document - nested calls and JSON.parse inside the block") do
+  out = []
+  JSON.each_document("[1]\n[2]\n") do |v|
+    JSON.each_document("{\"n\":#{v[0]}}") { |inner| out << inner["n"] }
+    out << JSON.parse('{"x":0}')["x"]
+  end
+  assert_equal [1, 0, 2, 0], out
+end
+
+assert("JSON.each_document - malformed records") do
+  input = %Q({"a":1}\n{"a":,}\n{"a":3}\n{"a"\n{"a":5}\n)
+  assert_raise(JSON::ParserError) { JSON.each_document(input) { |v| } }
+
+  out = []
+  n = JSON.each_document(input, skip_invalid: true) { |v| out << v["a"] }
+  assert_equal [1, 3, 5], out
+  assert_equal 3, n
+end
+
+assert("JSON.each_document - PaddedString input") do
+  out = []
+  JSON.each_document(JSON::PaddedString.new("1\n2\n3")) { |v| out << v }
+  assert_equal [1, 2, 3], out
+end
+
+assert("JSON.each_document - threads:") do
+  lines = (1..500).map { |i| %Q({"i":#{i},"s":"#{"x" * (i % 7)}"}) }.join("\n")
+  out = []
+  n = JSON.each_document(lines, threads: 3, batch_size: 256, queue_size: 2) { |v| out << v["i"] }
+  assert_equal 500, n
+  assert_equal (1..500).to_a, out
+
+  bad = lines + %Q(\n{"i":\n{"i":501}\n)
+  assert_raise(JSON::ParserError) { JSON.each_document(bad, threads: 2, batch_size: 256) { |v| } }
+  out = []
+  JSON.each_document(bad, threads: 2, batch_size: 256, skip_invalid: true) { |v| out << v["i"] }
+  assert_equal (1..501).to_a, out
+
+  assert_raise(ArgumentError) { JSON.each_document(lines, threads: 0) { |v| } }
+  assert_raise(ArgumentError) { JSON.each_document(lines, threads: 65) { |v| } }
+  assert_raise(ArgumentError) { JSON.each_document(lines, threads: 2, queue_size: 257) { |v| } }
+end
+
+assert("JSON.each_document - threads: stops workers when the block raises") do
+  lines = (1..200).map { |i| "[#{i}]" }.join("\n")
+  assert_raise(RuntimeError) do
+    JSON.each_document(lines, threads: 2, batch_size: 64) { |v| raise "stop" if v[0] == 10 }
+  end
+end
+
+assert("JSON::Parser#iterate_many - yields a reusable document handle") do
+  parser = JSON::Parser.new
+  handles = []
+  ids = []
+  n = parser.iterate_many(%Q({"id":1,"x":[1]}\n{"id":2}\n{"id":3}\n)) do |doc|
+    handles << doc
+    ids << doc["id"]
+  end
+  assert_equal 3, n
+  assert_equal [1, 2, 3], ids
+  assert_same handles[0], handles[2]
+end
+
+assert("JSON::Parser#iterate_many - break and raise hand the document back") do
+  parser = JSON::Parser.new
+  input = %Q({"id":1}\n{"id":2}\n{"id":3}\n)
+  first = parser.iterate_many(input) { |doc| break doc["id"] }
+  assert_equal 1, first
+  assert_raise(RuntimeError) do
+    parser.iterate_many(input) { |doc| raise "stop" if doc["id"] == 2 }
+  end
+  ids = []
+  assert_equal 3, parser.iterate_many(input) { |doc| ids << doc["id"] }
+  assert_equal [1, 2, 3], ids
+end
+
+assert("JSON::Parser#iterate_many - skip_invalid") do
+  parser = JSON::Parser.new
+  ids = []
+  parser.iterate_many(%Q({"id":1}\n{"id":"oops}\n{"id":3}\n), skip_invalid: true) do |doc|
+    ids << doc["id"]
+  end
+  assert_equal [1, 3], ids
+end
+
 # ---------------------------------------------------------
 # Rewind
 # ---------------------------------------------------------
@@ -384,6 +991,126 @@ assert("JSON.load_lazy - large file streaming") do
   assert_equal [1,2,3,4], doc["items"]
 end
 
+assert("JSON.mmap_threshold - maps files for load and load_lazy") do
+  assert_equal 4 * 1024 * 1024, JSON.mmap_threshold
+  page = '{"s":"' + "x" * (4096 - 8) + '"}' # ends exactly on a page boundary
+  File.open("tmp_mmap.json", "w") { |f| f.write(page) }
+  File.open("tmp_empty.json", "w") { |f| }
+
+  JSON.mmap_threshold = 0
+  begin
+    assert_equal 4088, JSON.load("tmp_mmap.json")["s"].bytesize
+    assert_equal 4088, JSON.load_lazy("tmp_mmap.json")["s"].bytesize
+    assert_raise(JSON::EmptyInputError) { JSON.load("tmp_empty.json") }
+  ensure
+    JSON.mmap_threshold = 4 * 1024 * 1024
+  end
+
+  JSON.mmap_threshold = nil
+  assert_nil JSON.mmap_threshold
+  assert_equal 4088, JSON.load("tmp_mmap.json")["s"].bytesize
+  JSON.mmap_threshold = 4 * 1024 * 1024
+end
+
+assert("JSON::PaddedString.mmap") do
+  File.open("tmp_mmap2.json", "w") { |f| f.write('{"a":[1,2]}') }
+  view = JSON::PaddedString.mmap("tmp_mmap2.json")
+  assert_kind_of JSON::PaddedStringView, view
+  assert_equal [1, 2], JSON::Document.new(view)["a"]
+end
+
+assert("JSON::StreamReader - top-level array across small windows") do
+  File.open("tmp_stream.json", "w") { |f| f.write(' [1, "a,]\\"b", {"x":[1,2]}, [[]], true] ') }
+  values = []
+  JSON::StreamReader.new("tmp_stream.json", window: 3).each { |v| values << v }
+  assert_equal [1, "a,]\"b", { "x" => [1, 2] }, [[]], true], values
+end
+
+assert("JSON::StreamReader - pointer and IO input") do
+  File.open("tmp_stream2.json", "w") do |f|
+    f.write('{"meta":{"items":[0]},"items":[{"id":1},{"id":2}],"rest":[]}')
+  end
+  ids = []
+  File.open("tmp_stream2.json", "r") do |io|
+    reader = JSON::StreamReader.new(io, window: 5, pointer: "/items", symbolize_names: true)
+    reader.each { |item| ids << item[:id] }
+  end
+  assert_equal [1, 2], ids
+  assert_equal [0], JSON::StreamReader.new("tmp_stream2.json", pointer: "/meta/items").to_a
+end
+
+assert("JSON::StreamReader - array index tokens in the pointer") do
+  File.open("tmp_stream4.json", "w") do |f|
+    f.write('[[0],[1,2],{"10":[3]},[[4]],[],[],[],[],[],[],[5]]')
+  end
+  assert_equal [1, 2], JSON::StreamReader.new("tmp_stream4.json", window: 4, pointer: "/1").to_a
+  assert_equal [3], JSON::StreamReader.new("tmp_stream4.json", pointer: "/2/10").to_a
+  assert_equal [4], JSON::StreamReader.new("tmp_stream4.json", pointer: "/3/0").to_a
+  assert_equal [5], JSON::StreamReader.new("tmp_stream4.json", pointer: "/10").to_a
+  assert_raise(JSON::NoSuchFieldError) { JSON::StreamReader.new("tmp_stream4.json", pointer: "/01").each {} }
+end
+
+assert("JSON::IncrementalParser - documents split across pipe reads") do
+  r, w = IO.pipe
+  parser = JSON::IncrementalParser.new
+  values = []
+  ['{"id":1,"s":"a}', '"}' + "\n[1,", '2]', "\n\"x\" 4", "2\n"].each do |fragment|
+    w.write(fragment)
+    parser.feed(r.sysread(fragment.bytesize)) { |v| values << v }
+  end
+  w.close
+  r.close
+  assert_equal [{ "id" => 1, "s" => "a}" }, [1, 2], "x", 42], values
+  assert_equal 0, parser.buffered_bytes
+end
+
+assert("JSON::IncrementalParser - max_buffer") do
+  parser = JSON::IncrementalParser.new(max_buffer: 16)
+  assert_equal [[1], [2]], parser.feed("[1]\n[2]\n")
+  assert_equal [], parser.feed("[3,4,5,6,7,8")
+  assert_raise(JSON::CapacityError) { parser.feed(",9,10") }
+  assert_equal 0, parser.buffered_bytes
+  assert_equal [{ "ok" => true }], parser.feed('{"ok":true}')
+  assert_raise(JSON::CapacityError) { parser.feed("[#{([1] * 20).join(',')}]") }
+  assert_equal [[1]], parser.feed("[1]")
+  assert_raise(ArgumentError) { JSON::IncrementalParser.new(max_buffer: 0) }
+end
+
+assert("JSON::IncrementalParser - values before a malformed document are returned") do
+  parser = JSON::IncrementalParser.new
+  assert_equal [1, 2], parser.feed(%Q(1\n2\n{"a" 1}\n[3]\n))
+  assert_raise(JSON::ParserError) { parser.feed("[4]") }
+  assert_equal [[3], [4]], parser.feed("")
+end
+
+assert("JSON::IncrementalParser - feed without a block, errors and reset") do
+  parser = JSON::IncrementalParser.new(freeze: true)
+  assert_equal [], parser.feed('{"a":[1,')
+  assert_equal 8, parser.buffered_bytes
+  docs = parser.feed('2]}{"b":null}')
+  assert_equal [{ "a" => [1, 2] }, { "b" => nil }], docs
+  assert_true docs[0].frozen?
+
+  assert_raise(JSON::ParserError) { parser.feed('{"a" 1}') }
+  assert_equal [true], parser.feed("true\n")
+
+  parser.feed('{"partial":')
+  parser.reset
+  assert_equal 0, parser.buffered_bytes
+  assert_equal [1], parser.feed("1\n")
+end
+
+assert("JSON::StreamReader - errors") do
+  File.open("tmp_stream3.json", "w") { |f| f.write('{"a":1,"b":[1,2') }
+  assert_raise(TypeError) { JSON::StreamReader.new("tmp_stream3.json", pointer: "/a").each {} }
+  assert_raise(JSON::NoSuchFieldError) { JSON::StreamReader.new("tmp_stream.json", pointer: "/a").each {} }
+  assert_raise(JSON::IncompleteArrayOrObjectError) do
+    JSON::StreamReader.new("tmp_stream3.json", pointer: "/b").each {}
+  end
+  assert_raise(JSON::InvalidJSONPointerError) { JSON::StreamReader.new("tmp_stream.json", pointer: "a") }
+  assert_raise(ArgumentError) { JSON::StreamReader.new("tmp_stream.json", window: 0) }
+end
+
 # ---------------------------------------------------------
 # native_ext_deserialize
 # ---------------------------------------------------------